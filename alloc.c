@@ -0,0 +1,261 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "alloc.h"
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define HAVE_BACKTRACE
+#endif
+
+#define BACKTRACE_DEPTH (32)
+
+static int audit_mode = ALLOC_AUDIT_OFF;
+static volatile int rendering = 0;
+static pthread_t render_thread;
+static unsigned long render_count = 0;
+
+typedef union _Chunk {
+	union _Chunk *next; /* chunks are kept in a list so the pool can free them */
+	double align; /* items following the header are aligned for any field */
+} Chunk;
+
+typedef struct _PoolItem {
+	struct _PoolItem *next;
+} PoolItem;
+
+struct _Pool {
+	size_t item_size;
+	int capacity; /* total items allocated, in use or not */
+	Chunk *chunks;
+	PoolItem *free_items;
+};
+
+static void audit(size_t size);
+static int pool_grow(Pool pool, int count);
+
+void
+alloc_set_audit(int mode)
+{
+#ifdef HAVE_BACKTRACE
+	void *frames[1];
+	
+	/* the first backtrace() loads libgcc, which allocates; get that out of the way now */
+	if(mode != ALLOC_AUDIT_OFF)
+		backtrace(frames, 1);
+#endif
+	
+	audit_mode = mode;
+}
+
+void
+alloc_enter_render(void)
+{
+	render_thread = pthread_self();
+	rendering = 1;
+}
+
+void
+alloc_leave_render(void)
+{
+	rendering = 0;
+}
+
+unsigned long
+alloc_render_count(void)
+{
+	return render_count;
+}
+
+void *
+ckv_malloc(size_t size)
+{
+	audit(size);
+	return malloc(size);
+}
+
+void *
+ckv_realloc(void *ptr, size_t size)
+{
+	audit(size);
+	return realloc(ptr, size);
+}
+
+void
+ckv_free(void *ptr)
+{
+	free(ptr);
+}
+
+void *
+ckv_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	if(nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	
+	/* shrinking a block doesn't count; Lua only does that when collecting */
+	if(ptr == NULL || nsize > osize)
+		audit(nsize);
+	
+	return realloc(ptr, nsize);
+}
+
+/* POOLS */
+
+Pool
+new_pool(size_t item_size, int capacity)
+{
+	Pool pool = (Pool)malloc(sizeof(struct _Pool));
+	if(pool == NULL)
+		return NULL;
+	
+	/* items double as free list entries, and are packed back to back */
+	if(item_size < sizeof(PoolItem))
+		item_size = sizeof(PoolItem);
+	item_size = (item_size + sizeof(Chunk) - 1) / sizeof(Chunk) * sizeof(Chunk);
+	
+	pool->item_size = item_size;
+	pool->capacity = 0;
+	pool->chunks = NULL;
+	pool->free_items = NULL;
+	
+	if(capacity > 0 && !pool_grow(pool, capacity)) {
+		free(pool);
+		return NULL;
+	}
+	
+	return pool;
+}
+
+void
+free_pool(Pool pool)
+{
+	Chunk *chunk, *next;
+	
+	if(pool == NULL)
+		return;
+	
+	for(chunk = pool->chunks; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	
+	free(pool);
+}
+
+int
+pool_reserve(Pool pool, int count)
+{
+	int available = 0;
+	PoolItem *item;
+	
+	for(item = pool->free_items; item != NULL && available < count; item = item->next)
+		available++;
+	
+	if(available >= count)
+		return 1;
+	
+	return pool_grow(pool, count - available);
+}
+
+void *
+pool_alloc(Pool pool)
+{
+	PoolItem *item;
+	
+	/* out of items; double the pool (this allocation is audited) */
+	if(pool->free_items == NULL && !pool_grow(pool, pool->capacity > 0 ? pool->capacity : 1))
+		return NULL;
+	
+	item = pool->free_items;
+	pool->free_items = item->next;
+	
+	return item;
+}
+
+void
+pool_free(Pool pool, void *item)
+{
+	PoolItem *pool_item = (PoolItem *)item;
+	
+	if(item == NULL)
+		return;
+	
+	pool_item->next = pool->free_items;
+	pool->free_items = pool_item;
+}
+
+void
+pool_foreach_free(Pool pool, void (*fn)(void *item))
+{
+	PoolItem *item, *next;
+	
+	if(pool == NULL)
+		return;
+	
+	for(item = pool->free_items; item != NULL; item = next) {
+		next = item->next;
+		fn(item);
+	}
+}
+
+/* PRIVATE HELPERS */
+
+static
+void
+audit(size_t size)
+{
+	if(!rendering || !pthread_equal(pthread_self(), render_thread))
+		return;
+	
+	render_count++;
+	
+	if(audit_mode == ALLOC_AUDIT_OFF)
+		return;
+	
+	fprintf(stderr, "[ckv] audio thread allocated %lu bytes\n", (unsigned long)size);
+	
+#ifdef HAVE_BACKTRACE
+	{
+		void *frames[BACKTRACE_DEPTH];
+		int depth = backtrace(frames, BACKTRACE_DEPTH);
+		backtrace_symbols_fd(frames + 1, depth - 1, 2 /* stderr */);
+	}
+#endif
+	
+	if(audit_mode == ALLOC_AUDIT_ABORT)
+		abort();
+}
+
+/* adds count items to the pool in a single chunk; returns 0 on failure */
+static
+int
+pool_grow(Pool pool, int count)
+{
+	int i;
+	char *items;
+	Chunk *chunk;
+	
+	chunk = (Chunk *)ckv_malloc(sizeof(Chunk) + pool->item_size * count);
+	if(chunk == NULL)
+		return 0;
+	
+	/* new items start zeroed, so users can tell a fresh item from a recycled one */
+	memset(chunk, 0, sizeof(Chunk) + pool->item_size * count);
+	
+	chunk->next = pool->chunks;
+	pool->chunks = chunk;
+	
+	items = (char *)(chunk + 1);
+	for(i = 0; i < count; i++)
+		pool_free(pool, items + i * pool->item_size);
+	
+	pool->capacity += count;
+	
+	return 1;
+}
@@ -0,0 +1,47 @@
+
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+/*
+
+memory allocation for ckv.
+
+everything ckv allocates while it runs goes through ckv_malloc() (or
+ckv_lua_alloc(), the allocator given to Lua), so allocations made by
+the thread that is rendering audio can be counted, reported with a
+backtrace, or made fatal. that is how a patch is shown to be real-time
+safe before it is played live.
+
+pools are free lists of fixed-size items for structures that are
+created and destroyed while rendering (shreds, events). reserving a
+pool up front means the audio thread only ever recycles memory.
+
+*/
+
+/* what to do about an allocation made while rendering */
+#define ALLOC_AUDIT_OFF (0) /* just count it */
+#define ALLOC_AUDIT_REPORT (1) /* print it to stderr with a backtrace */
+#define ALLOC_AUDIT_ABORT (2) /* report it, then abort() */
+
+void alloc_set_audit(int mode);
+void alloc_enter_render(void); /* the calling thread has started rendering audio */
+void alloc_leave_render(void); /* ... and has stopped */
+unsigned long alloc_render_count(void); /* number of allocations made while rendering */
+
+void *ckv_malloc(size_t size);
+void *ckv_realloc(void *ptr, size_t size);
+void ckv_free(void *ptr);
+void *ckv_lua_alloc(void *ud, void *ptr, size_t osize, size_t nsize); /* a lua_Alloc */
+
+typedef struct _Pool *Pool;
+
+Pool new_pool(size_t item_size, int capacity);
+void free_pool(Pool pool); /* frees every item, including those still in use */
+int pool_reserve(Pool pool, int count); /* makes sure count items can be taken without allocating; returns 0 on failure */
+void *pool_alloc(Pool pool); /* takes an item, growing the pool if it is empty */
+void pool_free(Pool pool, void *item); /* returns an item to the pool */
+void pool_foreach_free(Pool pool, void (*fn)(void *item)); /* calls fn on every item not in use, to free what pooled items own */
+
+#endif
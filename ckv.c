@@ -8,6 +8,7 @@
 
 #include "ckv.h"
 #include "ckvm.h"
+#include "alloc.h"
 #include "ckvaudio/audio.h"
 #include "ckvmidi/midi.h"
 #include "pq.h"
@@ -28,12 +29,14 @@ static
 void
 usage(void)
 {
-	printf("usage: ckv [-has] [file ...]\n");
+	printf("usage: ckv [-hasA] [-m N] [-c V] [-p N] [file ...]\n");
 	printf("  -h     print this usage information\n");
 	printf("  -a     load all Lua libraries (enough to shoot yourself in the foot), including file IO\n");
 	printf("  -s     silent mode (no audio processing, no MIDI, non-real-time)\n");
 	printf("  -m N   listen on MIDI port N\n");
 	printf("  -c V   hard clip audio output at +/-V\n");
+	printf("  -p N   reserve memory for N shreds and events up front, so the audio thread doesn't allocate\n");
+	printf("  -A     report every allocation on the audio thread, with a backtrace (-AA aborts instead)\n");
 }
 
 static
@@ -50,6 +53,15 @@ error_callback(CKVM vm, const char *message)
 	print_error(message);
 }
 
+/* summarize what the allocation audit found */
+static
+void
+print_audit(int audit)
+{
+	if(audit != ALLOC_AUDIT_OFF)
+		fprintf(stderr, "[ckv] %lu allocations on the audio thread\n", alloc_render_count());
+}
+
 /* read all of the given stream into memory */
 static
 char *
@@ -223,6 +235,8 @@ main(int argc, char *argv[])
 	int all_libs = 0; /* whether to load all lua standard libraries */
 	int sample_rate = 44100;
 	int midi_port = -1;
+	int reserve = 0; /* shreds and events to pre-allocate */
+	int audit = ALLOC_AUDIT_OFF;
 	
 	vm.ckvm = ckvm_create(error_callback);
 	if(vm.ckvm == NULL) {
@@ -233,7 +247,7 @@ main(int argc, char *argv[])
 	vm.audio = NULL;
 	vm.midi = NULL;
 	
-	while((c = getopt(argc, (char ** const) argv, "hsam:c:")) != -1)
+	while((c = getopt(argc, (char ** const) argv, "hsam:c:p:A")) != -1)
 		switch(c) {
 		case 'h':
 			usage();
@@ -250,8 +264,22 @@ main(int argc, char *argv[])
 		case 'c':
 			hard_clip = atof(optarg);
 			break;
+		case 'p':
+			reserve = atoi(optarg);
+			break;
+		case 'A':
+			if(audit < ALLOC_AUDIT_ABORT)
+				audit++; /* if used more than once, aborts on the first allocation */
+			break;
 		}
 	
+	if(reserve > 0 && !ckvm_reserve(vm.ckvm, reserve)) {
+		print_error("could not reserve memory for shreds");
+		return EXIT_FAILURE;
+	}
+	
+	alloc_set_audit(audit);
+	
 	/* libraries must be loaded before any scripts which use them */
 	
 	open_base_libs(&vm, all_libs);
@@ -262,6 +290,12 @@ main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 	
+	/* without a sound card nothing has to keep up, so ugens may wait on other threads (see SndIn) */
+	if(silent_mode) {
+		lua_pushboolean(ckvm_global_state(vm.ckvm), 1);
+		lua_setfield(ckvm_global_state(vm.ckvm), LUA_REGISTRYINDEX, "offline");
+	}
+	
 	if(midi_port != -1) {
 		vm.midi = ckvmidi_open(vm.ckvm);
 		if(vm.midi == NULL) {
@@ -301,7 +335,7 @@ main(int argc, char *argv[])
 		/* request audio buffers from ckv to advance time */
 		
 		int i;
-		double fakeMicBuffer[512], fakeSpeakerBuffer[512];
+		double fakeMicBuffer[512], fakeSpeakerBuffer[512 * 2 /* stereo */];
 		
 		/* zero the fake mic input buffer (TODO: use memset) */
 		for(i = 0; i < 512; i++) {
@@ -315,6 +349,8 @@ main(int argc, char *argv[])
 				break;
 		}
 		
+		print_audit(audit);
+		
 		ckva_destroy(vm.audio);
 		ckvm_destroy(vm.ckvm);
 		
@@ -343,6 +379,8 @@ main(int argc, char *argv[])
 		/* stop the rtaudio callback */
 		stop_audio();
 		
+		print_audit(audit);
+		
 		ckva_destroy(vm.audio);
 		ckvm_destroy(vm.ckvm);
 		
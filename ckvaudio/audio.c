@@ -1,6 +1,7 @@
 
 #include "audio.h"
 #include "ugen/ugen.h"
+#include "../alloc.h"
 
 #include <stdlib.h>
 
@@ -65,7 +66,7 @@ ckva_fill_buffer(CKVAudio audio, double *outputBuffer, double *inputBuffer, int
 {
 	lua_State *L;
 	int i, c;
-	int oldtop, adc, dac, sinks, ugen_graph, tick_all;
+	int oldtop, adc, dac;
 	double sample;
 
 	if(!ckvm_running(audio->vm)) {
@@ -77,6 +78,8 @@ ckva_fill_buffer(CKVAudio audio, double *outputBuffer, double *inputBuffer, int
 	
 	L = ckvm_global_state(audio->vm);
 	
+	alloc_enter_render();
+	
 	oldtop = lua_gettop(L);
 
 	lua_getglobal(L, "adc");
@@ -85,20 +88,6 @@ ckva_fill_buffer(CKVAudio audio, double *outputBuffer, double *inputBuffer, int
 	lua_getglobal(L, "dac");
 	dac = lua_gettop(L);
 
-	/* sinks */
-	lua_createtable(L, 2 /* array */, 0 /* non-array */);
-	lua_getglobal(L, "dac");
-	lua_rawseti(L, -2, 1);
-	lua_getglobal(L, "blackhole");
-	lua_rawseti(L, -2, 2);
-	sinks = lua_gettop(L);
-
-	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_graph");
-	ugen_graph = lua_gettop(L);
-
-	lua_getfield(L, ugen_graph, "tick_all");
-	tick_all = lua_gettop(L);
-
 	for(i = 0; i < frames; ) {
 		ckvm_run_until(audio->vm, audio->now);
 
@@ -114,10 +103,7 @@ ckva_fill_buffer(CKVAudio audio, double *outputBuffer, double *inputBuffer, int
 		lua_setfield(L, adc, "next");
 
 		/* tick all ugens */
-		lua_pushvalue(L, tick_all);
-		lua_pushvalue(L, ugen_graph);
-		lua_pushvalue(L, sinks);
-		lua_call(L, 2, 0);
+		ugen_tick_all(L);
 
 		/* get sample */
 		lua_getfield(L, dac, "last");
@@ -147,6 +133,8 @@ ckva_fill_buffer(CKVAudio audio, double *outputBuffer, double *inputBuffer, int
 	}
 
 	lua_settop(L, oldtop);
+	
+	alloc_leave_render();
 }
 
 static
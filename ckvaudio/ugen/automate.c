@@ -0,0 +1,367 @@
+
+#include <math.h>
+#include <string.h>
+
+#include "../../ckvm.h"
+#include "../../alloc.h"
+#include "ugen.h"
+
+/*
+
+automation moves a native ugen's field along a path a sample at a time,
+in C, instead of a shred setting it every few milliseconds.
+
+ramp(ugen, field, target, dur, curve, event) moves ugen.field from where
+it is to target over dur samples.
+
+automate(ugen, field, breakpoints, event) moves it through breakpoints, a
+list of {time, value} or {time, value, curve}, with times in samples from
+now (in order): from where it is to the first value, then on to each of
+the others in turn. automate(ugen, field, {}) stops automating the field.
+
+curve shapes a segment: 0 (the default) is a straight line; other numbers
+bend it, starting slowly if positive and quickly if negative, as in
+SuperCollider's Env; "exp" moves by equal ratios, for frequencies (both
+ends must be nonzero and have the same sign).
+
+both return event (by default a new Event), which is broadcast when the
+field gets to its last value, or when another automation of the field
+takes over. the field is set before the ugens are ticked each sample, so
+the first sample of a segment is its start and the last is its end. while
+a field is automated, setting it from Lua has no lasting effect.
+
+*/
+
+typedef struct _Breakpoint {
+	double time; /* samples since the one before */
+	double value;
+	double curve;
+	int exponential;
+} Breakpoint;
+
+typedef struct _Automation {
+	double *field;
+	int ugenRef; /* keeps the ugen alive while it's automated */
+	int eventRef;
+	Breakpoint *points;
+	int count;
+	int next; /* the point being headed for */
+	double from; /* the value the segment started at */
+	double t; /* samples into the segment */
+	double grow, w, scale; /* a curved segment's e^(curve / time), e^(curve * t / time) and 1 / (1 - e^curve) */
+	double ratio, v; /* an exponential segment's (value / from)^(1 / time) and from * ratio^t */
+} Automation;
+
+typedef struct _Automations {
+	Automation *list;
+	int count;
+	int size;
+} Automations;
+
+#define AUTOMATIONS "ckv_automations"
+
+/* args: automations userdata */
+static
+int
+automations_gc(lua_State *L)
+{
+	Automations *automations = (Automations *)lua_touserdata(L, 1);
+	int i;
+	
+	for(i = 0; i < automations->count; i++)
+		ckv_free(automations->list[i].points);
+	ckv_free(automations->list);
+	automations->list = NULL;
+	automations->count = automations->size = 0;
+	
+	return 0;
+}
+
+static
+Automations *
+get_automations(lua_State *L)
+{
+	Automations *automations;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, AUTOMATIONS);
+	automations = (Automations *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	
+	return automations;
+}
+
+/* starts the segment to automation's next point, from where the field is */
+static
+void
+automation_begin(Automation *automation)
+{
+	Breakpoint *point = &automation->points[automation->next];
+	
+	automation->from = *automation->field;
+	automation->t = 0;
+	
+	if(point->exponential) {
+		automation->v = automation->from;
+		if(automation->from * point->value > 0 && point->time > 0)
+			automation->ratio = pow(point->value / automation->from, 1.0 / point->time);
+		else
+			automation->ratio = 1; /* can't get there by ratios: hold, then jump at the end */
+	} else if(point->curve != 0 && point->time > 0) {
+		automation->grow = exp(point->curve / point->time);
+		automation->w = 1;
+		automation->scale = 1 / (1 - exp(point->curve));
+	}
+}
+
+/* sets the field for this sample and moves along; returns 1 once it's at the last point */
+static
+int
+automation_step(Automation *automation)
+{
+	Breakpoint *point = &automation->points[automation->next];
+	
+	/* a segment ends on the sample its time is up, and the next one starts there */
+	while(automation->t >= point->time) {
+		*automation->field = point->value;
+		if(++automation->next == automation->count)
+			return 1;
+		automation_begin(automation);
+		point++;
+	}
+	
+	if(point->exponential) {
+		*automation->field = automation->v;
+		automation->v *= automation->ratio;
+	} else if(point->curve != 0) {
+		*automation->field = automation->from + (point->value - automation->from) * (1 - automation->w) * automation->scale;
+		automation->w *= automation->grow;
+	} else {
+		*automation->field = automation->from + (point->value - automation->from) * automation->t / point->time;
+	}
+	automation->t += 1;
+	
+	return 0;
+}
+
+/* takes automations->list[i] off the list, broadcasting its event */
+static
+void
+automation_end(lua_State *L, Automations *automations, int i)
+{
+	Automation automation = automations->list[i];
+	
+	automations->list[i] = automations->list[--automations->count];
+	
+	ckv_free(automation.points);
+	luaL_unref(L, LUA_REGISTRYINDEX, automation.ugenRef);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, automation.eventRef);
+	ckvm_broadcast(L, lua_gettop(L));
+	lua_pop(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, automation.eventRef);
+}
+
+void
+automate_tick(lua_State *L)
+{
+	Automations *automations = get_automations(L);
+	int i;
+	
+	if(automations == NULL)
+		return;
+	
+	for(i = 0; i < automations->count; i++) {
+		if(automation_step(&automations->list[i]))
+			automation_end(L, automations, i--);
+	}
+}
+
+/* returns the field called name of the native ugen at index, raising an error if it has none */
+static
+double *
+check_field(lua_State *L, int index, const char *name)
+{
+	UGen *ugen = ugen_test(L, index);
+	const UGenField *field;
+	
+	if(ugen == NULL)
+		luaL_typerror(L, index, "native ugen");
+	
+	for(field = ugen->cls->fields; field != NULL && field->name != NULL; field++)
+		if(strcmp(field->name, name) == 0)
+			return (double *)((char *)ugen + field->offset);
+	
+	luaL_error(L, "%s has no field %s", ugen->cls->name, name);
+	return NULL;
+}
+
+/* reads a curve (a number or "exp") at index into point */
+static
+void
+check_curve(lua_State *L, int index, Breakpoint *point)
+{
+	point->curve = 0;
+	point->exponential = 0;
+	
+	if(lua_type(L, index) == LUA_TSTRING) {
+		if(strcmp(lua_tostring(L, index), "exp") != 0)
+			luaL_error(L, "unknown curve \"%s\"", lua_tostring(L, index));
+		point->exponential = 1;
+	} else if(!lua_isnoneornil(L, index)) {
+		point->curve = luaL_checknumber(L, index);
+	}
+}
+
+/*
+automates field, of the ugen at index, through points (which it takes), broadcasting
+the Event at event when it's done, and pushes the Event
+*/
+static
+void
+automate_field(lua_State *L, int index, double *field, Breakpoint *points, int count, int event)
+{
+	Automations *automations = get_automations(L);
+	Automation *automation, *list;
+	int i;
+	
+	/* a field only follows one path at a time */
+	for(i = 0; i < automations->count; i++) {
+		if(automations->list[i].field == field) {
+			automation_end(L, automations, i);
+			break;
+		}
+	}
+	
+	if(lua_isnoneornil(L, event))
+		ckvm_push_new_event(L);
+	else
+		lua_pushvalue(L, event);
+	
+	if(count == 0) {
+		ckv_free(points);
+		return;
+	}
+	
+	if(automations->count == automations->size) {
+		list = (Automation *)ckv_realloc(automations->list, sizeof(Automation) * (automations->size * 2 + 4));
+		if(list == NULL) {
+			ckv_free(points);
+			luaL_error(L, "out of memory automating a field");
+		}
+		automations->list = list;
+		automations->size = automations->size * 2 + 4;
+	}
+	
+	automation = &automations->list[automations->count++];
+	automation->field = field;
+	automation->points = points;
+	automation->count = count;
+	automation->next = 0;
+	lua_pushvalue(L, -1);
+	automation->eventRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, index);
+	automation->ugenRef = luaL_ref(L, LUA_REGISTRYINDEX);
+	automation_begin(automation);
+}
+
+/* reads the breakpoint at index into point, raising an error if it isn't one */
+static
+void
+check_breakpoint(lua_State *L, int index, int i, Breakpoint *point)
+{
+	lua_rawgeti(L, index, i);
+	if(!lua_istable(L, -1))
+		luaL_error(L, "breakpoint %d isn't a table", i);
+	
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, -2, 2);
+	lua_rawgeti(L, -3, 3);
+	point->time = lua_tonumber(L, -3);
+	point->value = lua_tonumber(L, -2);
+	check_curve(L, lua_gettop(L), point);
+	lua_pop(L, 4);
+}
+
+/* args: ugen, field, target, dur, curve (default 0), event (optional) */
+static
+int
+ckv_ramp(lua_State *L)
+{
+	double *field = check_field(L, 1, luaL_checkstring(L, 2));
+	Breakpoint target, *point;
+	
+	target.value = luaL_checknumber(L, 3);
+	target.time = luaL_checknumber(L, 4);
+	check_curve(L, 5, &target);
+	
+	point = (Breakpoint *)ckv_malloc(sizeof(Breakpoint));
+	if(point == NULL)
+		return luaL_error(L, "out of memory automating a field");
+	*point = target;
+	
+	automate_field(L, 1, field, point, 1, 6);
+	
+	return 1;
+}
+
+/* args: ugen, field, breakpoints, event (optional) */
+static
+int
+ckv_automate(lua_State *L)
+{
+	double *field = check_field(L, 1, luaL_checkstring(L, 2));
+	Breakpoint point, *points;
+	double previous = 0;
+	int i, count;
+	
+	luaL_checktype(L, 3, LUA_TTABLE);
+	count = lua_objlen(L, 3);
+	
+	/* check them all first, so an error can't leak the copy */
+	for(i = 1; i <= count; i++) {
+		check_breakpoint(L, 3, i, &point);
+		if(point.time < previous)
+			return luaL_error(L, "breakpoint %d is before the one before it", i);
+		previous = point.time;
+	}
+	
+	points = (Breakpoint *)ckv_malloc(sizeof(Breakpoint) * (count > 0 ? count : 1));
+	if(points == NULL)
+		return luaL_error(L, "out of memory automating a field");
+	
+	/* times are kept from one point to the next */
+	previous = 0;
+	for(i = 0; i < count; i++) {
+		check_breakpoint(L, 3, i + 1, &points[i]);
+		points[i].time -= previous;
+		previous += points[i].time;
+	}
+	
+	automate_field(L, 1, field, points, count, 4);
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_automate(lua_State *L)
+{
+	Automations *automations;
+	
+	automations = (Automations *)lua_newuserdata(L, sizeof(Automations));
+	automations->list = NULL;
+	automations->count = automations->size = 0;
+	lua_newtable(L);
+	lua_pushcfunction(L, automations_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, AUTOMATIONS);
+	
+	lua_pushcfunction(L, ckv_ramp);
+	lua_setglobal(L, "ramp");
+	
+	lua_pushcfunction(L, ckv_automate);
+	lua_setglobal(L, "automate");
+	
+	return 0;
+}
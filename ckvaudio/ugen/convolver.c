@@ -0,0 +1,571 @@
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../../alloc.h"
+#include "ugen.h"
+#include "fft.h"
+#include "ring.h"
+#include "sndin.h"
+#include "vmath.h"
+
+/*
+
+Convolver(filename, block) convolves its input with the impulse response
+in filename (any file SndIn can play, decoded the same way and through
+the same cache), for reverbs from recorded spaces: connect a bus to it,
+and it to the speaker.
+
+convolving a sample at a time with a second-long response would take
+44100 multiplies a sample, so it's done by FFT instead, a block at a time
+(uniformly partitioned overlap-save convolution): the response is cut
+into partitions a block long, and each block of input's spectrum is
+multiplied by each partition's, and summed with the blocks before it.
+
+the first 32 partitions (the head) are convolved on the audio thread,
+block samples (64 by default; a power of two) at a time, so the output
+lags the input by block samples (the "latency" field). the rest (the
+tail) is convolved in partitions 16 times as long, which is much cheaper
+per sample, by a thread of the convolver's own. the tail starts 2 of its
+partitions into the response, so the thread has one partition's time to
+do each before it's heard. the audio never waits for the thread: if it
+ever falls behind, that part of the tail is left out of the output, and
+counted in the "late" field (or, when rendering offline with -s, the
+convolver waits for it).
+
+each channel of the response convolves the input to one output:
+convolver[c] (or convolver:output(c)) is a ugen for channel c, and the
+convolver's own output is their average. so a stereo response makes a
+mono bus into a stereo reverb.
+
+fields: gain (also a port), late, and filename, latency, channels and
+length (of the response, in samples)
+
+methods:
+  convolver:output(c)  returns a ugen for channel c (numbered from 1)
+
+*/
+
+#define DEFAULT_BLOCK (64)
+#define HEAD_PARTITIONS (32)
+#define TAIL_RATIO (16) /* how many times longer the tail's partitions are than the head's */
+#define SLOTS (4) /* tail blocks queued for (or coming back from) the thread */
+
+/* a uniformly partitioned convolution, of every channel of part of a response */
+typedef struct _Partitions {
+	int block; /* samples in a partition, and in a block of input */
+	int count; /* partitions */
+	int channels;
+	FFT *fft; /* of 2 blocks */
+	double *response; /* the partitions' spectra, by channel then partition: block + 1 real parts, then as many imaginary ones */
+	double *spectra; /* the last count blocks of input's spectra (likewise), a ring */
+	int newest; /* its newest */
+	double *input; /* the last 2 blocks of input */
+	double *re, *im, *time; /* scratch */
+} Partitions;
+
+/* the part convolved by the convolver's thread */
+typedef struct _Tail {
+	Partitions parts; /* only used by the thread */
+	int block;
+	int channels;
+	double *in; /* SLOTS blocks of input; job k's is in slot k % SLOTS */
+	double *out; /* SLOTS blocks of output (channels blocks each), likewise */
+	long stamps[SLOTS]; /* the job whose input each slot has; if it isn't that slot's next job, that job was dropped */
+
+	/* with LOAD and STORE: the convolver only writes submitted, and the thread finished */
+	long submitted, finished; /* jobs */
+
+	/* under lock, which the convolver only waits for offline; otherwise it just tries to take it */
+	pthread_mutex_t lock;
+	pthread_cond_t wake; /* signalled when a job is submitted, or the thread should quit */
+	pthread_cond_t done; /* signalled when one is finished */
+	int quit;
+
+	/* only used by the convolver */
+	pthread_t thread;
+	int started;
+	int fill; /* samples in the block being submitted */
+	int dropping; /* its slot was still in use, so it's being left out */
+	int waking; /* a job was submitted, but the thread hasn't been signalled yet */
+	double *playing; /* the output being played, or NULL if it was late */
+	int offset; /* into it */
+} Tail;
+
+typedef struct _Convolver {
+	UGen ugen;
+	double gain;
+	double late; /* tail blocks left out: not ready in time, or dropped since the thread was behind */
+	int channels;
+	int block;
+	int wait; /* for the thread when it falls behind, rather than leave the tail out */
+	Partitions head;
+	double *in; /* this block of input, so far */
+	double *blockOut; /* the head's output being played (channels blocks) */
+	double *out; /* this sample of each channel */
+	int pos; /* in the block */
+	long t; /* samples ticked */
+	Tail *tail; /* NULL if the response fits in the head */
+} Convolver;
+
+#define PORT_GAIN (1)
+
+static const char *const convolver_ports[] = { "gain", NULL };
+
+static const UGenField convolver_fields[] = {
+	{ "gain", offsetof(Convolver, gain) },
+	{ "late", offsetof(Convolver, late) },
+	{ NULL, 0 }
+};
+
+
+/* PARTITIONED CONVOLUTION */
+
+/*
+sets up parts to convolve with count partitions of block samples of response (frames
+long, of channels channels, a frame at a time), from offset on; returns 0 if out of memory
+*/
+static int
+partitions_init(Partitions *parts, const float *response, long frames, int channels, long offset, int count, int block)
+{
+	int bins = block + 1;
+	int c, q, j;
+	long k;
+	double *spectrum;
+	
+	parts->block = block;
+	parts->count = count;
+	parts->channels = channels;
+	parts->newest = 0;
+	parts->fft = fft_new(2 * block);
+	parts->response = (double *)ckv_malloc(sizeof(double) * (2 * bins * (channels + 1) * count + 2 * block + 2 * bins + 2 * block));
+	if(parts->fft == NULL || parts->response == NULL)
+		return 0;
+	
+	parts->spectra = parts->response + 2 * bins * channels * count;
+	parts->input = parts->spectra + 2 * bins * count;
+	parts->re = parts->input + 2 * block;
+	parts->im = parts->re + bins;
+	parts->time = parts->im + bins;
+	memset(parts->spectra, 0, sizeof(double) * (2 * bins * count + 2 * block));
+	
+	/* each partition is padded to 2 blocks, so the last block of a circular convolution is linear */
+	for(c = 0; c < channels; c++) {
+		for(q = 0; q < count; q++) {
+			for(j = 0; j < 2 * block; j++) {
+				k = offset + (long)q * block + j;
+				parts->time[j] = j < block && k < frames ? response[k * channels + c] : 0;
+			}
+			spectrum = parts->response + 2 * bins * (c * count + q);
+			fft_forward(parts->fft, parts->time, spectrum, spectrum + bins);
+		}
+	}
+	
+	return 1;
+}
+
+static void
+partitions_free(Partitions *parts)
+{
+	fft_free(parts->fft);
+	ckv_free(parts->response);
+	parts->fft = NULL;
+	parts->response = NULL;
+}
+
+/* convolves the next block of input in, putting a block of each channel's output in out */
+static void
+partitions_run(Partitions *parts, const double *in, double *out)
+{
+	int block = parts->block, bins = block + 1, count = parts->count;
+	double *x, *h;
+	int c, q;
+	
+	/* overlap-save: the spectrum of the last 2 blocks of input */
+	memmove(parts->input, parts->input + block, sizeof(double) * block);
+	memcpy(parts->input + block, in, sizeof(double) * block);
+	parts->newest = (parts->newest + 1) % count;
+	x = parts->spectra + 2 * bins * parts->newest;
+	fft_forward(parts->fft, parts->input, x, x + bins);
+	
+	/* partition q is heard q blocks later, so it's multiplied by the spectrum from q blocks ago */
+	for(c = 0; c < parts->channels; c++) {
+		memset(parts->re, 0, sizeof(double) * bins);
+		memset(parts->im, 0, sizeof(double) * bins);
+		for(q = 0; q < count; q++) {
+			x = parts->spectra + 2 * bins * ((parts->newest - q + count) % count);
+			h = parts->response + 2 * bins * (c * count + q);
+			vmath_cmac(parts->re, parts->im, x, x + bins, h, h + bins, bins);
+		}
+		fft_inverse(parts->fft, parts->re, parts->im, parts->time);
+		memcpy(out + c * block, parts->time + block, sizeof(double) * block);
+	}
+}
+
+
+/* THE TAIL'S THREAD */
+
+/* convolves the tail's jobs as they're submitted, until it's told to quit */
+static void *
+tail_thread(void *arg)
+{
+	Tail *tail = (Tail *)arg;
+	long job;
+	int slot;
+	
+	pthread_mutex_lock(&tail->lock);
+	
+	for(;;) {
+		while(!tail->quit && tail->finished == LOAD(&tail->submitted))
+			pthread_cond_wait(&tail->wake, &tail->lock);
+		if(tail->quit)
+			break;
+	
+		job = tail->finished;
+		slot = job % SLOTS;
+		pthread_mutex_unlock(&tail->lock);
+	
+		/* a dropped block is convolved as silence, so the ones after it still line up */
+		if(LOAD(&tail->stamps[slot]) != job)
+			memset(tail->in + slot * tail->block, 0, sizeof(double) * tail->block);
+		partitions_run(&tail->parts, tail->in + slot * tail->block, tail->out + slot * tail->channels * tail->block);
+	
+		pthread_mutex_lock(&tail->lock);
+		STORE(&tail->finished, job + 1);
+		pthread_cond_signal(&tail->done);
+	}
+	
+	pthread_mutex_unlock(&tail->lock);
+	
+	return NULL;
+}
+
+/* stops the tail's thread, and frees it */
+static void
+tail_free(Tail *tail)
+{
+	if(tail->started) {
+		pthread_mutex_lock(&tail->lock);
+		tail->quit = 1;
+		pthread_cond_signal(&tail->wake);
+		pthread_mutex_unlock(&tail->lock);
+		pthread_join(tail->thread, NULL);
+	}
+	
+	pthread_mutex_destroy(&tail->lock);
+	pthread_cond_destroy(&tail->wake);
+	pthread_cond_destroy(&tail->done);
+	partitions_free(&tail->parts);
+	ckv_free(tail->in);
+	ckv_free(tail);
+}
+
+/* signals the thread if a job is waiting for it, and it can be done without blocking (if not, it's tried again next sample) */
+static void
+tail_wake(Tail *tail)
+{
+	if(tail->waking && pthread_mutex_trylock(&tail->lock) == 0) {
+		pthread_cond_signal(&tail->wake);
+		pthread_mutex_unlock(&tail->lock);
+		tail->waking = 0;
+	}
+}
+
+/* waits (offline) until the thread has finished job */
+static void
+tail_wait(Tail *tail, long job)
+{
+	pthread_mutex_lock(&tail->lock);
+	pthread_cond_signal(&tail->wake);
+	tail->waking = 0;
+	while(LOAD(&tail->finished) <= job)
+		pthread_cond_wait(&tail->done, &tail->lock);
+	pthread_mutex_unlock(&tail->lock);
+}
+
+/*
+has the thread convolve the next block of input when it's full; returns 1 if
+a block is being left out, because the thread is too far behind (if wait is
+set, it waits for the thread instead)
+*/
+static int
+tail_push(Tail *tail, double x, int wait)
+{
+	long job = tail->submitted;
+	int slot = job % SLOTS, dropped = 0;
+	
+	/* a slot is reused SLOTS jobs later, long after it's normally finished; if it isn't, this block would be late anyway */
+	if(tail->fill == 0) {
+		if(wait && job - LOAD(&tail->finished) >= SLOTS)
+			tail_wait(tail, job - SLOTS);
+		dropped = tail->dropping = job - LOAD(&tail->finished) >= SLOTS;
+	}
+	
+	if(!tail->dropping)
+		tail->in[slot * tail->block + tail->fill] = x;
+	
+	if(++tail->fill == tail->block) {
+		if(!tail->dropping)
+			STORE(&tail->stamps[slot], job);
+		STORE(&tail->submitted, job + 1);
+		tail->waking = 1;
+		tail->fill = 0;
+	}
+	tail_wake(tail);
+	
+	return dropped;
+}
+
+/* starts playing job's output, if it's finished (or, if wait is set, once it is); returns 0 if it's late */
+static int
+tail_fetch(Tail *tail, long job, int wait)
+{
+	int ready;
+	
+	if(wait && LOAD(&tail->finished) <= job)
+		tail_wait(tail, job);
+	ready = LOAD(&tail->finished) > job;
+	
+	tail->playing = ready ? tail->out + (job % SLOTS) * tail->channels * tail->block : NULL;
+	tail->offset = 0;
+	
+	return ready;
+}
+
+
+/* THE UGEN */
+
+static void
+convolver_tick(UGen *ugen)
+{
+	Convolver *convolver = (Convolver *)ugen;
+	Tail *tail = convolver->tail;
+	double gain = convolver->gain + ugen->in[PORT_GAIN];
+	double x = ugen->in[0], sum = 0, y;
+	long heard = convolver->t - convolver->block; /* the sample of the convolution being heard */
+	int block = convolver->block, c;
+	
+	if(convolver->head.fft == NULL)
+		return; /* it couldn't be set up */
+	
+	/* the tail's job n is heard from 2 of its blocks after its input */
+	if(tail != NULL && heard >= 2 * tail->block && heard % tail->block == 0) {
+		if(!tail_fetch(tail, heard / tail->block - 2, convolver->wait))
+			convolver->late += 1;
+	}
+	
+	for(c = 0; c < convolver->channels; c++) {
+		y = convolver->blockOut[c * block + convolver->pos];
+		if(tail != NULL && tail->playing != NULL)
+			y += tail->playing[c * tail->block + tail->offset];
+		sum += convolver->out[c] = y * gain;
+	}
+	ugen->last = sum / convolver->channels;
+	if(tail != NULL)
+		tail->offset++;
+	
+	convolver->in[convolver->pos] = x;
+	if(tail != NULL && tail_push(tail, x, convolver->wait))
+		convolver->late += 1;
+	if(++convolver->pos == block) {
+		partitions_run(&convolver->head, convolver->in, convolver->blockOut);
+		convolver->pos = 0;
+	}
+	convolver->t++;
+}
+
+static void
+convolver_release(UGen *ugen)
+{
+	Convolver *convolver = (Convolver *)ugen;
+	
+	if(convolver->tail != NULL)
+		tail_free(convolver->tail);
+	partitions_free(&convolver->head);
+	ckv_free(convolver->in);
+	convolver->tail = NULL;
+	convolver->in = NULL;
+}
+
+/* sets up convolver's tail, from offset on in response; returns 0 on failure */
+static int
+convolver_start_tail(Convolver *convolver, const float *response, long frames, long offset)
+{
+	int block = convolver->block * TAIL_RATIO;
+	int channels = convolver->channels;
+	Tail *tail;
+	int i;
+	
+	tail = (Tail *)ckv_malloc(sizeof(Tail));
+	if(tail == NULL)
+		return 0;
+	memset(tail, 0, sizeof(Tail));
+	for(i = 0; i < SLOTS; i++)
+		tail->stamps[i] = -1;
+	pthread_mutex_init(&tail->lock, NULL);
+	pthread_cond_init(&tail->wake, NULL);
+	pthread_cond_init(&tail->done, NULL);
+	tail->block = block;
+	tail->channels = channels;
+	convolver->tail = tail;
+	
+	tail->in = (double *)ckv_malloc(sizeof(double) * SLOTS * block * (channels + 1));
+	if(tail->in == NULL)
+		return 0;
+	tail->out = tail->in + SLOTS * block;
+	
+	if(!partitions_init(&tail->parts, response, frames, channels, offset, (frames - offset + block - 1) / block, block))
+		return 0;
+	
+	if(pthread_create(&tail->thread, NULL, tail_thread, tail) != 0)
+		return 0;
+	tail->started = 1;
+	
+	return 1;
+}
+
+/* loads the response in filename into convolver, and returns its length in samples; raises an error on failure */
+static long
+convolver_open(lua_State *L, Convolver *convolver, const char *filename)
+{
+	int block = convolver->block;
+	long frames, head;
+	int channels, ok;
+	float *response;
+	
+	convolver->tail = NULL;
+	convolver->in = NULL;
+	convolver->head.fft = NULL;
+	convolver->head.response = NULL;
+	convolver->pos = 0;
+	convolver->t = 0;
+	
+	response = sndin_load(filename, convolver->ugen.sample_rate, &frames, &channels);
+	if(response == NULL)
+		luaL_error(L, "could not open file \"%s\"", filename);
+	convolver->channels = channels;
+	
+	convolver->in = (double *)ckv_malloc(sizeof(double) * (block * (channels + 1) + channels));
+	ok = convolver->in != NULL;
+	if(ok) {
+		convolver->blockOut = convolver->in + block;
+		convolver->out = convolver->blockOut + block * channels;
+		memset(convolver->in, 0, sizeof(double) * (block * (channels + 1) + channels));
+	}
+	
+	head = frames < (long)HEAD_PARTITIONS * block ? frames : (long)HEAD_PARTITIONS * block;
+	ok = ok && partitions_init(&convolver->head, response, frames, channels, 0, (head + block - 1) / block, block);
+	if(ok && frames > head)
+		ok = convolver_start_tail(convolver, response, frames, head);
+	
+	ckv_free(response);
+	
+	if(!ok) {
+		convolver_release(&convolver->ugen);
+		luaL_error(L, "out of memory loading \"%s\"", filename);
+	}
+	
+	return frames;
+}
+
+static double
+convolver_read(UGen *ugen, int c)
+{
+	return ((Convolver *)ugen)->out[c];
+}
+
+/* a copy loads the response again (from the cache), starts out silent, and has its own "outputs" */
+static void
+convolver_copy(lua_State *L, UGen *ugen, int index)
+{
+	Convolver *convolver = (Convolver *)ugen;
+	
+	/* the original's, until convolver_open has its own */
+	convolver->tail = NULL;
+	convolver->in = NULL;
+	convolver->head.fft = NULL;
+	convolver->head.response = NULL;
+	convolver->late = 0;
+	
+	lua_newtable(L);
+	lua_setfield(L, index, "outputs");
+	
+	lua_getfield(L, index, "filename");
+	convolver_open(L, convolver, luaL_checkstring(L, -1));
+	lua_pop(L, 1);
+}
+
+static int convolver_output(lua_State *L);
+
+static const luaL_Reg convolver_methods[] = {
+	{ "output", convolver_output },
+	{ NULL, NULL }
+};
+
+static const UGenClass convolver_class = { "Convolver", sizeof(Convolver), convolver_ports, convolver_fields, convolver_methods, convolver_tick, convolver_release, convolver_copy };
+
+/* args: self, channel */
+static int
+convolver_output(lua_State *L)
+{
+	Convolver *convolver = (Convolver *)ugen_check(L, 1, &convolver_class);
+	int c = luaL_checkint(L, 2) - 1;
+	
+	luaL_argcheck(L, c >= 0 && c < convolver->channels, 2, "no such channel");
+	ugen_push_output(L, 1, "convolver", c, convolver_read);
+	
+	return 1;
+}
+
+/* args: filename, block (default 64) */
+static int
+new_convolver(lua_State *L)
+{
+	const char *filename = luaL_checkstring(L, 1);
+	int block = luaL_optint(L, 2, DEFAULT_BLOCK);
+	Convolver *convolver;
+	long length;
+	int self;
+	
+	luaL_argcheck(L, block >= 8 && (block & (block - 1)) == 0, 2, "block must be a power of two, at least 8");
+	
+	convolver = (Convolver *)ugen_new(L, &convolver_class);
+	self = lua_gettop(L);
+	convolver->gain = 1;
+	convolver->block = block;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "offline");
+	convolver->wait = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	
+	length = convolver_open(L, convolver, filename);
+	
+	lua_pushvalue(L, 1);
+	lua_setfield(L, self, "filename");
+	
+	lua_pushnumber(L, block);
+	lua_setfield(L, self, "latency");
+	
+	lua_pushnumber(L, convolver->channels);
+	lua_setfield(L, self, "channels");
+	
+	lua_pushnumber(L, length);
+	lua_setfield(L, self, "length");
+	
+	lua_newtable(L);
+	lua_setfield(L, self, "outputs");
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_convolver(lua_State *L)
+{
+	lua_pushcfunction(L, new_convolver);
+	lua_setglobal(L, "Convolver");
+	
+	return 0;
+}
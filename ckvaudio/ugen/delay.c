@@ -1,141 +1,197 @@
 
-#include <stdlib.h>
-#include <math.h>
+#include <stddef.h>
+#include <string.h>
 
-#include "../../ckvm.h"
+#include "../../alloc.h"
 #include "ugen.h"
 
-
 /*
-the amount size of the array used for the delay line is
-DELAY_BUFFER_PAD_FACTOR * LENGTH. when the array fills, all the
-values are shifted over so only LENGTH remain. larger values mean
-that the shifting happens less frequently, but will take longer.
-I have not tweaked this value to find the perfect balance.
+
+Delay(delay, max): a delay line, delay samples long (about 100 ms by
+default), which can be set as long as max (delay, by default).
+
+its delay field, plus its "delay" port, can be changed every sample, and
+may be fractional: the line is read between samples by linear
+interpolation. delay:tap(delay) returns a ugen that reads the same line at
+its own delay (a field and port like the Delay's), for chorus, flangers
+and comb banks; connecting a tap back to its delay's input makes a
+feedback loop.
+
+the line is a ring buffer whose size is a power of two, so moving along it
+is an increment and a mask.
+
 */
-#define DELAY_BUFFER_PAD_FACTOR (2)
 
 typedef struct _Delay {
+	UGen ugen;
+	double delay; /* in samples */
+	double max;
 	double *buffer;
-	int delay_length;
-	int ptr;
-	int size;
+	unsigned int mask; /* the buffer's size, less 1 */
+	unsigned int newest; /* where the last sample written is */
 } Delay;
 
-/* args: self */
-static
-int
-ckv_delay_tick(lua_State *L)
+typedef struct _DelayTap {
+	UGen ugen;
+	double delay;
+	Delay *line;
+} DelayTap;
+
+#define PORT_DELAY (1)
+
+#define MAX_DELAY (1 << 28) /* samples */
+
+static const char *const delay_ports[] = { "delay", NULL };
+
+static const UGenField delay_fields[] = {
+	{ "delay", offsetof(Delay, delay) },
+	{ NULL, 0 }
+};
+
+static const UGenField tap_fields[] = {
+	{ "delay", offsetof(DelayTap, delay) },
+	{ NULL, 0 }
+};
+
+/* reads the line delay samples before the newest sample (0 is the newest), clamped to its length */
+static double
+delay_read(Delay *line, double delay)
 {
-	Delay *delay;
-	lua_Number last_value, sample;
-	int i;
+	unsigned int i;
+	double frac, a, b;
 	
-	luaL_checktype(L, 1, LUA_TTABLE);
+	if(delay < 0)
+		delay = 0;
+	if(delay > line->max)
+		delay = line->max;
 	
-	lua_getfield(L, -1, "obj");
-	delay = (Delay *)lua_touserdata(L, -1);
-	lua_pop(L, 1);
+	i = (unsigned int)delay;
+	frac = delay - i;
+	a = line->buffer[(line->newest - i) & line->mask];
+	b = line->buffer[(line->newest - i - 1) & line->mask];
 	
-	last_value = 0.0;
-	if(delay->ptr - delay->delay_length >= 0)
-		last_value = delay->buffer[delay->ptr - delay->delay_length];
+	return a + (b - a) * frac;
+}
+
+static void
+delay_tick(UGen *ugen)
+{
+	Delay *line = (Delay *)ugen;
 	
-	/* get the latest input sample */
-	ckvm_pushstdglobal(L, "UGen");
-	lua_getfield(L, -1, "sum_inputs");
-	lua_pushvalue(L, 1);
-	lua_call(L, 1, 1);
-	sample = lua_tonumber(L, -1);
-	lua_pop(L, 2); /* pop sample and UGen */
+	line->newest = (line->newest + 1) & line->mask;
+	line->buffer[line->newest] = ugen->in[0];
 	
-	/* if we've reached the end of the buffer, move everything to the beginning */
-	if(delay->ptr == delay->size) {
-		for(i = 0; i < delay->delay_length; i++)
-			delay->buffer[i] = delay->buffer[delay->size - 1 - delay->delay_length + i];
-		delay->ptr = delay->delay_length;
-	}
+	ugen->last = delay_read(line, line->delay + ugen->in[PORT_DELAY]);
+}
+
+static void
+delay_release(UGen *ugen)
+{
+	Delay *line = (Delay *)ugen;
+	ckv_free(line->buffer);
+}
+
+/* allocates the buffer for line->max, raising an error if it can't */
+static void
+delay_alloc(lua_State *L, Delay *line)
+{
+	unsigned int size = 2;
 	
-	/* add current sample to the delay line */
-	delay->buffer[delay->ptr++] = sample;
+	/* room for the longest delay, plus the sample after it to interpolate with */
+	while(size < line->max + 2)
+		size *= 2;
 	
-	lua_pushnumber(L, last_value);
-	lua_setfield(L, 1, "last");
+	line->buffer = (double *)ckv_malloc(sizeof(double) * size);
+	if(line->buffer == NULL)
+		luaL_error(L, "out of memory allocating a delay line");
+	line->mask = size - 1;
+}
+
+/* a copy starts out with the original's samples */
+static void
+delay_copy(lua_State *L, UGen *ugen, int index)
+{
+	Delay *line = (Delay *)ugen;
+	double *original = line->buffer;
 	
-	return 0;
+	delay_alloc(L, line);
+	memcpy(line->buffer, original, sizeof(double) * (line->mask + 1));
 }
 
-/* args: delay obj */
-static
-int
-ckv_delay_release(lua_State *L)
+static void
+tap_tick(UGen *ugen)
+{
+	DelayTap *tap = (DelayTap *)ugen;
+	ugen->last = delay_read(tap->line, tap->delay + ugen->in[PORT_DELAY]);
+}
+
+static const UGenClass delay_class;
+
+/* a copy reads the line in its "line" field (the copy of the original's, if that was copied too) */
+static void
+tap_copy(lua_State *L, UGen *ugen, int index)
 {
-	Delay *delay = (Delay *)lua_touserdata(L, 1);
-	free(delay->buffer);
-	free(delay);
+	DelayTap *tap = (DelayTap *)ugen;
 	
-	return 0;
+	lua_getfield(L, index, "line");
+	tap->line = (Delay *)ugen_check(L, -1, &delay_class);
+	lua_pop(L, 1);
 }
 
-static
-const
-luaL_Reg
-ckvugen_delay[] = {
-	{ "tick", ckv_delay_tick },
+static int delay_tap(lua_State *L);
+
+static const luaL_Reg delay_methods[] = {
+	{ "tap", delay_tap },
 	{ NULL, NULL }
 };
 
-/* args: Delay (class), filename */
-static
-int
-ckv_delay_new(lua_State *L)
+static const UGenClass delay_class = { "Delay", sizeof(Delay), delay_ports, delay_fields, delay_methods, delay_tick, delay_release, delay_copy };
+static const UGenClass tap_class = { "DelayTap", sizeof(DelayTap), delay_ports, tap_fields, NULL, tap_tick, NULL, tap_copy };
+
+/* args: line, delay (default the line's) */
+static int
+delay_tap(lua_State *L)
+{
+	Delay *line = (Delay *)ugen_check(L, 1, &delay_class);
+	double delay = luaL_optnumber(L, 2, line->delay);
+	DelayTap *tap;
+	
+	tap = (DelayTap *)ugen_new(L, &tap_class);
+	tap->delay = delay;
+	tap->line = line;
+	
+	/* it reads what the line wrote this sample, so it's ticked after it and keeps it alive */
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "line");
+	ugen_connect(L, 1, lua_gettop(L), 0);
+	
+	return 1;
+}
+
+/* args: delay (default about 100 ms), max (default delay) */
+static int
+new_delay(lua_State *L)
 {
-	Delay *delay;
-	lua_Number delay_amount = 0;
-	
-	delay = (Delay *)malloc(sizeof(struct _Delay));
-	if(delay == NULL) {
-		fprintf(stderr, "[ckv] memory error allocating Delay\n");
-		return 0;
-	}
-	
-	/* if they provided a delay length use that; otherwise default to about 100ms */
-	if(lua_isnumber(L, 1)) {
-		delay_amount = lua_tonumber(L, 1);
-		if(delay_amount < 0)
-			delay_amount = 0;
-	} else {
-		ckvm_pushstdglobal(L, "sample_rate");
-		delay_amount = lua_tonumber(L, -1) / 10.0; /* ~100 ms */
-		lua_pop(L, 1);
-	}
-	
-	delay->delay_length = ceil(delay_amount);
-	delay->size = delay_amount * DELAY_BUFFER_PAD_FACTOR;
-	delay->ptr = 0;
-	
-	delay->buffer = (lua_Number *)malloc(sizeof(lua_Number) * delay->size);
-	if(delay->buffer == NULL) {
-		fprintf(stderr, "[ckv] memory error allocating Delay buffer\n");
-		free(delay);
-		return 0;
-	}
-	
-	lua_createtable(L, 0 /* array */, 2 /* non-array */);             /* stack: delay */
-	lua_pushlightuserdata(L, delay);                                  /* stack: delay, delay struct */
-	lua_createtable(L, 0 /* array */, 1 /* non-array */);             /* stack: delay, delay struct, metatable */
-	lua_pushcfunction(L, ckv_delay_release);                          /* stack: delay, delay struct, metatable, destructor */
-	lua_setfield(L, -2, "__gc"); /* metatable[__gc] = destructor */   /* stack: delay, delay struct, metatable */
-	lua_setmetatable(L, -2);                                          /* stack: delay, delay struct */
-	lua_setfield(L, -2, "obj"); /* delay[obj] = delay struct */       /* stack: delay */
-	
-	luaL_register(L, NULL, ckvugen_delay); /* add delay methods (tick, etc) */
-	
-	/* initialize delay.last to 0.0 */
-	lua_pushnumber(L, 0.0);
-	lua_setfield(L, -2, "last");
-	
-	return 1; /* return self */
+	int has_delay = lua_isnumber(L, 1);
+	double delay = lua_tonumber(L, 1);
+	double max = luaL_optnumber(L, 2, -1);
+	Delay *line;
+	
+	line = (Delay *)ugen_new(L, &delay_class);
+	if(!has_delay)
+		delay = line->ugen.sample_rate / 10.0;
+	if(delay < 0)
+		delay = 0;
+	if(max < delay)
+		max = delay;
+	luaL_argcheck(L, max < MAX_DELAY, 2, "delay too long");
+	
+	line->delay = delay;
+	line->max = max;
+	delay_alloc(L, line);
+	memset(line->buffer, 0, sizeof(double) * (line->mask + 1));
+	
+	return 1;
 }
 
 /* LIBRARY REGISTRATION */
@@ -143,7 +199,7 @@ ckv_delay_new(lua_State *L)
 int
 open_ugen_delay(lua_State *L)
 {
-	lua_pushcfunction(L, ckv_delay_new);
+	lua_pushcfunction(L, new_delay);
 	lua_setglobal(L, "Delay");
 	
 	return 0;
@@ -0,0 +1,302 @@
+
+#include <stddef.h>
+
+#include "../../ckvm.h"
+#include "ugen.h"
+
+/*
+
+envelopes, worked out a sample at a time instead of by a shred waking up
+every few milliseconds to nudge a field. times are in samples. each
+broadcasts its "event" when it finishes a segment that a shred might wait
+for.
+
+ADSR(attack, decay, sustain, release) multiplies its input by an
+attack-decay-sustain-release envelope (by default 10 ms, 100 ms, 0.7 and
+200 ms). adsr:key_on() starts the attack from wherever the envelope is, so
+retriggering doesn't click, and adsr:key_off() starts the release, which
+takes release samples from wherever the envelope is to 0; its event is
+broadcast when the release ends. fields: attack, decay, sustain, release,
+and level (where the envelope is).
+
+Line(from, to, dur) puts out a straight line from from to to, dur samples
+long (0 to 1 over a second by default), and then stays at to; its event is
+broadcast when it gets there. line:go(to, dur) starts a new line from
+wherever it is. fields: value.
+
+Ramp(value, time) puts out value, and whenever its target field is set,
+glides there in a straight line time samples long (50 ms by default),
+from wherever it is; its event is broadcast when it gets there. it's for
+smoothing a parameter that's set from Lua: connect(ramp, osc, "freq").
+fields: target, time, value.
+
+*/
+
+typedef struct _ADSR {
+	UGen ugen;
+	double attack, decay, sustain, release;
+	double level;
+	double releaseStep; /* per sample, from where the release started */
+	int stage;
+} ADSR;
+
+enum { STAGE_IDLE, STAGE_ATTACK, STAGE_DECAY, STAGE_SUSTAIN, STAGE_RELEASE };
+
+typedef struct _Line {
+	UGen ugen;
+	double value;
+	double target, time; /* Ramp's */
+	double to; /* where the line is heading */
+	double step; /* per sample */
+	double remaining; /* samples until it's there */
+} Line;
+
+static const UGenField adsr_fields[] = {
+	{ "attack", offsetof(ADSR, attack) },
+	{ "decay", offsetof(ADSR, decay) },
+	{ "sustain", offsetof(ADSR, sustain) },
+	{ "release", offsetof(ADSR, release) },
+	{ "level", offsetof(ADSR, level) },
+	{ NULL, 0 }
+};
+
+static const UGenField line_fields[] = {
+	{ "value", offsetof(Line, value) },
+	{ NULL, 0 }
+};
+
+static const UGenField ramp_fields[] = {
+	{ "target", offsetof(Line, target) },
+	{ "time", offsetof(Line, time) },
+	{ "value", offsetof(Line, value) },
+	{ NULL, 0 }
+};
+
+static void
+adsr_tick(UGen *ugen)
+{
+	ADSR *adsr = (ADSR *)ugen;
+	
+	ugen->last = ugen->in[0] * adsr->level;
+	
+	/* the steps are worked out from the fields each sample, so they can be changed mid-segment */
+	switch(adsr->stage) {
+	case STAGE_ATTACK:
+		adsr->level += adsr->attack > 1 ? 1.0 / adsr->attack : 1.0;
+		if(adsr->level >= 1.0) {
+			adsr->level = 1.0;
+			adsr->stage = STAGE_DECAY;
+		}
+		break;
+	case STAGE_DECAY:
+		adsr->level -= adsr->decay > 1 ? (1.0 - adsr->sustain) / adsr->decay : 1.0 - adsr->sustain;
+		if(adsr->level <= adsr->sustain) {
+			adsr->level = adsr->sustain;
+			adsr->stage = STAGE_SUSTAIN;
+		}
+		break;
+	case STAGE_SUSTAIN:
+		adsr->level = adsr->sustain;
+		break;
+	case STAGE_RELEASE:
+		adsr->level -= adsr->releaseStep;
+		if(adsr->level <= 0) {
+			adsr->level = 0;
+			adsr->stage = STAGE_IDLE;
+			ugen->signal = 1;
+		}
+		break;
+	}
+}
+
+/* moves line one sample along */
+static void
+line_step(Line *line)
+{
+	if(line->remaining <= 0)
+		return;
+	
+	line->remaining -= 1;
+	if(line->remaining > 0) {
+		line->value += line->step;
+	} else {
+		line->value = line->to;
+		line->ugen.signal = 1;
+	}
+}
+
+/* starts a line from where it is to to, dur samples long (or jumps there, if dur is 0) */
+static void
+line_go(Line *line, double to, double dur)
+{
+	line->to = to;
+	line->remaining = dur;
+	if(dur > 0) {
+		line->step = (to - line->value) / dur;
+	} else {
+		line->value = to;
+		line->remaining = 0;
+		line->ugen.signal = 1;
+	}
+}
+
+static void
+line_tick(UGen *ugen)
+{
+	Line *line = (Line *)ugen;
+	
+	ugen->last = line->value;
+	line_step(line);
+}
+
+static void
+ramp_tick(UGen *ugen)
+{
+	Line *line = (Line *)ugen;
+	
+	if(line->target != line->to)
+		line_go(line, line->target, line->time);
+	
+	ugen->last = line->value;
+	line_step(line);
+}
+
+/* a copy has its own event */
+static void
+envelope_copy(lua_State *L, UGen *ugen, int index)
+{
+	ckvm_push_new_event(L);
+	lua_setfield(L, index, "event");
+}
+
+static int adsr_key_on(lua_State *L);
+static int adsr_key_off(lua_State *L);
+static int line_go_method(lua_State *L);
+
+static const luaL_Reg adsr_methods[] = {
+	{ "key_on", adsr_key_on },
+	{ "key_off", adsr_key_off },
+	{ NULL, NULL }
+};
+
+static const luaL_Reg line_methods[] = {
+	{ "go", line_go_method },
+	{ NULL, NULL }
+};
+
+static const UGenClass adsr_class = { "ADSR", sizeof(ADSR), NULL, adsr_fields, adsr_methods, adsr_tick, NULL, envelope_copy };
+static const UGenClass line_class = { "Line", sizeof(Line), NULL, line_fields, line_methods, line_tick, NULL, envelope_copy };
+static const UGenClass ramp_class = { "Ramp", sizeof(Line), NULL, ramp_fields, NULL, ramp_tick, NULL, envelope_copy };
+
+/* args: self */
+static int
+adsr_key_on(lua_State *L)
+{
+	ADSR *adsr = (ADSR *)ugen_check(L, 1, &adsr_class);
+	adsr->stage = STAGE_ATTACK;
+	
+	return 0;
+}
+
+/* args: self */
+static int
+adsr_key_off(lua_State *L)
+{
+	ADSR *adsr = (ADSR *)ugen_check(L, 1, &adsr_class);
+	
+	if(adsr->stage == STAGE_IDLE)
+		return 0;
+	
+	adsr->stage = STAGE_RELEASE;
+	adsr->releaseStep = adsr->release > 1 ? adsr->level / adsr->release : adsr->level;
+	
+	return 0;
+}
+
+/* args: self, to, dur */
+static int
+line_go_method(lua_State *L)
+{
+	Line *line = (Line *)ugen_check(L, 1, &line_class);
+	line_go(line, luaL_checknumber(L, 2), luaL_checknumber(L, 3));
+	
+	return 0;
+}
+
+/* adds an Event as the ugen on top of the stack's "event" */
+static void
+set_event(lua_State *L)
+{
+	ckvm_push_new_event(L);
+	lua_setfield(L, -2, "event");
+}
+
+/* args: attack (default 10 ms), decay (default 100 ms), sustain (default 0.7), release (default 200 ms) */
+static int
+new_adsr(lua_State *L)
+{
+	double attack = luaL_optnumber(L, 1, -1);
+	double decay = luaL_optnumber(L, 2, -1);
+	double sustain = luaL_optnumber(L, 3, 0.7);
+	double release = luaL_optnumber(L, 4, -1);
+	ADSR *adsr = (ADSR *)ugen_new(L, &adsr_class);
+	double rate = adsr->ugen.sample_rate;
+	
+	adsr->attack = attack >= 0 ? attack : rate * 0.01;
+	adsr->decay = decay >= 0 ? decay : rate * 0.1;
+	adsr->sustain = sustain;
+	adsr->release = release >= 0 ? release : rate * 0.2;
+	adsr->level = 0;
+	adsr->stage = STAGE_IDLE;
+	set_event(L);
+	
+	return 1;
+}
+
+/* args: from (default 0), to (default 1), dur (default a second) */
+static int
+new_line(lua_State *L)
+{
+	double from = luaL_optnumber(L, 1, 0);
+	double to = luaL_optnumber(L, 2, 1);
+	double dur = luaL_optnumber(L, 3, -1);
+	Line *line = (Line *)ugen_new(L, &line_class);
+	
+	line->value = from;
+	line_go(line, to, dur >= 0 ? dur : line->ugen.sample_rate);
+	set_event(L);
+	
+	return 1;
+}
+
+/* args: value (default 0), time (default 50 ms) */
+static int
+new_ramp(lua_State *L)
+{
+	double value = luaL_optnumber(L, 1, 0);
+	double time = luaL_optnumber(L, 2, -1);
+	Line *line = (Line *)ugen_new(L, &ramp_class);
+	
+	line->value = line->target = line->to = value;
+	line->time = time >= 0 ? time : line->ugen.sample_rate * 0.05;
+	set_event(L);
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_envelope(lua_State *L)
+{
+	lua_pushcfunction(L, new_adsr);
+	lua_setglobal(L, "ADSR");
+	
+	lua_pushcfunction(L, new_line);
+	lua_setglobal(L, "Line");
+	
+	lua_pushcfunction(L, new_ramp);
+	lua_setglobal(L, "Ramp");
+	
+	return 0;
+}
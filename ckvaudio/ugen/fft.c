@@ -0,0 +1,183 @@
+
+#include <math.h>
+
+#include "fft.h"
+#include "../../alloc.h"
+
+struct _FFT {
+	int n;
+	int half; /* n / 2, the size of the complex FFT */
+	double *cosines; /* cos and sin of 2 pi k / n, for k < half */
+	double *sines;
+	int *reverse; /* each index of the complex FFT with its bits reversed */
+	double *re, *im; /* scratch */
+};
+
+#define TWO_PI (6.28318530717958647692)
+
+FFT *
+fft_new(int n)
+{
+	FFT *fft;
+	int bits, k, j;
+	
+	if(n < 4 || (n & (n - 1)) != 0)
+		return NULL;
+	
+	fft = (FFT *)ckv_malloc(sizeof(FFT));
+	if(fft == NULL)
+		return NULL;
+	
+	fft->n = n;
+	fft->half = n / 2;
+	fft->cosines = (double *)ckv_malloc(sizeof(double) * 4 * fft->half);
+	fft->reverse = (int *)ckv_malloc(sizeof(int) * fft->half);
+	if(fft->cosines == NULL || fft->reverse == NULL) {
+		ckv_free(fft->cosines);
+		ckv_free(fft->reverse);
+		ckv_free(fft);
+		return NULL;
+	}
+	fft->sines = fft->cosines + fft->half;
+	fft->re = fft->sines + fft->half;
+	fft->im = fft->re + fft->half;
+	
+	for(k = 0; k < fft->half; k++) {
+		fft->cosines[k] = cos(TWO_PI * k / n);
+		fft->sines[k] = sin(TWO_PI * k / n);
+	}
+	
+	for(bits = 0; (1 << bits) < fft->half; bits++)
+		;
+	for(k = 0; k < fft->half; k++) {
+		fft->reverse[k] = 0;
+		for(j = 0; j < bits; j++)
+			if(k & (1 << j))
+				fft->reverse[k] |= 1 << (bits - 1 - j);
+	}
+	
+	return fft;
+}
+
+void
+fft_free(FFT *fft)
+{
+	if(fft == NULL)
+		return;
+	
+	ckv_free(fft->cosines);
+	ckv_free(fft->reverse);
+	ckv_free(fft);
+}
+
+int
+fft_size(FFT *fft)
+{
+	return fft->n;
+}
+
+/* the complex FFT, in place on the scratch arrays */
+static void
+transform(FFT *fft)
+{
+	double *re = fft->re, *im = fft->im;
+	double wr, wi, tr, ti;
+	int half = fft->half;
+	int size, step, i, j, a, b;
+	
+	for(i = 0; i < half; i++) {
+		j = fft->reverse[i];
+		if(i < j) {
+			tr = re[i]; re[i] = re[j]; re[j] = tr;
+			ti = im[i]; im[i] = im[j]; im[j] = ti;
+		}
+	}
+	
+	/* butterflies of size 2, 4, ...; a twiddle of size size is the table's entry at n / size */
+	for(size = 2; size <= half; size <<= 1) {
+		step = fft->n / size;
+		for(i = 0; i < half; i += size) {
+			for(j = 0; j < size / 2; j++) {
+				wr = fft->cosines[j * step];
+				wi = -fft->sines[j * step];
+				a = i + j;
+				b = a + size / 2;
+				tr = wr * re[b] - wi * im[b];
+				ti = wr * im[b] + wi * re[b];
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+void
+fft_forward(FFT *fft, const double *in, double *re, double *im)
+{
+	int half = fft->half;
+	double zr, zi, cr, ci, er, ei, odr, odi, wr, wi;
+	int k;
+	
+	/* the even samples as the real parts, the odd ones as the imaginary */
+	for(k = 0; k < half; k++) {
+		fft->re[k] = in[2 * k];
+		fft->im[k] = in[2 * k + 1];
+	}
+	transform(fft);
+	
+	re[0] = fft->re[0] + fft->im[0];
+	im[0] = 0;
+	re[half] = fft->re[0] - fft->im[0];
+	im[half] = 0;
+	
+	/* untangle the spectra of the even (e) and odd (o) samples, and put them together */
+	for(k = 1; k < half; k++) {
+		zr = fft->re[k];
+		zi = fft->im[k];
+		cr = fft->re[half - k];
+		ci = -fft->im[half - k];
+		er = (zr + cr) * 0.5;
+		ei = (zi + ci) * 0.5;
+		odr = (zi - ci) * 0.5;
+		odi = (cr - zr) * 0.5;
+		wr = fft->cosines[k];
+		wi = -fft->sines[k];
+		re[k] = er + wr * odr - wi * odi;
+		im[k] = ei + wr * odi + wi * odr;
+	}
+}
+
+void
+fft_inverse(FFT *fft, const double *re, const double *im, double *out)
+{
+	int half = fft->half;
+	double xr, xi, cr, ci, er, ei, dr, di, odr, odi, wr, wi;
+	double scale = 1.0 / half;
+	int k;
+	
+	/* the spectra of the even and odd samples, tangled back together (conjugated, to use the forward transform) */
+	for(k = 0; k < half; k++) {
+		xr = re[k];
+		xi = k > 0 ? im[k] : 0;
+		cr = re[half - k];
+		ci = k > 0 ? -im[half - k] : 0;
+		er = (xr + cr) * 0.5;
+		ei = (xi + ci) * 0.5;
+		dr = (xr - cr) * 0.5;
+		di = (xi - ci) * 0.5;
+		wr = fft->cosines[k];
+		wi = fft->sines[k];
+		odr = dr * wr - di * wi;
+		odi = dr * wi + di * wr;
+		fft->re[k] = er - odi;
+		fft->im[k] = -(ei + odr);
+	}
+	transform(fft);
+	
+	for(k = 0; k < half; k++) {
+		out[2 * k] = fft->re[k] * scale;
+		out[2 * k + 1] = -fft->im[k] * scale;
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef FFT_H
+#define FFT_H
+
+/*
+
+a real FFT, for ugens that work on spectra (convolution, analysis).
+
+an FFT of size n (a power of two, at least 4) takes n real samples to
+n / 2 + 1 complex bins, from 0 Hz to Nyquist, kept as separate arrays of
+real and imaginary parts so a pass over the bins is a pass over plain
+doubles, which vectorizes. it's a radix-2 complex FFT of size n / 2 over
+the even and odd samples, then untangled.
+
+fft_inverse(fft_forward(x)) is x: the inverse is scaled by 1 / n.
+
+an FFT has scratch space, so one FFT can't be used by two threads at
+once; give each thread its own.
+
+*/
+
+typedef struct _FFT FFT;
+
+FFT *fft_new(int n); /* NULL if out of memory */
+void fft_free(FFT *fft);
+int fft_size(FFT *fft);
+
+/* in has n samples; re and im get n / 2 + 1 bins */
+void fft_forward(FFT *fft, const double *in, double *re, double *im);
+
+/* re and im have n / 2 + 1 bins (the imaginary parts of the first and last are ignored); out gets n samples */
+void fft_inverse(FFT *fft, const double *re, const double *im, double *out);
+
+#endif
@@ -0,0 +1,639 @@
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ugen.h"
+#include "vmath.h"
+#include "../../alloc.h"
+
+/*
+
+filters: Biquad(type, freq, q, gain) and SVF(type, freq, q, gain) filter
+their input; FilterBank(n, type) runs n filters in one ugen, for vocoders,
+formant banks and graphic EQs that would otherwise take n ugens and a Gain.
+
+types: "lp", "hp", "bp" (0 dB at freq), "notch", "peak", "lowshelf" and
+"highshelf"; gain (in dB) is only used by the last three. by default a
+filter is a 1 kHz "lp", with a q of 0.707 and a gain of 0 dB.
+
+Biquad is the cookbook filter (Robert Bristow-Johnson's), in transposed
+direct form II. SVF is Andrew Simper's trapezoidal state-variable filter,
+which has the same responses but stays well behaved when its frequency is
+swept quickly, so prefer it for anything modulated.
+
+when freq, q, gain or the type changes, the coefficients glide to their
+new values over 32 samples rather than jumping, so setting a field from
+Lua doesn't click.
+
+fields: freq, q, gain (freq and q are also ports)
+
+methods:
+  filter:type()      returns the type
+  filter:type(name)  sets it
+
+FilterBank(n, type) is n SVFs (of type, "bp" by default) side by side. the
+filters' states and coefficients are kept in contiguous arrays, so each
+tick is one pass of vmath_svf across all of them, a vector of filters at a
+time. filter i's input is port i plus the default port (so connect one
+source to the bank to feed every filter); the bank's own output is the
+sum of its filters, and bank:output(i) (or bank[i]) returns a ugen for
+filter i's.
+
+methods (filters are numbered from 1):
+  bank:filter(i)                          returns filter i's type, freq, q and gain
+  bank:filter(i, type, freq, q, gain)     sets them (any can be nil, to keep it)
+  bank:freqs()                            returns the frequencies as a table
+  bank:freqs(t, first)                    sets filters first, first + 1, ... (first defaults to 1) from t
+  bank:qs(...), bank:gains(...)           likewise
+
+*/
+
+#define SMOOTH (32) /* samples a change of coefficients takes */
+
+#define COEFS (6) /* each filter's, for either structure */
+
+enum { TYPE_LP, TYPE_HP, TYPE_BP, TYPE_NOTCH, TYPE_PEAK, TYPE_LOWSHELF, TYPE_HIGHSHELF };
+
+static const char *const types[] = { "lp", "hp", "bp", "notch", "peak", "lowshelf", "highshelf", NULL };
+
+typedef void (*Design)(int type, double freq, double q, double gain, double rate, double *c, int stride);
+
+typedef struct _Filter {
+	UGen ugen;
+	double freq, q, gain;
+	int type;
+	double designed[3]; /* the freq, q and gain target was worked out for */
+	int redesign; /* set when the type changes */
+	double coefs[COEFS]; /* those in use */
+	double target[COEFS];
+	double step[COEFS];
+	int left; /* samples until coefs gets to target */
+	double state[2];
+} Filter;
+
+typedef struct _FilterBank {
+	UGen ugen;
+	int filters;
+	char *types;
+	double *freqs; /* one block, from here */
+	double *qs;
+	double *gains;
+	double *coefs; /* by coefficient, then filter, as vmath_svf wants them */
+	double *target;
+	double *step;
+	double *state;
+	double *in;
+	double *out;
+	int left;
+	int redesign; /* set when any filter changes */
+} FilterBank;
+
+#define PORT_FREQ (1)
+#define PORT_Q (2)
+
+#define PI (3.14159265358979323846)
+
+static const char *const filter_ports[] = { "freq", "q", NULL };
+
+static const UGenField filter_fields[] = {
+	{ "freq", offsetof(Filter, freq) },
+	{ "q", offsetof(Filter, q) },
+	{ "gain", offsetof(Filter, gain) },
+	{ NULL, 0 }
+};
+
+/* keeps freq between 1 Hz and just under Nyquist, and q positive */
+static void
+clamp(double *freq, double *q, double rate)
+{
+	if(!(*freq >= 1.0))
+		*freq = 1.0;
+	if(*freq > rate * 0.49)
+		*freq = rate * 0.49;
+	if(!(*q >= 0.01))
+		*q = 0.01;
+}
+
+/* b0, b1, b2, a1 and a2, divided by a0, into c[0], c[stride], ... */
+static void
+biquad_design(int type, double freq, double q, double gain, double rate, double *c, int stride)
+{
+	double w, cw, alpha, A, sq;
+	double b0, b1, b2, a0, a1, a2;
+	
+	clamp(&freq, &q, rate);
+	w = 2 * PI * freq / rate;
+	cw = cos(w);
+	alpha = sin(w) / (2 * q);
+	A = pow(10.0, gain / 40);
+	sq = 2 * sqrt(A) * alpha;
+	
+	a0 = 1 + alpha;
+	a1 = -2 * cw;
+	a2 = 1 - alpha;
+	
+	switch(type) {
+	case TYPE_LP:
+		b0 = b2 = (1 - cw) / 2;
+		b1 = 1 - cw;
+		break;
+	case TYPE_HP:
+		b0 = b2 = (1 + cw) / 2;
+		b1 = -(1 + cw);
+		break;
+	case TYPE_BP:
+		b0 = alpha;
+		b1 = 0;
+		b2 = -alpha;
+		break;
+	case TYPE_NOTCH:
+		b0 = b2 = 1;
+		b1 = -2 * cw;
+		break;
+	case TYPE_PEAK:
+		b0 = 1 + alpha * A;
+		b1 = -2 * cw;
+		b2 = 1 - alpha * A;
+		a0 = 1 + alpha / A;
+		a2 = 1 - alpha / A;
+		break;
+	case TYPE_LOWSHELF:
+		b0 = A * ((A + 1) - (A - 1) * cw + sq);
+		b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+		b2 = A * ((A + 1) - (A - 1) * cw - sq);
+		a0 = (A + 1) + (A - 1) * cw + sq;
+		a1 = -2 * ((A - 1) + (A + 1) * cw);
+		a2 = (A + 1) + (A - 1) * cw - sq;
+		break;
+	default: /* TYPE_HIGHSHELF */
+		b0 = A * ((A + 1) + (A - 1) * cw + sq);
+		b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+		b2 = A * ((A + 1) + (A - 1) * cw - sq);
+		a0 = (A + 1) - (A - 1) * cw + sq;
+		a1 = 2 * ((A - 1) - (A + 1) * cw);
+		a2 = (A + 1) - (A - 1) * cw - sq;
+		break;
+	}
+	
+	c[0] = b0 / a0;
+	c[stride] = b1 / a0;
+	c[2 * stride] = b2 / a0;
+	c[3 * stride] = a1 / a0;
+	c[4 * stride] = a2 / a0;
+	c[5 * stride] = 0;
+}
+
+/* a1, a2, a3, m0, m1 and m2 (see vmath_svf) into c[0], c[stride], ... */
+static void
+svf_design(int type, double freq, double q, double gain, double rate, double *c, int stride)
+{
+	double g, k, A, a1;
+	double m0 = 0, m1 = 0, m2 = 0;
+	
+	clamp(&freq, &q, rate);
+	g = tan(PI * freq / rate);
+	k = 1 / q;
+	A = pow(10.0, gain / 40);
+	
+	switch(type) {
+	case TYPE_LP:
+		m2 = 1;
+		break;
+	case TYPE_HP:
+		m0 = 1;
+		m1 = -k;
+		m2 = -1;
+		break;
+	case TYPE_BP:
+		m1 = k;
+		break;
+	case TYPE_NOTCH:
+		m0 = 1;
+		m1 = -k;
+		break;
+	case TYPE_PEAK:
+		k = 1 / (q * A);
+		m0 = 1;
+		m1 = k * (A * A - 1);
+		break;
+	case TYPE_LOWSHELF:
+		g /= sqrt(A);
+		m0 = 1;
+		m1 = k * (A - 1);
+		m2 = A * A - 1;
+		break;
+	default: /* TYPE_HIGHSHELF */
+		g *= sqrt(A);
+		m0 = A * A;
+		m1 = k * (1 - A) * A;
+		m2 = 1 - A * A;
+		break;
+	}
+	
+	a1 = 1 / (1 + g * (g + k));
+	c[0] = a1;
+	c[stride] = g * a1;
+	c[2 * stride] = g * g * a1;
+	c[3 * stride] = m0;
+	c[4 * stride] = m1;
+	c[5 * stride] = m2;
+}
+
+/* starts count coefficients gliding from coefs to target */
+static void
+glide_start(const double *coefs, const double *target, double *step, int count, int *left)
+{
+	int k;
+	
+	for(k = 0; k < count; k++)
+		step[k] = (target[k] - coefs[k]) * (1.0 / SMOOTH);
+	*left = SMOOTH;
+}
+
+/* moves count coefficients one sample along their glide, if they're gliding */
+static void
+glide(double *coefs, const double *target, const double *step, int count, int *left)
+{
+	int k;
+	
+	if(*left == 0)
+		return;
+	
+	if(--*left == 0) {
+		memcpy(coefs, target, sizeof(double) * count);
+	} else {
+		for(k = 0; k < count; k++)
+			coefs[k] += step[k];
+	}
+}
+
+/* works out filter's coefficients again if what they're for has changed, and glides them along */
+static void
+filter_update(Filter *filter, Design design)
+{
+	double freq = filter->freq + filter->ugen.in[PORT_FREQ];
+	double q = filter->q + filter->ugen.in[PORT_Q];
+	
+	if(filter->redesign || freq != filter->designed[0] || q != filter->designed[1] || filter->gain != filter->designed[2]) {
+		design(filter->type, freq, q, filter->gain, filter->ugen.sample_rate, filter->target, 1);
+		glide_start(filter->coefs, filter->target, filter->step, COEFS, &filter->left);
+		filter->designed[0] = freq;
+		filter->designed[1] = q;
+		filter->designed[2] = filter->gain;
+		filter->redesign = 0;
+	}
+	
+	glide(filter->coefs, filter->target, filter->step, COEFS, &filter->left);
+}
+
+static void
+biquad_tick(UGen *ugen)
+{
+	Filter *filter = (Filter *)ugen;
+	double *c = filter->coefs, *s = filter->state;
+	double x = ugen->in[0], y;
+	
+	filter_update(filter, biquad_design);
+	
+	y = c[0] * x + s[0];
+	s[0] = c[1] * x - c[3] * y + s[1];
+	s[1] = c[2] * x - c[4] * y;
+	ugen->last = y;
+}
+
+static void
+svf_tick(UGen *ugen)
+{
+	Filter *filter = (Filter *)ugen;
+	
+	filter_update(filter, svf_design);
+	vmath_svf(&ugen->last, ugen->in, filter->state, filter->coefs, 1);
+}
+
+static void
+filterbank_tick(UGen *ugen)
+{
+	FilterBank *bank = (FilterBank *)ugen;
+	double *in = bank->in, *out = bank->out;
+	double sum = 0;
+	int i, n = bank->filters;
+	
+	if(bank->redesign) {
+		for(i = 0; i < n; i++)
+			svf_design(bank->types[i], bank->freqs[i], bank->qs[i], bank->gains[i], ugen->sample_rate, bank->target + i, n);
+		glide_start(bank->coefs, bank->target, bank->step, COEFS * n, &bank->left);
+		bank->redesign = 0;
+	}
+	glide(bank->coefs, bank->target, bank->step, COEFS * n, &bank->left);
+	
+	for(i = 0; i < n; i++)
+		in[i] = ugen->in[0] + ugen->in[i + 1];
+	vmath_svf(out, in, bank->state, bank->coefs, n);
+	
+	for(i = 0; i < n; i++)
+		sum += out[i];
+	ugen->last = sum;
+}
+
+static void
+filterbank_release(UGen *ugen)
+{
+	FilterBank *bank = (FilterBank *)ugen;
+	
+	ckv_free(bank->types);
+	ckv_free(bank->freqs);
+}
+
+/* allocates the bank's arrays (one block of doubles, from freqs), raising an error if it can't */
+static void
+filterbank_alloc(lua_State *L, FilterBank *bank)
+{
+	int n = bank->filters;
+	
+	bank->types = (char *)ckv_malloc(n);
+	bank->freqs = (double *)ckv_malloc(sizeof(double) * (3 + 3 * COEFS + 4) * n);
+	if(bank->types == NULL || bank->freqs == NULL)
+		luaL_error(L, "out of memory creating a filter bank");
+	
+	bank->qs = bank->freqs + n;
+	bank->gains = bank->qs + n;
+	bank->coefs = bank->gains + n;
+	bank->target = bank->coefs + COEFS * n;
+	bank->step = bank->target + COEFS * n;
+	bank->state = bank->step + COEFS * n;
+	bank->in = bank->state + 2 * n;
+	bank->out = bank->in + n;
+}
+
+/* a copy starts out with the original's filters, and its "outputs" */
+static void
+filterbank_copy(lua_State *L, UGen *ugen, int index)
+{
+	FilterBank *bank = (FilterBank *)ugen;
+	FilterBank original = *bank;
+	
+	filterbank_alloc(L, bank);
+	memcpy(bank->types, original.types, bank->filters);
+	memcpy(bank->freqs, original.freqs, sizeof(double) * (3 + 3 * COEFS + 4) * bank->filters);
+	
+	lua_newtable(L);
+	lua_setfield(L, index, "outputs");
+}
+
+static double
+filterbank_read(UGen *ugen, int i)
+{
+	return ((FilterBank *)ugen)->out[i];
+}
+
+static int biquad_type(lua_State *L);
+static int svf_type(lua_State *L);
+static int filterbank_filter(lua_State *L);
+static int filterbank_freqs(lua_State *L);
+static int filterbank_qs(lua_State *L);
+static int filterbank_gains(lua_State *L);
+static int filterbank_output(lua_State *L);
+
+static const luaL_Reg biquad_methods[] = {
+	{ "type", biquad_type },
+	{ NULL, NULL }
+};
+
+static const luaL_Reg svf_methods[] = {
+	{ "type", svf_type },
+	{ NULL, NULL }
+};
+
+static const luaL_Reg filterbank_methods[] = {
+	{ "filter", filterbank_filter },
+	{ "freqs", filterbank_freqs },
+	{ "qs", filterbank_qs },
+	{ "gains", filterbank_gains },
+	{ "output", filterbank_output },
+	{ NULL, NULL }
+};
+
+static const UGenClass biquad_class = { "Biquad", sizeof(Filter), filter_ports, filter_fields, biquad_methods, biquad_tick, NULL, NULL };
+static const UGenClass svf_class = { "SVF", sizeof(Filter), filter_ports, filter_fields, svf_methods, svf_tick, NULL, NULL };
+static const UGenClass filterbank_class = { "FilterBank", sizeof(FilterBank), NULL, NULL, filterbank_methods, filterbank_tick, filterbank_release, filterbank_copy };
+
+/* args: self, type (optional) */
+static int
+filter_type(lua_State *L, const UGenClass *cls)
+{
+	Filter *filter = (Filter *)ugen_check(L, 1, cls);
+	
+	if(lua_isnoneornil(L, 2)) {
+		lua_pushstring(L, types[filter->type]);
+		return 1;
+	}
+	
+	filter->type = luaL_checkoption(L, 2, NULL, types);
+	filter->redesign = 1;
+	
+	return 0;
+}
+
+static int
+biquad_type(lua_State *L)
+{
+	return filter_type(L, &biquad_class);
+}
+
+static int
+svf_type(lua_State *L)
+{
+	return filter_type(L, &svf_class);
+}
+
+/* args: bank, filter, type, freq, q, gain (all but filter optional) */
+static int
+filterbank_filter(lua_State *L)
+{
+	FilterBank *bank = (FilterBank *)ugen_check(L, 1, &filterbank_class);
+	int i = luaL_checkint(L, 2) - 1;
+	
+	luaL_argcheck(L, i >= 0 && i < bank->filters, 2, "no such filter");
+	
+	if(lua_gettop(L) <= 2) {
+		lua_pushstring(L, types[(int)bank->types[i]]);
+		lua_pushnumber(L, bank->freqs[i]);
+		lua_pushnumber(L, bank->qs[i]);
+		lua_pushnumber(L, bank->gains[i]);
+		return 4;
+	}
+	
+	if(!lua_isnoneornil(L, 3))
+		bank->types[i] = (char)luaL_checkoption(L, 3, NULL, types);
+	if(!lua_isnoneornil(L, 4))
+		bank->freqs[i] = luaL_checknumber(L, 4);
+	if(!lua_isnoneornil(L, 5))
+		bank->qs[i] = luaL_checknumber(L, 5);
+	if(!lua_isnoneornil(L, 6))
+		bank->gains[i] = luaL_checknumber(L, 6);
+	bank->redesign = 1;
+	
+	return 0;
+}
+
+/* args: bank, table (optional), first (default 1); gets or sets the given array in bulk */
+static int
+filterbank_array(lua_State *L, double *(*array)(FilterBank *bank))
+{
+	FilterBank *bank = (FilterBank *)ugen_check(L, 1, &filterbank_class);
+	double *values = array(bank);
+	int first, count, i;
+	
+	if(lua_isnoneornil(L, 2)) {
+		lua_createtable(L, bank->filters, 0);
+		for(i = 0; i < bank->filters; i++) {
+			lua_pushnumber(L, values[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		return 1;
+	}
+	
+	luaL_checktype(L, 2, LUA_TTABLE);
+	first = luaL_optint(L, 3, 1) - 1;
+	count = lua_objlen(L, 2);
+	luaL_argcheck(L, first >= 0 && first + count <= bank->filters, 3, "too many filters");
+	
+	for(i = 0; i < count; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		values[first + i] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	bank->redesign = 1;
+	
+	return 0;
+}
+
+static double *
+bank_freqs(FilterBank *bank)
+{
+	return bank->freqs;
+}
+
+static double *
+bank_qs(FilterBank *bank)
+{
+	return bank->qs;
+}
+
+static double *
+bank_gains(FilterBank *bank)
+{
+	return bank->gains;
+}
+
+static int
+filterbank_freqs(lua_State *L)
+{
+	return filterbank_array(L, bank_freqs);
+}
+
+static int
+filterbank_qs(lua_State *L)
+{
+	return filterbank_array(L, bank_qs);
+}
+
+static int
+filterbank_gains(lua_State *L)
+{
+	return filterbank_array(L, bank_gains);
+}
+
+/* args: bank, filter */
+static int
+filterbank_output(lua_State *L)
+{
+	FilterBank *bank = (FilterBank *)ugen_check(L, 1, &filterbank_class);
+	int i = luaL_checkint(L, 2) - 1;
+	
+	luaL_argcheck(L, i >= 0 && i < bank->filters, 2, "no such filter");
+	ugen_push_output(L, 1, "bank", i, filterbank_read);
+	
+	return 1;
+}
+
+/* args: type (default "lp"), freq (default 1000), q (default 0.707), gain (default 0); upvalues: class, design */
+static int
+new_filter(lua_State *L)
+{
+	const UGenClass *cls = (const UGenClass *)lua_touserdata(L, lua_upvalueindex(1));
+	Design design = *(Design *)lua_touserdata(L, lua_upvalueindex(2));
+	int type = luaL_checkoption(L, 1, "lp", types);
+	double freq = luaL_optnumber(L, 2, 1000);
+	double q = luaL_optnumber(L, 3, 0.707);
+	double gain = luaL_optnumber(L, 4, 0);
+	Filter *filter = (Filter *)ugen_new(L, cls);
+	
+	filter->type = type;
+	filter->freq = freq;
+	filter->q = q;
+	filter->gain = gain;
+	
+	/* a new filter starts out with its coefficients, rather than gliding to them */
+	design(type, filter->freq, filter->q, filter->gain, filter->ugen.sample_rate, filter->coefs, 1);
+	memcpy(filter->target, filter->coefs, sizeof(filter->coefs));
+	filter->designed[0] = filter->freq;
+	filter->designed[1] = filter->q;
+	filter->designed[2] = filter->gain;
+	
+	return 1;
+}
+
+/* args: filters, type (default "bp") */
+static int
+new_filterbank(lua_State *L)
+{
+	int filters = luaL_checkint(L, 1);
+	int type = luaL_checkoption(L, 2, "bp", types);
+	FilterBank *bank;
+	int i;
+	
+	luaL_argcheck(L, filters > 0, 1, "a filter bank needs at least one filter");
+	
+	bank = (FilterBank *)ugen_new_ports(L, &filterbank_class, filters + 1);
+	bank->filters = filters;
+	filterbank_alloc(L, bank);
+	memset(bank->freqs, 0, sizeof(double) * (3 + 3 * COEFS + 4) * filters);
+	
+	for(i = 0; i < filters; i++) {
+		bank->types[i] = (char)type;
+		bank->freqs[i] = 1000;
+		bank->qs[i] = 0.707;
+		svf_design(type, 1000, 0.707, 0, bank->ugen.sample_rate, bank->coefs + i, filters);
+	}
+	memcpy(bank->target, bank->coefs, sizeof(double) * COEFS * filters);
+	
+	lua_newtable(L);
+	lua_setfield(L, -2, "outputs");
+	
+	return 1;
+}
+
+static void
+register_filter(lua_State *L, const UGenClass *cls, Design design)
+{
+	lua_pushlightuserdata(L, (void *)cls);
+	*(Design *)lua_newuserdata(L, sizeof(Design)) = design;
+	lua_pushcclosure(L, new_filter, 2);
+	lua_setglobal(L, cls->name);
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_filter(lua_State *L)
+{
+	register_filter(L, &biquad_class, biquad_design);
+	register_filter(L, &svf_class, svf_design);
+	
+	lua_pushcfunction(L, new_filterbank);
+	lua_setglobal(L, "FilterBank");
+	
+	return 0;
+}
@@ -1,23 +1,54 @@
 
+#include <stddef.h>
+
 #include "ugen.h"
 
+typedef struct _Gain {
+	UGen ugen;
+	double gain;
+} Gain;
+
+#define PORT_GAIN (1)
+
+static const char *const gain_ports[] = { "gain", NULL };
+
+static const UGenField gain_fields[] = {
+	{ "gain", offsetof(Gain, gain) },
+	{ NULL, 0 }
+};
+
+static void
+gain_tick(UGen *ugen)
+{
+	Gain *gain = (Gain *)ugen;
+	ugen->last = ugen->in[0] * (gain->gain + ugen->in[PORT_GAIN]);
+}
+
+static const UGenClass gain_class = { "Gain", sizeof(Gain), gain_ports, gain_fields, NULL, gain_tick, NULL, NULL };
+
+/* args: gain (default 1) */
+static int
+new_gain(lua_State *L)
+{
+	double g = luaL_optnumber(L, 1, 1.0);
+	Gain *gain = (Gain *)ugen_new(L, &gain_class);
+	
+	gain->gain = g;
+	
+	return 1;
+}
+
 /* LIBRARY REGISTRATION */
 
 int
 open_ugen_gain(lua_State *L)
 {
-	(void) luaL_dostring(L,
-	"function Gain(gain)"
-	"  return {"
-	"    last = 0.0,"
-	"    gain = gain or 1.0,"
-	"    tick = function(self)"
-	"      self.last = UGen.sum_inputs(self) * self.gain;"
-	"    end"
-	"  }"
-	"end;"
-	"PassThru = Gain" /* alias for "Gain" is "PassThru" */
-	);
+	lua_pushcfunction(L, new_gain);
+	lua_setglobal(L, "Gain");
+	
+	/* alias for "Gain" is "PassThru" */
+	lua_pushcfunction(L, new_gain);
+	lua_setglobal(L, "PassThru");
 	
 	return 0;
 }
@@ -0,0 +1,978 @@
+
+#include <stdlib.h>
+
+#include "../../alloc.h"
+#include "graph.h"
+
+#define ORDER_PORT (-1) /* port of the edges that keep sinks in priority order */
+#define INITIAL_CAPACITY (64)
+
+/* a batch sorts the whole graph once if it added at least this many out-of-order edges per node */
+#define SORT_FRACTION (16)
+
+/* changes made during a batch, so it can be rolled back */
+#define OP_BEGIN (0)
+#define OP_CONNECT (1)
+#define OP_DISCONNECT (2)
+#define OP_ADD_SINK (3)
+#define OP_REMOVE_SINK (4)
+#define OP_NONE (5) /* a committed inner batch's OP_BEGIN */
+
+typedef struct _Op {
+	int op;
+	Node *source; /* or the sink */
+	Node *dest;
+	int port;
+	int sink; /* OP_ADD_SINK: whether it was already a sink */
+	double priority; /* ... and its priority before */
+} Op;
+
+struct _Graph {
+	Pool node_pool;
+	Pool edge_pool;
+
+	Node **order; /* the nodes, sources before destinations */
+	int size;
+	int capacity; /* of order and of the scratch space below */
+
+	Node **sinks; /* by priority */
+	int sink_count;
+	int sink_capacity;
+
+	int back_edges; /* how many feedback edges there are */
+	
+	int batch; /* how many batches are open */
+	Edge **pending; /* edges added during the batch that disagree with the order, oldest first */
+	int pending_count;
+	int pending_capacity;
+	Op *log; /* what the open batches have done */
+	int log_count;
+	int log_capacity;
+	int undoing;
+	
+	/* scratch space for searches */
+	unsigned int visit; /* nodes marked with this have been visited by the current search */
+	Node **stack;
+	Node **forward;
+	Node **backward;
+	int *slots;
+	Node **suspects; /* nodes that may be live only because they're on a dead loop */
+	int suspect_count;
+};
+
+static Edge *find_edge(Node *source, Node *dest, int port);
+static int link_edge(Graph graph, Node *source, Node *dest, int port, int back);
+static void unlink_edge(Graph graph, Edge *edge);
+static void cut_edge(Graph graph, Edge *edge);
+static int reorder(Graph graph, Node *source, Node *dest);
+static int push_forward(Graph graph, Node *node, Node *source, int upper, int *top);
+static void push_backward(Graph graph, Node *node, int lower, int *top);
+static void add_user(Node *node);
+static void remove_user(Graph graph, Node *node);
+static void collect_dead_loops(Graph graph);
+static void order_sinks(Graph graph);
+static void unorder_sinks(Graph graph);
+static void unlink_order_edges(Graph graph, Node *node);
+static int compare_index(const void *a, const void *b);
+static Op *log_op(Graph graph, int op);
+static void undo_op(Graph graph, Op *op);
+static void drop_op(Graph graph);
+static void end_batch(Graph graph);
+static int sort_all(Graph graph);
+static void ready(Graph graph, Node *node, int *count);
+static Node *take_ready(Graph graph, int *count);
+static void order_pending(Graph graph);
+
+Graph
+new_graph(void)
+{
+	Graph graph = (Graph)ckv_malloc(sizeof(struct _Graph));
+	if(graph == NULL)
+		return NULL;
+	
+	graph->node_pool = new_pool(sizeof(Node), INITIAL_CAPACITY);
+	graph->edge_pool = new_pool(sizeof(Edge), INITIAL_CAPACITY);
+	graph->order = NULL;
+	graph->size = 0;
+	graph->capacity = 0;
+	graph->sinks = NULL;
+	graph->sink_count = 0;
+	graph->sink_capacity = 0;
+	graph->back_edges = 0;
+	graph->batch = 0;
+	graph->pending = NULL;
+	graph->pending_count = 0;
+	graph->pending_capacity = 0;
+	graph->log = NULL;
+	graph->log_count = 0;
+	graph->log_capacity = 0;
+	graph->undoing = 0;
+	graph->visit = 0;
+	graph->stack = NULL;
+	graph->forward = NULL;
+	graph->backward = NULL;
+	graph->slots = NULL;
+	graph->suspects = NULL;
+	graph->suspect_count = 0;
+	
+	if(graph->node_pool == NULL || graph->edge_pool == NULL) {
+		free_graph(graph);
+		return NULL;
+	}
+	
+	return graph;
+}
+
+void
+free_graph(Graph graph)
+{
+	if(graph == NULL)
+		return;
+	
+	free_pool(graph->node_pool);
+	free_pool(graph->edge_pool);
+	ckv_free(graph->order);
+	ckv_free(graph->sinks);
+	ckv_free(graph->stack);
+	ckv_free(graph->forward);
+	ckv_free(graph->backward);
+	ckv_free(graph->slots);
+	ckv_free(graph->suspects);
+	ckv_free(graph->pending);
+	ckv_free(graph->log);
+	ckv_free(graph);
+}
+
+Node *
+graph_add_node(Graph graph)
+{
+	Node *node;
+	
+	if(graph->size == graph->capacity) {
+		int capacity = graph->capacity > 0 ? graph->capacity * 2 : INITIAL_CAPACITY;
+		Node **order = (Node **)ckv_realloc(graph->order, sizeof(Node *) * capacity);
+		Node **stack = (Node **)ckv_realloc(graph->stack, sizeof(Node *) * capacity);
+		Node **forward = (Node **)ckv_realloc(graph->forward, sizeof(Node *) * capacity);
+		Node **backward = (Node **)ckv_realloc(graph->backward, sizeof(Node *) * capacity);
+		int *slots = (int *)ckv_realloc(graph->slots, sizeof(int) * capacity);
+		Node **suspects = (Node **)ckv_realloc(graph->suspects, sizeof(Node *) * capacity);
+	
+		/* keep whatever was reallocated, so nothing leaks on failure */
+		if(order != NULL) graph->order = order;
+		if(stack != NULL) graph->stack = stack;
+		if(forward != NULL) graph->forward = forward;
+		if(backward != NULL) graph->backward = backward;
+		if(slots != NULL) graph->slots = slots;
+		if(suspects != NULL) graph->suspects = suspects;
+	
+		if(order == NULL || stack == NULL || forward == NULL || backward == NULL || slots == NULL || suspects == NULL)
+			return NULL;
+	
+		graph->capacity = capacity;
+	}
+	
+	node = (Node *)pool_alloc(graph->node_pool);
+	if(node == NULL)
+		return NULL;
+	
+	node->ref = 0;
+	node->last = 0;
+	node->index = graph->size;
+	node->users = 0;
+	node->sink = 0;
+	node->priority = 0;
+	node->inputs = NULL;
+	node->outputs = NULL;
+	node->mark = graph->visit;
+	node->suspect = 0;
+	
+	graph->order[graph->size++] = node;
+	
+	return node;
+}
+
+void
+graph_remove_node(Graph graph, Node *node)
+{
+	int i;
+	
+	graph_remove_sink(graph, node);
+	while(node->outputs != NULL)
+		cut_edge(graph, node->outputs);
+	while(node->inputs != NULL)
+		cut_edge(graph, node->inputs);
+	collect_dead_loops(graph);
+	
+	for(i = node->index; i + 1 < graph->size; i++) {
+		graph->order[i] = graph->order[i + 1];
+		graph->order[i]->index = i;
+	}
+	graph->size--;
+	
+	/* an open batch can't roll back what it did to the node */
+	for(i = 0; i < graph->log_count; i++)
+		if(graph->log[i].op != OP_BEGIN && (graph->log[i].source == node || graph->log[i].dest == node))
+			graph->log[i].op = OP_NONE;
+	
+	pool_free(graph->node_pool, node);
+}
+
+int
+graph_size(Graph graph)
+{
+	return graph->size;
+}
+
+Node *
+graph_node(Graph graph, int index)
+{
+	return graph->order[index];
+}
+
+int
+graph_connect(Graph graph, Node *source, Node *dest, int port)
+{
+	Edge *edge = find_edge(source, dest, port);
+	Op *op;
+	int result;
+	
+	if(graph->batch > 0) {
+		op = log_op(graph, OP_CONNECT);
+		if(op == NULL)
+			return -1;
+		op->source = source;
+		op->dest = dest;
+		op->port = port;
+	}
+	
+	if(edge != NULL) {
+		edge->count++;
+		return 1;
+	}
+	
+	result = link_edge(graph, source, dest, port, 0);
+	
+	/* connections come before the order of the sinks, so try again without it */
+	if(result == 0 && graph->sink_count > 1) {
+		unorder_sinks(graph);
+		result = link_edge(graph, source, dest, port, 0);
+		order_sinks(graph);
+	}
+	
+	/* it closes a loop, so it becomes the loop's feedback edge */
+	if(result == 0)
+		result = link_edge(graph, source, dest, port, 1);
+	
+	if(result == 1 && dest->users > 0)
+		add_user(source);
+	if(result < 0 && graph->batch > 0)
+		drop_op(graph);
+	
+	return result;
+}
+
+int
+graph_disconnect(Graph graph, Node *source, Node *dest, int port)
+{
+	Edge *edge = find_edge(source, dest, port);
+	Op *op;
+	
+	if(edge == NULL)
+		return 0;
+	
+	if(graph->batch > 0) {
+		op = log_op(graph, OP_DISCONNECT);
+		if(op == NULL)
+			return -1;
+		op->source = source;
+		op->dest = dest;
+		op->port = port;
+	}
+	
+	if(--edge->count > 0)
+		return 1;
+	
+	unlink_edge(graph, edge);
+	if(dest->users > 0) {
+		remove_user(graph, source);
+		collect_dead_loops(graph);
+	}
+	
+	return 1;
+}
+
+int
+graph_add_sink(Graph graph, Node *node, double priority)
+{
+	Op *op = NULL;
+	int i;
+	
+	if(graph->batch > 0) {
+		op = log_op(graph, OP_ADD_SINK);
+		if(op == NULL)
+			return -1;
+		op->source = node;
+		op->sink = node->sink;
+		op->priority = node->priority;
+	}
+	
+	if(node->sink) {
+		/* just moving it */
+		for(i = 0; graph->sinks[i] != node; i++)
+			;
+		for(; i + 1 < graph->sink_count; i++)
+			graph->sinks[i] = graph->sinks[i + 1];
+		graph->sink_count--;
+	} else if(graph->sink_count == graph->sink_capacity) {
+		int capacity = graph->sink_capacity > 0 ? graph->sink_capacity * 2 : 4;
+		Node **sinks = (Node **)ckv_realloc(graph->sinks, sizeof(Node *) * capacity);
+		if(sinks == NULL) {
+			if(op != NULL)
+				drop_op(graph);
+			return -1;
+		}
+		graph->sinks = sinks;
+		graph->sink_capacity = capacity;
+	}
+	
+	/* after every sink of the same priority */
+	for(i = graph->sink_count; i > 0 && graph->sinks[i - 1]->priority > priority; i--)
+		graph->sinks[i] = graph->sinks[i - 1];
+	graph->sinks[i] = node;
+	graph->sink_count++;
+	
+	node->priority = priority;
+	if(!node->sink) {
+		node->sink = 1;
+		add_user(node);
+	}
+	
+	order_sinks(graph);
+	
+	return 1;
+}
+
+void
+graph_remove_sink(Graph graph, Node *node)
+{
+	int i;
+	
+	Op *op;
+	
+	if(!node->sink)
+		return;
+	
+	/* (if this can't be logged, it can't be rolled back) */
+	if(graph->batch > 0 && (op = log_op(graph, OP_REMOVE_SINK)) != NULL) {
+		op->source = node;
+		op->priority = node->priority;
+	}
+	
+	for(i = 0; graph->sinks[i] != node; i++)
+		;
+	for(; i + 1 < graph->sink_count; i++)
+		graph->sinks[i] = graph->sinks[i + 1];
+	graph->sink_count--;
+	
+	node->sink = 0;
+	remove_user(graph, node);
+	collect_dead_loops(graph);
+	
+	unlink_order_edges(graph, node);
+	order_sinks(graph);
+}
+
+int
+graph_begin(Graph graph)
+{
+	if(log_op(graph, OP_BEGIN) == NULL)
+		return -1;
+	
+	/* the sinks are ordered again when the batch commits */
+	if(graph->batch++ == 0)
+		unorder_sinks(graph);
+	
+	return 1;
+}
+
+void
+graph_commit(Graph graph)
+{
+	int i;
+	
+	if(graph->batch == 0)
+		return;
+	
+	/* an inner batch's changes now belong to the one around it */
+	for(i = graph->log_count - 1; graph->log[i].op != OP_BEGIN; i--)
+		;
+	graph->log[i].op = OP_NONE;
+	
+	if(--graph->batch == 0)
+		end_batch(graph);
+}
+
+int
+graph_in_batch(Graph graph)
+{
+	return graph->batch > 0;
+}
+
+void
+graph_rollback(Graph graph)
+{
+	Op op;
+	
+	if(graph->batch == 0)
+		return;
+	
+	graph->undoing = 1;
+	for(;;) {
+		op = graph->log[--graph->log_count];
+		if(op.op == OP_BEGIN)
+			break;
+		undo_op(graph, &op);
+	}
+	graph->undoing = 0;
+	
+	if(--graph->batch == 0)
+		end_batch(graph);
+}
+
+/* PRIVATE HELPERS */
+
+static
+Edge *
+find_edge(Node *source, Node *dest, int port)
+{
+	Edge *edge;
+	
+	for(edge = dest->inputs; edge != NULL; edge = edge->next_input)
+		if(edge->source == source && edge->port == port)
+			return edge;
+	
+	return NULL;
+}
+
+/*
+adds a new edge, reordering if necessary; returns as graph_connect() does.
+a feedback edge never needs reordering: it only asks that dest be ticked before
+source, which is already so.
+*/
+static
+int
+link_edge(Graph graph, Node *source, Node *dest, int port, int back)
+{
+	Edge *edge;
+	int pending = 0;
+	
+	if(!back) {
+		if(source == dest)
+			return 0;
+		if(source->index > dest->index) {
+			if(graph->batch > 0)
+				pending = 1;
+			else if(!reorder(graph, source, dest))
+				return 0;
+		}
+	}
+	
+	if(pending && graph->pending_count == graph->pending_capacity) {
+		int capacity = graph->pending_capacity > 0 ? graph->pending_capacity * 2 : INITIAL_CAPACITY;
+		Edge **edges = (Edge **)ckv_realloc(graph->pending, sizeof(Edge *) * capacity);
+		if(edges == NULL)
+			return -1;
+		graph->pending = edges;
+		graph->pending_capacity = capacity;
+	}
+	
+	edge = (Edge *)pool_alloc(graph->edge_pool);
+	if(edge == NULL)
+		return -1;
+	
+	edge->pending = pending;
+	if(pending)
+		graph->pending[graph->pending_count++] = edge;
+	
+	edge->source = source;
+	edge->dest = dest;
+	edge->port = port;
+	edge->count = 1;
+	edge->back = back;
+	graph->back_edges += back;
+	
+	edge->next_input = dest->inputs;
+	dest->inputs = edge;
+	edge->next_output = source->outputs;
+	source->outputs = edge;
+	
+	return 1;
+}
+
+static
+void
+unlink_edge(Graph graph, Edge *edge)
+{
+	Edge **e;
+	int i;
+	
+	for(e = &edge->dest->inputs; *e != edge; e = &(*e)->next_input)
+		;
+	*e = edge->next_input;
+	
+	for(e = &edge->source->outputs; *e != edge; e = &(*e)->next_output)
+		;
+	*e = edge->next_output;
+	
+	if(edge->pending) {
+		for(i = 0; graph->pending[i] != edge; i++)
+			;
+		for(; i + 1 < graph->pending_count; i++)
+			graph->pending[i] = graph->pending[i + 1];
+		graph->pending_count--;
+	}
+	
+	graph->back_edges -= edge->back;
+	pool_free(graph->edge_pool, edge);
+}
+
+/* removes an edge however many times it was connected */
+static
+void
+cut_edge(Graph graph, Edge *edge)
+{
+	Node *source = edge->source;
+	int live = edge->port != ORDER_PORT && edge->dest->users > 0;
+	
+	unlink_edge(graph, edge);
+	if(live)
+		remove_user(graph, source);
+}
+
+/*
+makes room for an edge from source to dest, where dest currently comes first.
+the nodes that have to move are those reachable from dest that come no later
+than source (the forward set), and those that reach source that come no
+earlier than dest (the backward set). they're given the same positions they
+held, backward set first. returns 0 if source is reachable from dest.
+
+a feedback edge is followed backwards: it means its dest comes before its source.
+edges still pending in a batch aren't followed.
+*/
+static
+int
+reorder(Graph graph, Node *source, Node *dest)
+{
+	int lower = dest->index, upper = source->index;
+	int forward = 0, backward = 0, top, i, j, k;
+	Node *node;
+	Edge *edge;
+	
+	graph->visit++;
+	
+	/* forward set */
+	top = 0;
+	graph->stack[top++] = dest;
+	dest->mark = graph->visit;
+	while(top > 0) {
+		node = graph->stack[--top];
+		graph->forward[forward++] = node;
+	
+		for(edge = node->outputs; edge != NULL; edge = edge->next_output)
+			if(!edge->back && !edge->pending && !push_forward(graph, edge->dest, source, upper, &top))
+				return 0;
+		for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+			if(edge->back && !push_forward(graph, edge->source, source, upper, &top))
+				return 0;
+	}
+	
+	/* backward set */
+	top = 0;
+	graph->stack[top++] = source;
+	source->mark = graph->visit;
+	while(top > 0) {
+		node = graph->stack[--top];
+		graph->backward[backward++] = node;
+	
+		for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+			if(!edge->back && !edge->pending)
+				push_backward(graph, edge->source, lower, &top);
+		for(edge = node->outputs; edge != NULL; edge = edge->next_output)
+			if(edge->back)
+				push_backward(graph, edge->dest, lower, &top);
+	}
+	
+	qsort(graph->forward, forward, sizeof(Node *), compare_index);
+	qsort(graph->backward, backward, sizeof(Node *), compare_index);
+	
+	/* the positions the two sets hold between them, in order */
+	for(i = j = k = 0; i < backward || j < forward; k++) {
+		if(j == forward || (i < backward && graph->backward[i]->index < graph->forward[j]->index))
+			graph->slots[k] = graph->backward[i++]->index;
+		else
+			graph->slots[k] = graph->forward[j++]->index;
+	}
+	
+	for(k = 0; k < backward; k++) {
+		node = graph->backward[k];
+		node->index = graph->slots[k];
+		graph->order[node->index] = node;
+	}
+	for(j = 0; j < forward; j++, k++) {
+		node = graph->forward[j];
+		node->index = graph->slots[k];
+		graph->order[node->index] = node;
+	}
+	
+	return 1;
+}
+
+/* pushes a node for the forward search; returns 0 if it is source (there's a loop) */
+static
+int
+push_forward(Graph graph, Node *node, Node *source, int upper, int *top)
+{
+	if(node == source)
+		return 0;
+	
+	if(node->mark != graph->visit && node->index < upper) {
+		node->mark = graph->visit;
+		graph->stack[(*top)++] = node;
+	}
+	
+	return 1;
+}
+
+static
+void
+push_backward(Graph graph, Node *node, int lower, int *top)
+{
+	if(node->mark != graph->visit && node->index > lower) {
+		node->mark = graph->visit;
+		graph->stack[(*top)++] = node;
+	}
+}
+
+/* a live node has started using this node's output */
+static
+void
+add_user(Node *node)
+{
+	Edge *edge;
+	
+	if(node->users++ > 0)
+		return;
+	
+	/* it has just come alive, so everything feeding it has too */
+	for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+		if(edge->port != ORDER_PORT)
+			add_user(edge->source);
+}
+
+/*
+a live node has stopped using this node's output. with feedback edges,
+a node that still has users may only be kept alive by a loop that no
+longer reaches a sink, so it's set aside to be checked.
+*/
+static
+void
+remove_user(Graph graph, Node *node)
+{
+	Edge *edge;
+	
+	/* (a pending edge may yet close a loop) */
+	if(--node->users > 0) {
+		if(graph->back_edges + graph->pending_count > 0 && !node->suspect) {
+			node->suspect = 1;
+			graph->suspects[graph->suspect_count++] = node;
+		}
+		return;
+	}
+	
+	for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+		if(edge->port != ORDER_PORT)
+			remove_user(graph, edge->source);
+}
+
+/*
+for each suspect that is still live, looks for a sink downstream. if there
+is none, nothing it feeds is live, directly or not, so all of them die.
+*/
+static
+void
+collect_dead_loops(Graph graph)
+{
+	Node *node, *suspect;
+	Edge *edge;
+	int i, top, found, dead;
+	
+	for(i = 0; i < graph->suspect_count; i++) {
+		suspect = graph->suspects[i];
+		suspect->suspect = 0;
+		if(suspect->users == 0)
+			continue;
+		
+		graph->visit++;
+		top = 0;
+		dead = 0;
+		found = 0;
+		graph->stack[top++] = suspect;
+		suspect->mark = graph->visit;
+		while(top > 0 && !found) {
+			node = graph->stack[--top];
+			graph->forward[dead++] = node;
+			found = node->sink;
+			
+			for(edge = node->outputs; edge != NULL; edge = edge->next_output) {
+				/* (a dead node can't lead to a sink) */
+				if(edge->port != ORDER_PORT && edge->dest->users > 0 && edge->dest->mark != graph->visit) {
+					edge->dest->mark = graph->visit;
+					graph->stack[top++] = edge->dest;
+				}
+			}
+		}
+		
+		if(found)
+			continue;
+		
+		/* nothing downstream counts as a user any more, and it all stops using what feeds it */
+		while(dead > 0) {
+			node = graph->forward[--dead];
+			node->users = 0;
+			for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+				if(edge->port != ORDER_PORT && edge->source->mark != graph->visit)
+					remove_user(graph, edge->source);
+		}
+	}
+	
+	graph->suspect_count = 0;
+}
+
+/* replaces the edges that order the sinks; those that disagree with a connection are left out */
+static
+void
+order_sinks(Graph graph)
+{
+	int i;
+	
+	unorder_sinks(graph);
+	
+	/* (not during a batch: they're ordered when it commits) */
+	if(graph->batch > 0)
+		return;
+	
+	for(i = 1; i < graph->sink_count; i++)
+		link_edge(graph, graph->sinks[i - 1], graph->sinks[i], ORDER_PORT, 0);
+}
+
+static
+void
+unorder_sinks(Graph graph)
+{
+	int i;
+	
+	for(i = 0; i < graph->sink_count; i++)
+		unlink_order_edges(graph, graph->sinks[i]);
+}
+
+static
+void
+unlink_order_edges(Graph graph, Node *node)
+{
+	Edge *edge, *next;
+	
+	for(edge = node->outputs; edge != NULL; edge = next) {
+		next = edge->next_output;
+		if(edge->port == ORDER_PORT)
+			unlink_edge(graph, edge);
+	}
+}
+
+static
+int
+compare_index(const void *a, const void *b)
+{
+	return (*(Node **)a)->index - (*(Node **)b)->index;
+}
+
+/* appends an entry to the batch log; NULL if out of memory */
+static
+Op *
+log_op(Graph graph, int op)
+{
+	Op *entry;
+	
+	if(graph->log_count == graph->log_capacity) {
+		int capacity = graph->log_capacity > 0 ? graph->log_capacity * 2 : INITIAL_CAPACITY;
+		Op *log = (Op *)ckv_realloc(graph->log, sizeof(Op) * capacity);
+		if(log == NULL)
+			return NULL;
+		graph->log = log;
+		graph->log_capacity = capacity;
+	}
+	
+	/* (while rolling back, the entry is just scratch space) */
+	entry = &graph->log[graph->undoing ? graph->log_count : graph->log_count++];
+	entry->op = op;
+	entry->source = NULL;
+	entry->dest = NULL;
+	
+	return entry;
+}
+
+/* forgets the entry just logged, for a change that failed */
+static
+void
+drop_op(Graph graph)
+{
+	if(!graph->undoing)
+		graph->log_count--;
+}
+
+static
+void
+undo_op(Graph graph, Op *op)
+{
+	switch(op->op) {
+	case OP_CONNECT:
+		graph_disconnect(graph, op->source, op->dest, op->port);
+		break;
+	case OP_DISCONNECT:
+		graph_connect(graph, op->source, op->dest, op->port);
+		break;
+	case OP_ADD_SINK:
+		if(op->sink)
+			graph_add_sink(graph, op->source, op->priority);
+		else
+			graph_remove_sink(graph, op->source);
+		break;
+	case OP_REMOVE_SINK:
+		graph_add_sink(graph, op->source, op->priority);
+		break;
+	}
+}
+
+/* puts the pending edges into the order once the outermost batch is closed */
+static
+void
+end_batch(Graph graph)
+{
+	graph->log_count = 0;
+	
+	if(graph->pending_count * SORT_FRACTION < graph->size || !sort_all(graph))
+		order_pending(graph);
+	
+	order_sinks(graph);
+}
+
+/*
+orders the whole graph from scratch, keeping the old order where it can
+(Kahn's algorithm, taking the ready node that came first each time). as in
+reorder(), a feedback edge means its dest comes before its source.
+returns 0, leaving the order as it was, if the pending edges close a loop.
+*/
+static
+int
+sort_all(Graph graph)
+{
+	int *before = graph->slots; /* how many nodes that must come first aren't yet sorted, by old index */
+	Node **sorted = graph->forward;
+	Node *node;
+	Edge *edge;
+	int i, count = 0, next = 0;
+	
+	for(i = 0; i < graph->size; i++)
+		before[i] = 0;
+	for(i = 0; i < graph->size; i++) {
+		for(edge = graph->order[i]->outputs; edge != NULL; edge = edge->next_output) {
+			if(edge->back)
+				before[edge->source->index]++;
+			else
+				before[edge->dest->index]++;
+		}
+	}
+	
+	for(i = 0; i < graph->size; i++)
+		if(before[i] == 0)
+			ready(graph, graph->order[i], &count);
+	
+	while(count > 0) {
+		node = take_ready(graph, &count);
+		sorted[next++] = node;
+		for(edge = node->outputs; edge != NULL; edge = edge->next_output)
+			if(!edge->back && --before[edge->dest->index] == 0)
+				ready(graph, edge->dest, &count);
+		for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+			if(edge->back && --before[edge->source->index] == 0)
+				ready(graph, edge->source, &count);
+	}
+	
+	if(next < graph->size)
+		return 0;
+	
+	for(i = 0; i < graph->size; i++) {
+		graph->order[i] = sorted[i];
+		sorted[i]->index = i;
+	}
+	for(i = 0; i < graph->pending_count; i++)
+		graph->pending[i]->pending = 0;
+	graph->pending_count = 0;
+	
+	return 1;
+}
+
+/* adds a node to the ready nodes, a heap (by old index) in the stack */
+static
+void
+ready(Graph graph, Node *node, int *count)
+{
+	Node **heap = graph->stack;
+	int i = (*count)++;
+	
+	for(; i > 0 && heap[(i - 1) / 2]->index > node->index; i = (i - 1) / 2)
+		heap[i] = heap[(i - 1) / 2];
+	heap[i] = node;
+}
+
+/* removes the ready node that came first */
+static
+Node *
+take_ready(Graph graph, int *count)
+{
+	Node **heap = graph->stack;
+	Node *first = heap[0];
+	Node *last = heap[--(*count)];
+	int i = 0, child;
+	
+	for(; (child = i * 2 + 1) < *count; i = child) {
+		if(child + 1 < *count && heap[child + 1]->index < heap[child]->index)
+			child++;
+		if(last->index <= heap[child]->index)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+	
+	return first;
+}
+
+/* takes the pending edges into the order one at a time, as if they were connected outside a batch */
+static
+void
+order_pending(Graph graph)
+{
+	Edge *edge;
+	int i;
+	
+	for(i = 0; i < graph->pending_count; i++) {
+		edge = graph->pending[i];
+		edge->pending = 0;
+		if(edge->source->index > edge->dest->index && !reorder(graph, edge->source, edge->dest)) {
+			/* it closes a loop */
+			edge->back = 1;
+			graph->back_edges++;
+		}
+	}
+	
+	graph->pending_count = 0;
+}
@@ -0,0 +1,93 @@
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+/*
+
+the ugen graph: which ugens feed which, and the order to tick them in.
+
+the graph keeps its nodes in a topological order (every source before
+all of its destinations), updating it as edges are added rather than
+sorting the whole graph again (Pearce & Kelly, "A Dynamic Topological
+Sort Algorithm for Directed Acyclic Graphs"). an edge that only agrees
+with the current order costs nothing; one that doesn't only reorders
+the nodes between its endpoints that it actually affects.
+
+a connection that would close a loop becomes the loop's feedback edge.
+it is left out of the order (its dest is kept before its source
+instead), so the loop is broken there with a delay of one sample, and
+ticking stays a single pass over the nodes. it stays a feedback edge
+until it is disconnected.
+
+a node is live if it is a sink or feeds a live node. only live nodes
+need to be ticked. liveness is kept as a count of users on each node,
+so it is also updated incrementally. a loop can count itself as a user,
+so when a graph has feedback edges, a node that loses a user but stays
+live is checked for a path to a sink.
+
+sinks are kept in order of priority, and are also ordered that way in
+the graph, as far as their connections allow.
+
+changes can be made in a batch. edges added during a batch take effect
+(and count toward liveness) at once, but the order isn't touched until
+the batch commits, when it is fixed up for all of them together, with
+a single sort if there are many. a batch can instead be rolled back,
+undoing every change made in it. batches nest. the order isn't valid
+while a batch is open, so the graph mustn't be ticked then.
+
+*/
+
+typedef struct _Node Node;
+typedef struct _Edge Edge;
+typedef struct _Graph *Graph;
+
+struct _Edge {
+	Node *source;
+	Node *dest;
+	int port; /* which of the dest's inputs; negative for edges that only constrain the order */
+	int count; /* how many times it has been connected */
+	int back; /* a feedback edge: dest is ticked first, so it reads source's output from the sample before */
+	int pending; /* added during a batch, and not yet in the order */
+	Edge *next_input; /* in dest's list of inputs */
+	Edge *next_output; /* in source's list of outputs */
+};
+
+struct _Node {
+	/* for the graph's owner */
+	int ref; /* registry reference to the ugen */
+	double last; /* the ugen's output at its last tick */
+	struct _UGen *native; /* the ugen's struct if it's native, or NULL */
+
+	/* for the graph */
+	int index; /* position in the order */
+	int users; /* live nodes it feeds, plus one if it's a sink */
+	int sink;
+	double priority;
+	Edge *inputs;
+	Edge *outputs;
+	unsigned int mark;
+	int suspect;
+};
+
+Graph new_graph(void);
+void free_graph(Graph graph);
+
+Node *graph_add_node(Graph graph); /* returns NULL if out of memory */
+void graph_remove_node(Graph graph, Node *node); /* along with its edges; the nodes after it move up */
+int graph_size(Graph graph);
+Node *graph_node(Graph graph, int index); /* nodes in tick order */
+
+/* these return 1 on success, -1 if out of memory */
+int graph_connect(Graph graph, Node *source, Node *dest, int port);
+int graph_disconnect(Graph graph, Node *source, Node *dest, int port); /* returns 0 if there was no such edge */
+
+/* sinks with lower priorities are ticked first; ties go to the older sink */
+int graph_add_sink(Graph graph, Node *node, double priority);
+void graph_remove_sink(Graph graph, Node *node);
+
+int graph_begin(Graph graph); /* returns 1, or -1 if out of memory */
+void graph_commit(Graph graph);
+void graph_rollback(Graph graph); /* undoes the innermost batch and closes it */
+int graph_in_batch(Graph graph);
+
+#endif
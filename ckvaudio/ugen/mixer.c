@@ -0,0 +1,200 @@
+
+#include <string.h>
+
+#include "ugen.h"
+#include "vmath.h"
+#include "../../alloc.h"
+
+/*
+
+Mixer(inputs, outputs): mixes any number of inputs to one or more outputs
+through a matrix of gains.
+
+input i is port i (connect(voice, mixer, i)); the default port is input 1.
+at first, every input feeds every output at gain 1. the mixer's own output
+is output 1, and mixer:output(j) (or mixer[j]) returns a ugen for output j.
+
+methods (inputs and outputs are numbered from 1):
+  mixer:gain(i, j)        returns the gain from input i to output j
+  mixer:gain(i, j, gain)  sets it
+  mixer:mute(i, muted)    mutes input i (or unmutes it if muted is false)
+
+*/
+
+typedef struct _Mixer {
+	UGen ugen;
+	int inputs;
+	int outputs;
+	double *gains; /* by output, then input; what's used, so 0 where an input is muted */
+	double *levels; /* the gains as set, whether muted or not */
+	char *muted;
+	double *out;
+} Mixer;
+
+static void
+mixer_tick(UGen *ugen)
+{
+	Mixer *mixer = (Mixer *)ugen;
+	int j;
+	
+	ugen->in[1] += ugen->in[0];
+	
+	for(j = 0; j < mixer->outputs; j++)
+		mixer->out[j] = vmath_dot(mixer->gains + j * mixer->inputs, ugen->in + 1, mixer->inputs);
+	
+	ugen->last = mixer->out[0];
+}
+
+static double
+mixer_read(UGen *ugen, int j)
+{
+	return ((Mixer *)ugen)->out[j];
+}
+
+static void
+mixer_release(UGen *ugen)
+{
+	Mixer *mixer = (Mixer *)ugen;
+	
+	ckv_free(mixer->gains);
+	ckv_free(mixer->levels);
+	ckv_free(mixer->muted);
+	ckv_free(mixer->out);
+}
+
+/* allocates the mixer's arrays, raising an error if it can't */
+static void
+mixer_alloc(lua_State *L, Mixer *mixer)
+{
+	int size = mixer->inputs * mixer->outputs;
+	
+	mixer->gains = (double *)ckv_malloc(sizeof(double) * size);
+	mixer->levels = (double *)ckv_malloc(sizeof(double) * size);
+	mixer->muted = (char *)ckv_malloc(mixer->inputs);
+	mixer->out = (double *)ckv_malloc(sizeof(double) * mixer->outputs);
+	if(mixer->gains == NULL || mixer->levels == NULL || mixer->muted == NULL || mixer->out == NULL)
+		luaL_error(L, "out of memory creating a mixer");
+}
+
+/* a copy starts out with the original's arrays, and its "outputs" */
+static void
+mixer_copy(lua_State *L, UGen *ugen, int index)
+{
+	Mixer *mixer = (Mixer *)ugen;
+	Mixer original = *mixer;
+	int size = mixer->inputs * mixer->outputs;
+	
+	mixer_alloc(L, mixer);
+	memcpy(mixer->gains, original.gains, sizeof(double) * size);
+	memcpy(mixer->levels, original.levels, sizeof(double) * size);
+	memcpy(mixer->muted, original.muted, mixer->inputs);
+	memcpy(mixer->out, original.out, sizeof(double) * mixer->outputs);
+	
+	lua_newtable(L);
+	lua_setfield(L, index, "outputs");
+}
+
+static int mixer_gain(lua_State *L);
+static int mixer_mute(lua_State *L);
+static int mixer_output(lua_State *L);
+
+static const luaL_Reg mixer_methods[] = {
+	{ "gain", mixer_gain },
+	{ "mute", mixer_mute },
+	{ "output", mixer_output },
+	{ NULL, NULL }
+};
+
+static const UGenClass mixer_class = { "Mixer", sizeof(Mixer), NULL, NULL, mixer_methods, mixer_tick, mixer_release, mixer_copy };
+
+/* args: mixer, input, output, gain (optional) */
+static int
+mixer_gain(lua_State *L)
+{
+	Mixer *mixer = (Mixer *)ugen_check(L, 1, &mixer_class);
+	int i = luaL_checkint(L, 2) - 1;
+	int j = luaL_checkint(L, 3) - 1;
+	int k = j * mixer->inputs + i;
+	
+	luaL_argcheck(L, i >= 0 && i < mixer->inputs, 2, "no such input");
+	luaL_argcheck(L, j >= 0 && j < mixer->outputs, 3, "no such output");
+	
+	if(lua_isnoneornil(L, 4)) {
+		lua_pushnumber(L, mixer->levels[k]);
+		return 1;
+	}
+	
+	mixer->levels[k] = luaL_checknumber(L, 4);
+	mixer->gains[k] = mixer->muted[i] ? 0 : mixer->levels[k];
+	
+	return 0;
+}
+
+/* args: mixer, input, muted (default true) */
+static int
+mixer_mute(lua_State *L)
+{
+	Mixer *mixer = (Mixer *)ugen_check(L, 1, &mixer_class);
+	int i = luaL_checkint(L, 2) - 1;
+	int j;
+	
+	luaL_argcheck(L, i >= 0 && i < mixer->inputs, 2, "no such input");
+	
+	mixer->muted[i] = lua_isnone(L, 3) || lua_toboolean(L, 3);
+	for(j = 0; j < mixer->outputs; j++)
+		mixer->gains[j * mixer->inputs + i] = mixer->muted[i] ? 0 : mixer->levels[j * mixer->inputs + i];
+	
+	return 0;
+}
+
+/* args: mixer, output */
+static int
+mixer_output(lua_State *L)
+{
+	Mixer *mixer = (Mixer *)ugen_check(L, 1, &mixer_class);
+	int j = luaL_checkint(L, 2) - 1;
+	
+	luaL_argcheck(L, j >= 0 && j < mixer->outputs, 2, "no such output");
+	ugen_push_output(L, 1, "mixer", j, mixer_read);
+	
+	return 1;
+}
+
+/* args: inputs, outputs (default 1) */
+static int
+new_mixer(lua_State *L)
+{
+	int inputs = luaL_checkint(L, 1);
+	int outputs = luaL_optint(L, 2, 1);
+	Mixer *mixer;
+	int k;
+	
+	luaL_argcheck(L, inputs > 0, 1, "a mixer needs at least one input");
+	luaL_argcheck(L, outputs > 0, 2, "a mixer needs at least one output");
+	
+	mixer = (Mixer *)ugen_new_ports(L, &mixer_class, inputs + 1);
+	mixer->inputs = inputs;
+	mixer->outputs = outputs;
+	mixer_alloc(L, mixer);
+	
+	for(k = 0; k < inputs * outputs; k++)
+		mixer->gains[k] = mixer->levels[k] = 1.0;
+	memset(mixer->muted, 0, inputs);
+	memset(mixer->out, 0, sizeof(double) * outputs);
+	
+	lua_newtable(L);
+	lua_setfield(L, -2, "outputs");
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_mixer(lua_State *L)
+{
+	lua_pushcfunction(L, new_mixer);
+	lua_setglobal(L, "Mixer");
+	
+	return 0;
+}
@@ -1,5 +1,183 @@
 
+#include <math.h>
+#include <stddef.h>
+
 #include "ugen.h"
+#include "vmath.h"
+
+/*
+
+all the oscillators share a struct; width is only used by PulseOsc.
+
+SinOsc takes its sine from vmath_sin, as OscBank does. the jumps in SawOsc,
+SqrOsc and PulseOsc are band-limited with PolyBLEP (Valimaki & Huovilainen,
+"Antialiasing Oscillators in Subtractive Synthesis"): the samples on either
+side of a jump are nudged toward a band-limited step, which takes away most
+of the aliasing of the naive waveform for the cost of a few multiplies.
+
+*/
+
+typedef struct _Osc {
+	UGen ugen;
+	double freq;
+	double phase; /* 0 to 1 */
+	double gain;
+	double width;
+} Osc;
+
+/* ports, numbered from 1 after "default" */
+#define PORT_FREQ (1)
+#define PORT_PHASE (2)
+#define PORT_GAIN (3)
+#define PORT_WIDTH (4)
+
+#define TWO_PI (6.28318530717958647692)
+
+static const char *const osc_ports[] = { "freq", "phase", "gain", NULL };
+static const char *const pulse_ports[] = { "freq", "phase", "gain", "width", NULL };
+
+static const UGenField osc_fields[] = {
+	{ "freq", offsetof(Osc, freq) },
+	{ "phase", offsetof(Osc, phase) },
+	{ "gain", offsetof(Osc, gain) },
+	{ "width", offsetof(Osc, width) },
+	{ NULL, 0 }
+};
+
+/* returns the phase to read this sample, and advances the oscillator's phase by *dt (made positive) */
+static double
+osc_step(Osc *osc, double *dt)
+{
+	double *in = osc->ugen.in;
+	double phase = osc->phase + in[PORT_PHASE];
+	double step = (osc->freq + in[PORT_FREQ]) / osc->ugen.sample_rate;
+	
+	osc->phase += step;
+	osc->phase -= floor(osc->phase);
+	
+	*dt = fabs(step) < 0.5 ? fabs(step) : 0.5;
+	return phase - floor(phase);
+}
+
+/*
+what to subtract from a waveform that falls from 1 to -1 when t (the phase
+since the fall, from 0 to 1) wraps, given the phase per sample dt
+*/
+static double
+poly_blep(double t, double dt)
+{
+	if(t < dt) {
+		t /= dt;
+		return t + t - t * t - 1.0;
+	}
+	if(t > 1.0 - dt) {
+		t = (t - 1.0) / dt;
+		return t * t + t + t + 1.0;
+	}
+	return 0.0;
+}
+
+static double
+osc_gain(Osc *osc)
+{
+	return osc->gain + osc->ugen.in[PORT_GAIN];
+}
+
+static void
+sinosc_tick(UGen *ugen)
+{
+	Osc *osc = (Osc *)ugen;
+	double dt, x;
+	
+	x = TWO_PI * osc_step(osc, &dt);
+	vmath_sin(&ugen->last, &x, 1);
+	ugen->last *= osc_gain(osc);
+}
+
+static void
+sawosc_tick(UGen *ugen)
+{
+	Osc *osc = (Osc *)ugen;
+	double dt;
+	double phase = osc_step(osc, &dt);
+	
+	/* it only falls by 1 */
+	ugen->last = (phase - 0.5 * poly_blep(phase, dt)) * osc_gain(osc);
+}
+
+static void
+sqrosc_tick(UGen *ugen)
+{
+	Osc *osc = (Osc *)ugen;
+	double dt;
+	double phase = osc_step(osc, &dt);
+	double up = phase + 0.5;
+	double sample = phase < 0.5 ? -1.0 : 1.0;
+	
+	sample -= poly_blep(phase, dt);
+	sample += poly_blep(up - floor(up), dt);
+	
+	ugen->last = sample * osc_gain(osc);
+}
+
+static void
+triosc_tick(UGen *ugen)
+{
+	Osc *osc = (Osc *)ugen;
+	double dt;
+	double phase = osc_step(osc, &dt);
+	
+	/* a triangle has no jumps to smooth */
+	ugen->last = (phase < 0.5 ? phase * 4 - 1 : phase * (-4) + 3) * osc_gain(osc);
+}
+
+static void
+pulseosc_tick(UGen *ugen)
+{
+	Osc *osc = (Osc *)ugen;
+	double dt;
+	double phase = osc_step(osc, &dt);
+	double width = osc->width + ugen->in[PORT_WIDTH];
+	double down = phase - width;
+	double sample = phase < width ? 1.0 : -1.0;
+	
+	/* up at phase 0, down at the width (unless it's outside the period, so there's no jump) */
+	if(width > 0 && width < 1) {
+		sample += poly_blep(phase, dt);
+		sample -= poly_blep(down - floor(down), dt);
+	}
+	
+	ugen->last = sample * osc_gain(osc);
+}
+
+static const UGenClass sinosc_class = { "SinOsc", sizeof(Osc), osc_ports, osc_fields, NULL, sinosc_tick, NULL, NULL };
+static const UGenClass sawosc_class = { "SawOsc", sizeof(Osc), osc_ports, osc_fields, NULL, sawosc_tick, NULL, NULL };
+static const UGenClass sqrosc_class = { "SqrOsc", sizeof(Osc), osc_ports, osc_fields, NULL, sqrosc_tick, NULL, NULL };
+static const UGenClass triosc_class = { "TriOsc", sizeof(Osc), osc_ports, osc_fields, NULL, triosc_tick, NULL, NULL };
+static const UGenClass pulseosc_class = { "PulseOsc", sizeof(Osc), pulse_ports, osc_fields, NULL, pulseosc_tick, NULL, NULL };
+
+/* args: freq (default 440); upvalue: class */
+static int
+new_osc(lua_State *L)
+{
+	const UGenClass *cls = (const UGenClass *)lua_touserdata(L, lua_upvalueindex(1));
+	double freq = luaL_optnumber(L, 1, 440.0);
+	Osc *osc = (Osc *)ugen_new(L, cls);
+	
+	osc->freq = freq;
+	osc->gain = 1.0;
+	osc->width = 0.5;
+	
+	return 1;
+}
+
+static void
+register_osc(lua_State *L, const UGenClass *cls)
+{
+	lua_pushlightuserdata(L, (void *)cls);
+	lua_pushcclosure(L, new_osc, 1);
+	lua_setglobal(L, cls->name);
+}
 
 /* LIBRARY REGISTRATION */
 
@@ -8,112 +186,34 @@
 int
 open_ugen_pulseosc(lua_State *L)
 {
-	(void) luaL_dostring(L,
-	"function PulseOsc(freq)"
-	"  return {"
-	"    last = 0.0,"
-	"    phase = 0.0,"
-	"    freq = freq or 440.0,"
-	"    width = 0.5,"
-	"    tick = function(self)"
-	"      if self.phase < self.width then"
-	"        self.last = 1"
-	"      else"
-	"        self.last = -1"
-	"      end"
-	"      self.phase = (self.phase + self.freq / sample_rate) % 1.0;"
-	"    end,"
-	"  }"
-	"end"
-	);
-	
+	register_osc(L, &pulseosc_class);
 	return 0;
 }
 
 int
 open_ugen_sinosc(lua_State *L)
 {
-	(void) luaL_dostring(L,
-	"function SinOsc(freq)"
-	"  return {"
-	"    last = 0.0,"
-	"    phase = 0.0,"
-	"    freq = freq or 440.0,"
-	"    tick = function(self)"
-	"      self.last = math.sin(self.phase * math.pi * 2.0);"
-	"      self.phase = (self.phase + self.freq / sample_rate) % 1.0;"
-	"    end,"
-	"  }"
-	"end"
-	);
-	
+	register_osc(L, &sinosc_class);
 	return 0;
 }
 
 int
 open_ugen_sqrosc(lua_State *L)
 {
-	(void) luaL_dostring(L,
-	"function SqrOsc(freq)"
-	"  return {"
-	"    last = 0.0,"
-	"    phase = 0.0,"
-	"    freq = freq or 440.0,"
-	"    tick = function(self)"
-	"      if self.phase < 0.5 then"
-	"        self.last = -1;"
-	"      else"
-	"        self.last = 1;"
-	"      end"
-	"      self.phase = (self.phase + self.freq / sample_rate) % 1.0;"
-	"    end,"
-	"  }"
-	"end"
-	);
-	
+	register_osc(L, &sqrosc_class);
 	return 0;
 }
 
 int
 open_ugen_sawosc(lua_State *L)
 {
-	(void) luaL_dostring(L,
-	"function SawOsc(freq)"
-	"  return {"
-	"    last = 0.0,"
-	"    phase = 0.0,"
-	"    freq = freq or 440.0,"
-	"    tick = function(self)"
-	"      self.last = self.phase;"
-	"      self.phase = (self.phase + self.freq / sample_rate) % 1.0;"
-	"    end,"
-	"  }"
-	"end"
-	);
-	
+	register_osc(L, &sawosc_class);
 	return 0;
 }
 
 int
 open_ugen_triosc(lua_State *L)
 {
-	(void) luaL_dostring(L,
-	"function TriOsc(freq)"
-	"  return {"
-	"    last = 0.0,"
-	"    phase = 0.0,"
-	"    freq = freq or 440.0,"
-	"    tick = function(self)"
-	"      if self.phase < 0.5 then"
-	"        self.last = self.phase * 4 - 1"
-	"      else"
-	"        self.last = self.phase * (-4) + 3"
-	"      end"
-	"      self.phase = (self.phase + self.freq / sample_rate) % 1.0;"
-	"    end,"
-	"  }"
-	"end"
-	);
-	
+	register_osc(L, &triosc_class);
 	return 0;
 }
@@ -0,0 +1,230 @@
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "ugen.h"
+#include "vmath.h"
+#include "../../alloc.h"
+
+/*
+
+OscBank(n): n sine partials in one ugen, for additive and organ-style
+patches that would otherwise take n SinOscs and a Gain.
+
+the partials' frequencies, amplitudes and phases (0 to 1) are kept in
+contiguous arrays, so each tick is a pass of vmath_sin over the phases
+and a dot product with the amplitudes, rather than n ugens to tick and
+sum. at first, every partial is silent.
+
+fields: gain (also a port)
+
+methods (partials are numbered from 1):
+  bank:freqs()                 returns the frequencies as a table
+  bank:freqs(t, first)         sets partials first, first + 1, ... (first defaults to 1) from t
+  bank:amps(...), bank:phases(...)  likewise
+  bank:partial(i)              returns partial i's frequency, amplitude and phase
+  bank:partial(i, freq, amp, phase)  sets them (amp and phase are optional)
+
+*/
+
+typedef struct _OscBank {
+	UGen ugen;
+	double gain;
+	int partials;
+	double *freqs;
+	double *amps;
+	double *phases;
+	double *scratch; /* the sines, each tick */
+} OscBank;
+
+#define PORT_GAIN (1)
+
+#define TWO_PI (6.28318530717958647692)
+
+static const char *const oscbank_ports[] = { "gain", NULL };
+
+static const UGenField oscbank_fields[] = {
+	{ "gain", offsetof(OscBank, gain) },
+	{ NULL, 0 }
+};
+
+static void
+oscbank_tick(UGen *ugen)
+{
+	OscBank *bank = (OscBank *)ugen;
+	double *phases = bank->phases;
+	double *scratch = bank->scratch;
+	double rate = 1.0 / ugen->sample_rate;
+	int i, n = bank->partials;
+	
+	for(i = 0; i < n; i++)
+		scratch[i] = phases[i] * TWO_PI;
+	vmath_sin(scratch, scratch, n);
+	ugen->last = vmath_dot(scratch, bank->amps, n) * (bank->gain + ugen->in[PORT_GAIN]);
+	
+	for(i = 0; i < n; i++) {
+		phases[i] += bank->freqs[i] * rate;
+		phases[i] -= floor(phases[i]);
+	}
+}
+
+static void
+oscbank_release(UGen *ugen)
+{
+	OscBank *bank = (OscBank *)ugen;
+	ckv_free(bank->freqs);
+}
+
+/* allocates the bank's arrays (one block, from freqs), raising an error if it can't */
+static void
+oscbank_alloc(lua_State *L, OscBank *bank)
+{
+	int n = bank->partials;
+	
+	bank->freqs = (double *)ckv_malloc(sizeof(double) * 4 * n);
+	if(bank->freqs == NULL)
+		luaL_error(L, "out of memory creating an oscillator bank");
+	
+	bank->amps = bank->freqs + n;
+	bank->phases = bank->amps + n;
+	bank->scratch = bank->phases + n;
+}
+
+/* a copy starts out with the original's partials */
+static void
+oscbank_copy(lua_State *L, UGen *ugen, int index)
+{
+	OscBank *bank = (OscBank *)ugen;
+	double *original = bank->freqs;
+	
+	oscbank_alloc(L, bank);
+	memcpy(bank->freqs, original, sizeof(double) * 4 * bank->partials);
+}
+
+static int oscbank_freqs(lua_State *L);
+static int oscbank_amps(lua_State *L);
+static int oscbank_phases(lua_State *L);
+static int oscbank_partial(lua_State *L);
+
+static const luaL_Reg oscbank_methods[] = {
+	{ "freqs", oscbank_freqs },
+	{ "amps", oscbank_amps },
+	{ "phases", oscbank_phases },
+	{ "partial", oscbank_partial },
+	{ NULL, NULL }
+};
+
+static const UGenClass oscbank_class = { "OscBank", sizeof(OscBank), oscbank_ports, oscbank_fields, oscbank_methods, oscbank_tick, oscbank_release, oscbank_copy };
+
+/* args: bank, table (optional), first (default 1); gets or sets the given array in bulk */
+static int
+oscbank_array(lua_State *L, OscBank *bank, double *array)
+{
+	int first, count, i;
+	
+	if(lua_isnoneornil(L, 2)) {
+		lua_createtable(L, bank->partials, 0);
+		for(i = 0; i < bank->partials; i++) {
+			lua_pushnumber(L, array[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		return 1;
+	}
+	
+	luaL_checktype(L, 2, LUA_TTABLE);
+	first = luaL_optint(L, 3, 1) - 1;
+	count = lua_objlen(L, 2);
+	luaL_argcheck(L, first >= 0 && first + count <= bank->partials, 3, "too many partials");
+	
+	for(i = 0; i < count; i++) {
+		lua_rawgeti(L, 2, i + 1);
+		array[first + i] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	
+	return 0;
+}
+
+static int
+oscbank_freqs(lua_State *L)
+{
+	OscBank *bank = (OscBank *)ugen_check(L, 1, &oscbank_class);
+	return oscbank_array(L, bank, bank->freqs);
+}
+
+static int
+oscbank_amps(lua_State *L)
+{
+	OscBank *bank = (OscBank *)ugen_check(L, 1, &oscbank_class);
+	return oscbank_array(L, bank, bank->amps);
+}
+
+/* phases are kept from 0 to 1 */
+static int
+oscbank_phases(lua_State *L)
+{
+	OscBank *bank = (OscBank *)ugen_check(L, 1, &oscbank_class);
+	int i, n = oscbank_array(L, bank, bank->phases);
+	
+	for(i = 0; i < bank->partials; i++)
+		bank->phases[i] -= floor(bank->phases[i]);
+	
+	return n;
+}
+
+/* args: bank, partial, freq, amp (optional), phase (optional) */
+static int
+oscbank_partial(lua_State *L)
+{
+	OscBank *bank = (OscBank *)ugen_check(L, 1, &oscbank_class);
+	int i = luaL_checkint(L, 2) - 1;
+	
+	luaL_argcheck(L, i >= 0 && i < bank->partials, 2, "no such partial");
+	
+	if(lua_isnoneornil(L, 3)) {
+		lua_pushnumber(L, bank->freqs[i]);
+		lua_pushnumber(L, bank->amps[i]);
+		lua_pushnumber(L, bank->phases[i]);
+		return 3;
+	}
+	
+	bank->freqs[i] = luaL_checknumber(L, 3);
+	if(!lua_isnoneornil(L, 4))
+		bank->amps[i] = luaL_checknumber(L, 4);
+	if(!lua_isnoneornil(L, 5)) {
+		bank->phases[i] = luaL_checknumber(L, 5);
+		bank->phases[i] -= floor(bank->phases[i]);
+	}
+	
+	return 0;
+}
+
+/* args: partials */
+static int
+new_oscbank(lua_State *L)
+{
+	int partials = luaL_checkint(L, 1);
+	OscBank *bank;
+	
+	luaL_argcheck(L, partials > 0, 1, "an oscillator bank needs at least one partial");
+	
+	bank = (OscBank *)ugen_new(L, &oscbank_class);
+	bank->gain = 1.0;
+	bank->partials = partials;
+	oscbank_alloc(L, bank);
+	memset(bank->freqs, 0, sizeof(double) * 4 * partials);
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_oscbank(lua_State *L)
+{
+	lua_pushcfunction(L, new_oscbank);
+	lua_setglobal(L, "OscBank");
+	
+	return 0;
+}
@@ -0,0 +1,117 @@
+
+#include <string.h>
+
+#include "ring.h"
+#include "../../alloc.h"
+
+int
+ring_init(Ring *ring, unsigned int size)
+{
+	unsigned int n = 2;
+	
+	while(n < size)
+		n *= 2;
+	
+	ring->buffer = (float *)ckv_malloc(sizeof(float) * n);
+	if(ring->buffer == NULL)
+		return 0;
+	
+	ring->mask = n - 1;
+	ring->head = ring->tail = 0;
+	
+	return 1;
+}
+
+void
+ring_free(Ring *ring)
+{
+	ckv_free(ring->buffer);
+	ring->buffer = NULL;
+}
+
+unsigned int
+ring_size(Ring *ring)
+{
+	return ring->mask + 1;
+}
+
+unsigned int
+ring_count(Ring *ring)
+{
+	return LOAD(&ring->head) - ring->tail;
+}
+
+float
+ring_peek(Ring *ring, unsigned int i)
+{
+	return ring->buffer[(ring->tail + i) & ring->mask];
+}
+
+unsigned int
+ring_read(Ring *ring, float *out, unsigned int n)
+{
+	unsigned int count = ring_count(ring);
+	unsigned int start = ring->tail & ring->mask;
+	unsigned int first;
+	
+	if(n > count)
+		n = count;
+	
+	/* in up to two pieces, if it wraps */
+	first = ring->mask + 1 - start;
+	if(first > n)
+		first = n;
+	memcpy(out, ring->buffer + start, sizeof(float) * first);
+	memcpy(out + first, ring->buffer, sizeof(float) * (n - first));
+	
+	STORE(&ring->tail, ring->tail + n);
+	
+	return n;
+}
+
+void
+ring_skip(Ring *ring, unsigned int n)
+{
+	STORE(&ring->tail, ring->tail + n);
+}
+
+void
+ring_skip_to(Ring *ring, unsigned int mark)
+{
+	/* counts wrap, so compare the distance */
+	if((int)(mark - ring->tail) > 0)
+		STORE(&ring->tail, mark);
+}
+
+unsigned int
+ring_space(Ring *ring)
+{
+	return ring->mask + 1 - (ring->head - LOAD(&ring->tail));
+}
+
+unsigned int
+ring_write(Ring *ring, const float *in, unsigned int n)
+{
+	unsigned int space = ring_space(ring);
+	unsigned int start = ring->head & ring->mask;
+	unsigned int first;
+	
+	if(n > space)
+		n = space;
+	
+	first = ring->mask + 1 - start;
+	if(first > n)
+		first = n;
+	memcpy(ring->buffer + start, in, sizeof(float) * first);
+	memcpy(ring->buffer, in + first, sizeof(float) * (n - first));
+	
+	STORE(&ring->head, ring->head + n);
+	
+	return n;
+}
+
+unsigned int
+ring_mark(Ring *ring)
+{
+	return ring->head;
+}
@@ -0,0 +1,44 @@
+
+#ifndef RING_H
+#define RING_H
+
+/*
+
+a ring buffer of floats for passing samples between two threads without
+locks: one thread only writes to it, and the other only reads from it.
+
+head and tail count every float ever written and read; they only wrap
+around the buffer (whose size is a power of two) when they're used to
+index it. each side publishes its count after touching the buffer, and
+reads the other side's before, so neither sees a float half-written.
+
+*/
+
+/* acquire loads and release stores, for the words threads share: a ring's head and tail, and the others' flags and counts */
+#define LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, x) __atomic_store_n((p), (x), __ATOMIC_RELEASE)
+
+typedef struct _Ring {
+	float *buffer;
+	unsigned int mask; /* the buffer's size, less 1 */
+	unsigned int head; /* written by the writer */
+	unsigned int tail; /* written by the reader */
+} Ring;
+
+int ring_init(Ring *ring, unsigned int size); /* rounds size up to a power of two; returns 0 if out of memory */
+void ring_free(Ring *ring);
+unsigned int ring_size(Ring *ring);
+
+/* for the reader */
+unsigned int ring_count(Ring *ring); /* floats that can be read */
+float ring_peek(Ring *ring, unsigned int i); /* the ith float that can be read (i < ring_count()) */
+unsigned int ring_read(Ring *ring, float *out, unsigned int n); /* returns how many were read */
+void ring_skip(Ring *ring, unsigned int n); /* n <= ring_count() */
+void ring_skip_to(Ring *ring, unsigned int mark); /* skips what was written before the writer's ring_mark() (if it hasn't been read) */
+
+/* for the writer */
+unsigned int ring_space(Ring *ring); /* floats that can be written */
+unsigned int ring_write(Ring *ring, const float *in, unsigned int n); /* returns how many were written */
+unsigned int ring_mark(Ring *ring); /* where the next float written will be, for the reader to ring_skip_to() */
+
+#endif
@@ -2,349 +2,1580 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswresample/swresample.h>
 #include <libavutil/opt.h>
 
 #include "../../ckvm.h"
+#include "../../alloc.h"
 #include "ugen.h"
+#include "ring.h"
+#include "sndin.h"
 
-typedef struct _SndIn {
+/*
+
+SndIn(filename, prefetch) plays a sound file.
+
+the file's channels are kept as they are: sndin[c] (or sndin:output(c))
+is a ugen for channel c, and the SndIn's own output is their average.
+
+files are decoded by a pool of decoder threads, never by the thread that
+renders audio. each SndIn has a ring per channel that its decoder keeps
+about prefetch samples ahead of it (half a second's worth by default);
+ticking it only reads from the rings. they are filled before SndIn()
+returns, and the decoder is woken once the SndIn has read half of them. if the decoder falls
+behind anyway, the SndIn plays silence until it catches up (or, when
+rendering offline with -s, waits for it). files that are in the cache
+(see CACHE) are played straight from memory instead.
+
+seeking hands the decoder the new position, which it moves to with the
+file and codec it already has open; the SndIn plays silence until the
+decoder has (or, offline, waits). looping is done by the decoder too, so
+the rings run straight from the end of the loop back into its start.
+compressed files are seeked with an index of their packets, built by
+reading through the file on the first seek, and then decoded from the
+packet before the new position.
+
+fields: rate (how many samples of the file to move through per sample;
+1 by default), loop (set it to 1 to loop the region), and channels,
+duration (in samples), filename, and done (an Event, broadcast when the file or region
+runs out; it is also the SndIn's "event")
+
+methods (positions are in samples from the start of the file):
+  sndin:seek(t)             plays from t on (within the region), even if the SndIn was done
+  sndin:region(start, len)  plays (and loops) only len samples from start (len defaults to the rest of the file)
+  sndin:region()            plays the whole file again
+  sndin:output(c)           returns a ugen for channel c (numbered from 1)
+  sndin:close()             stops playing and closes the file
+
+preload{filename, ...} has the decoder threads put files in the cache
+ahead of time.
+
+*/
+
+#define DECODER_THREADS (2)
+#define DECODER_POLL_NS (5000000) /* how often idle decoders look for SndIns that have drained their rings */
+#define DEFAULT_PREFETCH (0.5) /* seconds */
+#define WAIT_NS (100000) /* how long an offline SndIn sleeps at a time while its decoder catches up */
+#define SEEK_PREROLL (2) /* packets decoded before the one holding a seek's position, for codecs that carry state across packets */
+
+/* where a packet of a compressed file is, for seeking */
+typedef struct _IndexEntry {
+	int64_t pts; /* in the stream's time base */
+	int64_t pos; /* in bytes */
+} IndexEntry;
+
+typedef struct _Decoder {
+	/* only used by the thread decoding it */
 	AVFormatContext *pFormatCtx;
 	AVCodecContext *pCodecCtx;
 	AVPacket decodingPacket;
 	AVFrame *frame;
 	SwrContext *resampler;
 	int audioStreamIndex; /* which stream is audio */
+	int sample_rate; /* of the samples it puts out */
+	int channels; /* the file's, which are kept apart */
 
-	float *buffer;
+	float **buffers; /* converted samples waiting to go into the rings, a plane per channel */
+	int bufferSize; /* samples allocated in each plane; they are only reallocated to grow */
 	int samplesLeft;
-	float nextSampleIndex; /* can advance at fractional rates */
+	int nextSampleIndex;
 
-	int eof, closed;
+	int64_t position; /* of buffers[c][nextSampleIndex] in the file, in samples at sample_rate */
+	int64_t discard; /* samples before this are decoded but dropped, after a seek */
+	int resync; /* position is a guess until the next frame's timestamp */
+	int64_t start, end; /* the region; end < 0 is the end of the file */
+	IndexEntry *index; /* of the packets, built on the first seek; NULL if there isn't one yet */
+	int indexSize;
+	int indexed; /* the index has been built (or isn't needed) */
+	unsigned int handled; /* the last request seeked to */
+
+	/*
+	shared with the SndIn. there's a ring per channel, filled in lockstep, each
+	before the next; so the last ring's count is the one the SndIn can read,
+	and (since it reads them in the same order) its space is what can be written.
+	*/
+	Ring *rings;
+	int eof; /* everything has been put in the rings */
+	int wanted; /* the rings need filling */
+	int closed; /* the SndIn has let go, so the decoder can be freed */
+	int loop; /* go back to the region's start at its end */
+	long long length; /* of the file in samples, once the decoder has got to its end; -1 before */
+
+	/*
+	a seek, written by the SndIn: requests is made odd while it writes the rest,
+	so the decoder can tell if it's read half of one. when the decoder has seeked,
+	it sets seeked to requests; what it put in the rings before seekHead is stale.
+	*/
+	unsigned int requests;
+	long long requestStart, requestEnd, requestTarget;
+	unsigned int seeked;
+	unsigned int seekHead;
+
+	/* the pool's, under its lock */
+	int busy; /* a decoder thread is filling it */
+	struct _Decoder *next;
+} Decoder;
+
+typedef struct _CacheEntry CacheEntry;
+
+typedef struct _SndIn {
+	UGen ugen;
+	double rate;
+	double skip; /* samples to move through before the next one to play */
+	int prefetch;
+	int wait; /* for the decoder when it falls behind, rather than playing silence */
+	int done;
+	double loop;
+	double start, end; /* the region; end < 0 is the end of the file */
+	double position; /* in the file, of the sample being played */
+	Decoder *decoder; /* if it's streaming the file */
+	int looping; /* what the decoder was last told loop was */
+	int pending; /* the decoder hasn't done the last seek yet */
+	unsigned int request; /* the last seek */
+	CacheEntry *entry; /* if it's playing the file from the cache */
+	int channels;
+	double *out; /* this sample of each channel */
 } SndIn;
 
-static int sndin_handle_packet(SndIn *sndin); /* returns number of samples in frame */
-static void sndin_handle_frame(SndIn *sndin);
+static const UGenField sndin_fields[] = {
+	{ "rate", offsetof(SndIn, rate) },
+	{ "loop", offsetof(SndIn, loop) },
+	{ NULL, 0 }
+};
+
+/* the decoders being filled by the threads, and the lock on the list */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static Decoder *pool = NULL;
+static int pool_started = 0;
+
+
+/* DECODING */
+
+static int decoder_handle_packet(Decoder *decoder); /* returns number of samples in frame */
+static void decoder_handle_frame(Decoder *decoder);
+static int64_t decoder_samples(Decoder *decoder, int64_t pts);
 
 /* returns 0 on failure */
 static
 int
-sndin_open(SndIn *sndin, const char *filename, int out_sample_rate)
+decoder_open(Decoder *decoder, const char *filename, int out_sample_rate)
 {
 	AVCodec *pCodec;
-
-	sndin->pFormatCtx = NULL;
-	sndin->pCodecCtx = NULL;
-	sndin->frame = NULL;
-	sndin->decodingPacket.size = 0;
-	sndin->buffer = NULL;
-
-	sndin->samplesLeft = sndin->nextSampleIndex = 0;
-	sndin->eof = 0;
-	sndin->closed = 0;
-
+	int64_t layout;
+	
+	decoder->pFormatCtx = NULL;
+	decoder->pCodecCtx = NULL;
+	decoder->frame = NULL;
+	decoder->decodingPacket.size = 0;
+	decoder->buffers = NULL;
+	decoder->bufferSize = 0;
+	decoder->rings = NULL;
+	
+	decoder->samplesLeft = decoder->nextSampleIndex = 0;
+	decoder->sample_rate = out_sample_rate;
+	decoder->position = decoder->discard = 0;
+	decoder->resync = 0;
+	decoder->start = 0;
+	decoder->end = -1;
+	decoder->index = NULL;
+	decoder->indexSize = 0;
+	decoder->indexed = 0;
+	decoder->handled = 0;
+	
+	decoder->eof = 0;
+	decoder->wanted = 0;
+	decoder->closed = 0;
+	decoder->loop = 0;
+	decoder->length = -1;
+	decoder->requests = decoder->seeked = 0;
+	decoder->busy = 0;
+	decoder->next = NULL;
+	
 	/* Register all formats and codecs */
 	av_register_all();
-
+	
 	/* open audio file */
-	if(avformat_open_input(&sndin->pFormatCtx, filename, NULL, NULL) != 0)
+	if(avformat_open_input(&decoder->pFormatCtx, filename, NULL, NULL) != 0)
 		return 0;
-
+	
 	/* get stream information */
-	if (avformat_find_stream_info(sndin->pFormatCtx, NULL) < 0) {
-		avformat_close_input(&sndin->pFormatCtx);
+	if (avformat_find_stream_info(decoder->pFormatCtx, NULL) < 0) {
+		avformat_close_input(&decoder->pFormatCtx);
 		return 0; /* Couldn't find stream information */
 	}
-
+	
 	/* identify best audio stream */
-	sndin->audioStreamIndex = av_find_best_stream(sndin->pFormatCtx, AVMEDIA_TYPE_AUDIO, -1, -1, &pCodec, 0);
-	if (sndin->audioStreamIndex < 0) {
-		avformat_close_input(&sndin->pFormatCtx);
+	decoder->audioStreamIndex = av_find_best_stream(decoder->pFormatCtx, AVMEDIA_TYPE_AUDIO, -1, -1, &pCodec, 0);
+	if (decoder->audioStreamIndex < 0) {
+		avformat_close_input(&decoder->pFormatCtx);
 		return 0;
 	}
-
+	
 	/* allocate audio buffer */
-	sndin->frame = avcodec_alloc_frame();
-	if (!sndin->frame) {
-		avformat_close_input(&sndin->pFormatCtx);
+	decoder->frame = avcodec_alloc_frame();
+	if (!decoder->frame) {
+		avformat_close_input(&decoder->pFormatCtx);
 		return 0;
 	}
-
+	
 	/* Get the codec context for the audio stream */
-	AVStream *audioStream = sndin->pFormatCtx->streams[sndin->audioStreamIndex];
-	sndin->pCodecCtx = audioStream->codec;
-	sndin->pCodecCtx->codec = pCodec;
-
-	if (avcodec_open2(sndin->pCodecCtx, sndin->pCodecCtx->codec, NULL) != 0) {
-		av_free(sndin->frame);
-		avformat_close_input(&sndin->pFormatCtx);
+	AVStream *audioStream = decoder->pFormatCtx->streams[decoder->audioStreamIndex];
+	decoder->pCodecCtx = audioStream->codec;
+	decoder->pCodecCtx->codec = pCodec;
+	
+	if (avcodec_open2(decoder->pCodecCtx, decoder->pCodecCtx->codec, NULL) != 0) {
+		av_free(decoder->frame);
+		avformat_close_input(&decoder->pFormatCtx);
 		return 0;
 	}
-
-	/* initialize a converter from the input sample format to float samples */
-	sndin->resampler = swr_alloc();
-	av_opt_set_int(sndin->resampler, "in_channel_layout", sndin->pCodecCtx->channel_layout ? sndin->pCodecCtx->channel_layout : av_get_default_channel_layout(sndin->pCodecCtx->channels), 0);
-	av_opt_set_int(sndin->resampler, "out_channel_layout", AV_CH_LAYOUT_MONO, 0);
-	av_opt_set_int(sndin->resampler, "in_sample_rate", sndin->pCodecCtx->sample_rate, 0);
-	av_opt_set_int(sndin->resampler, "out_sample_rate", out_sample_rate, 0);
-	av_opt_set_sample_fmt(sndin->resampler, "in_sample_fmt", sndin->pCodecCtx->sample_fmt, 0);
-	av_opt_set_sample_fmt(sndin->resampler, "out_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
-	if(swr_init(sndin->resampler) != 0) {
-		avcodec_close(sndin->pCodecCtx);
-		av_free(sndin->frame);
-		avformat_close_input(&sndin->pFormatCtx);
+	
+	/* initialize a converter from the input sample format to planes of float samples, keeping the channels as they are */
+	layout = decoder->pCodecCtx->channel_layout ? decoder->pCodecCtx->channel_layout : av_get_default_channel_layout(decoder->pCodecCtx->channels);
+	decoder->channels = av_get_channel_layout_nb_channels(layout);
+	decoder->buffers = (float **)ckv_malloc(sizeof(float *) * (decoder->channels > 0 ? decoder->channels : 1));
+	decoder->resampler = swr_alloc();
+	av_opt_set_int(decoder->resampler, "in_channel_layout", layout, 0);
+	av_opt_set_int(decoder->resampler, "out_channel_layout", layout, 0);
+	av_opt_set_int(decoder->resampler, "in_sample_rate", decoder->pCodecCtx->sample_rate, 0);
+	av_opt_set_int(decoder->resampler, "out_sample_rate", out_sample_rate, 0);
+	av_opt_set_sample_fmt(decoder->resampler, "in_sample_fmt", decoder->pCodecCtx->sample_fmt, 0);
+	av_opt_set_sample_fmt(decoder->resampler, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
+	if(decoder->channels <= 0 || decoder->buffers == NULL || swr_init(decoder->resampler) != 0) {
+		ckv_free(decoder->buffers);
+		swr_free(&decoder->resampler);
+		avcodec_close(decoder->pCodecCtx);
+		av_free(decoder->frame);
+		avformat_close_input(&decoder->pFormatCtx);
 		return 0;
 	}
-
+	
 	return 1;
 }
 
+/* decodes the next frame into buffer; returns 0 if the file has run out */
 static
-void
-sndin_get_samples(SndIn *sndin)
+int
+decoder_get_samples(Decoder *decoder)
 {
 	AVPacket readingPacket;
 	
-	if(sndin->closed || sndin->eof)
-		return;
-
 	av_init_packet(&readingPacket);
-
+	
 	/* check if there are samples left over from the last decodingPacket */
-	if (sndin_handle_packet(sndin) > 0) {
-		sndin_handle_frame(sndin);
-		return;
+	if (decoder_handle_packet(decoder) > 0) {
+		decoder_handle_frame(decoder);
+		return 1;
 	}
-
+	
 	/* read new frame then read from decodingPacket again */
-	while(av_read_frame(sndin->pFormatCtx, &readingPacket) == 0) {
+	while(av_read_frame(decoder->pFormatCtx, &readingPacket) == 0) {
 		/* is this a packet from the audio stream? */
-		if(readingPacket.stream_index == sndin->audioStreamIndex) {
-			sndin->decodingPacket = readingPacket;
-
-			if (sndin_handle_packet(sndin) > 0) {
-				sndin_handle_frame(sndin);
+		if(readingPacket.stream_index == decoder->audioStreamIndex) {
+			decoder->decodingPacket = readingPacket;
+	
+			if (decoder_handle_packet(decoder) > 0) {
+				decoder_handle_frame(decoder);
 				av_free_packet(&readingPacket);
-				return;
+				return 1;
 			}
 		}
-
+	
 		av_free_packet(&readingPacket);
 	}
-
+	
 	/*
 	Some codecs will cause frames to be buffered up in the decoding process.
 	If the CODEC_CAP_DELAY flag is set, there can be buffered up frames that
 	need to be flushed, so we'll do that.
 	*/
-	if (sndin->pCodecCtx->codec->capabilities & CODEC_CAP_DELAY) {
+	if (decoder->pCodecCtx->codec->capabilities & CODEC_CAP_DELAY) {
 		av_init_packet(&readingPacket);
-
+	
 		/* Decode all the remaining frames in the buffer, until the end is reached */
 		int gotFrame = 0;
-		if(avcodec_decode_audio4(sndin->pCodecCtx, sndin->frame, &gotFrame, &readingPacket) >= 0 && gotFrame) {
-			sndin_handle_frame(sndin);
-			return;
+		if(avcodec_decode_audio4(decoder->pCodecCtx, decoder->frame, &gotFrame, &readingPacket) >= 0 && gotFrame) {
+			decoder_handle_frame(decoder);
+			return 1;
 		}
 	}
-
+	
 	/* we ran out of packets */
-	sndin->samplesLeft = sndin->nextSampleIndex = 0;
-	sndin->eof = 1;
+	decoder->samplesLeft = decoder->nextSampleIndex = 0;
+	return 0;
 }
 
 static
 int
-sndin_handle_packet(SndIn *sndin)
+decoder_handle_packet(Decoder *decoder)
 {
 	/* Audio packets can have multiple audio frames in a single packet */
-	if(sndin->decodingPacket.size > 0) {
+	if(decoder->decodingPacket.size > 0) {
 		/*
 		Try to decode the packet into a frame.
 		Some frames rely on multiple packets, so we have to make sure
 		the frame is finished before we can use it.
 		*/
 		int gotFrame = 0;
-		int len = avcodec_decode_audio4(sndin->pCodecCtx, sndin->frame, &gotFrame, &sndin->decodingPacket);
-
+		int len = avcodec_decode_audio4(decoder->pCodecCtx, decoder->frame, &gotFrame, &decoder->decodingPacket);
+	
 		if(len >= 0 && gotFrame) {
-			sndin->decodingPacket.size -= len;
-			sndin->decodingPacket.data += len;
+			decoder->decodingPacket.size -= len;
+			decoder->decodingPacket.data += len;
 			return len;
 		} else {
-			sndin->decodingPacket.size = 0;
-			sndin->decodingPacket.data = NULL;
+			decoder->decodingPacket.size = 0;
+			decoder->decodingPacket.data = NULL;
 		}
 	}
-
+	
 	return 0;
 }
 
 static
 void
-sndin_handle_frame(SndIn *sndin)
+decoder_handle_frame(Decoder *decoder)
 {
-	if(sndin->buffer) {
-		av_freep(&sndin->buffer);
+	int out_samples = av_rescale_rnd(swr_get_delay(decoder->resampler, decoder->pCodecCtx->sample_rate) + decoder->frame->nb_samples, decoder->pCodecCtx->sample_rate, decoder->pCodecCtx->sample_rate, AV_ROUND_UP);
+	
+	/* frames are usually the same size, so this rarely allocates after the first frame */
+	if(out_samples > decoder->bufferSize) {
+		if(decoder->bufferSize > 0)
+			av_freep(&decoder->buffers[0]); /* the planes are one block */
+		if(av_samples_alloc((uint8_t **)decoder->buffers, NULL, decoder->channels, out_samples, AV_SAMPLE_FMT_FLTP, 0) < 0) {
+			decoder->bufferSize = decoder->samplesLeft = 0;
+			return;
+		}
+		decoder->bufferSize = out_samples;
+	}
+	
+	decoder->nextSampleIndex = 0;
+	decoder->samplesLeft = swr_convert(decoder->resampler, (uint8_t **)decoder->buffers, out_samples, (const uint8_t **)decoder->frame->extended_data, decoder->frame->nb_samples);
+	if(decoder->samplesLeft < 0)
+		decoder->samplesLeft = 0;
+	
+	/* after a seek, find out where it landed and drop what comes before the new position */
+	if(decoder->resync && decoder->frame->pkt_pts != AV_NOPTS_VALUE) {
+		decoder->position = decoder_samples(decoder, decoder->frame->pkt_pts);
+		decoder->resync = 0;
 	}
+	if(decoder->position < decoder->discard) {
+		int64_t drop = decoder->discard - decoder->position;
+		if(drop > decoder->samplesLeft)
+			drop = decoder->samplesLeft;
+		decoder->nextSampleIndex += drop;
+		decoder->samplesLeft -= drop;
+		decoder->position += drop;
+	}
+}
 
-	int out_samples = av_rescale_rnd(swr_get_delay(sndin->resampler, sndin->pCodecCtx->sample_rate) + sndin->frame->nb_samples, sndin->pCodecCtx->sample_rate, sndin->pCodecCtx->sample_rate, AV_ROUND_UP);
-	av_samples_alloc((uint8_t **)&sndin->buffer, NULL, 1 /* channels */, out_samples, AV_SAMPLE_FMT_FLT, 0);
-	sndin->nextSampleIndex -= sndin->samplesLeft;
-	sndin->samplesLeft = swr_convert(sndin->resampler, (uint8_t **)&sndin->buffer, out_samples, (const uint8_t **)sndin->frame->extended_data, sndin->frame->nb_samples);
+/* converts a timestamp of the audio stream to a position in samples */
+static
+int64_t
+decoder_samples(Decoder *decoder, int64_t pts)
+{
+	AVStream *stream = decoder->pFormatCtx->streams[decoder->audioStreamIndex];
+	AVRational rate = { 1, decoder->sample_rate };
+	
+	if(stream->start_time != AV_NOPTS_VALUE)
+		pts -= stream->start_time;
+	
+	return av_rescale_q(pts, stream->time_base, rate);
 }
 
+/* reads through a compressed file once, noting where each packet is; PCM files seek exactly without one */
 static
 void
-sndin_close(SndIn *sndin)
+decoder_build_index(Decoder *decoder)
 {
-	av_free(sndin->frame);
-	avcodec_close(sndin->pCodecCtx);
-	avformat_close_input(&sndin->pFormatCtx);
+	AVStream *stream = decoder->pFormatCtx->streams[decoder->audioStreamIndex];
+	AVPacket packet;
+	IndexEntry *index;
+	int capacity = 0;
+	
+	decoder->indexed = 1;
+	if(strncmp(decoder->pCodecCtx->codec->name, "pcm_", 4) == 0)
+		return;
+	
+	av_seek_frame(decoder->pFormatCtx, decoder->audioStreamIndex, stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0, AVSEEK_FLAG_BACKWARD);
+	av_init_packet(&packet);
+	while(av_read_frame(decoder->pFormatCtx, &packet) == 0) {
+		if(packet.stream_index == decoder->audioStreamIndex && packet.pts != AV_NOPTS_VALUE && packet.pos >= 0) {
+			if(decoder->indexSize == capacity) {
+				capacity = capacity > 0 ? capacity * 2 : 1024;
+				index = (IndexEntry *)ckv_realloc(decoder->index, sizeof(IndexEntry) * capacity);
+				if(index == NULL) {
+					/* do without */
+					av_free_packet(&packet);
+					ckv_free(decoder->index);
+					decoder->index = NULL;
+					decoder->indexSize = 0;
+					return;
+				}
+				decoder->index = index;
+			}
+			decoder->index[decoder->indexSize].pts = packet.pts;
+			decoder->index[decoder->indexSize].pos = packet.pos;
+			decoder->indexSize++;
+		}
+		av_free_packet(&packet);
+	}
+}
 
-	sndin->eof = 1;
-	sndin->closed = 1;
+/* moves to position (in samples), reusing the codec and resampler */
+static
+void
+decoder_seek(Decoder *decoder, int64_t position)
+{
+	AVStream *stream = decoder->pFormatCtx->streams[decoder->audioStreamIndex];
+	AVRational rate = { 1, decoder->sample_rate };
+	int64_t pts = av_rescale_q(position, rate, stream->time_base);
+	int low, high, middle, seeked = 0;
+	
+	if(stream->start_time != AV_NOPTS_VALUE)
+		pts += stream->start_time;
+	
+	if(!decoder->indexed)
+		decoder_build_index(decoder);
+	
+	if(decoder->index != NULL) {
+		/* the last packet starting at or before pts, then back a few */
+		low = 0;
+		high = decoder->indexSize - 1;
+		while(low < high) {
+			middle = (low + high + 1) / 2;
+			if(decoder->index[middle].pts <= pts)
+				low = middle;
+			else
+				high = middle - 1;
+		}
+		low = low > SEEK_PREROLL ? low - SEEK_PREROLL : 0;
+		
+		if(av_seek_frame(decoder->pFormatCtx, -1, decoder->index[low].pos, AVSEEK_FLAG_BYTE) >= 0) {
+			decoder->position = decoder_samples(decoder, decoder->index[low].pts);
+			seeked = 1;
+		}
+	}
+	
+	if(!seeked) {
+		av_seek_frame(decoder->pFormatCtx, decoder->audioStreamIndex, pts, AVSEEK_FLAG_BACKWARD);
+		decoder->position = position;
+	}
+	
+	/* nothing decoded before the seek carries over */
+	avcodec_flush_buffers(decoder->pCodecCtx);
+	swr_init(decoder->resampler);
+	decoder->decodingPacket.size = 0;
+	decoder->samplesLeft = decoder->nextSampleIndex = 0;
+	decoder->resync = 1;
+	decoder->discard = position;
 }
 
-/* args: self */
+/* does the SndIn's last seek, if the decoder hasn't; returns 1 if it did */
 static
 int
-ckv_sndin_tick(lua_State *L)
+decoder_handle_request(Decoder *decoder)
 {
-	SndIn *sndin;
-	lua_Number last_value;
-	float rate;
+	unsigned int requests = LOAD(&decoder->requests);
+	long long start, end, target;
 	
-	luaL_checktype(L, 1, LUA_TTABLE);
+	/* none, or the SndIn is still writing it */
+	if(requests == decoder->handled || (requests & 1))
+		return 0;
 	
-	lua_getfield(L, -1, "obj");
-	sndin = (SndIn *)lua_touserdata(L, -1);
-	lua_pop(L, 1);
+	start = LOAD(&decoder->requestStart);
+	end = LOAD(&decoder->requestEnd);
+	target = LOAD(&decoder->requestTarget);
+	if(LOAD(&decoder->requests) != requests)
+		return 0; /* the SndIn has made another; it'll want filling again */
+	
+	decoder->handled = requests;
+	decoder->start = start;
+	decoder->end = end;
+	decoder_seek(decoder, target);
+	
+	STORE(&decoder->eof, 0);
+	STORE(&decoder->seekHead, ring_mark(&decoder->rings[0]));
+	STORE(&decoder->seeked, requests);
+	
+	return 1;
+}
+
+/* puts up to n of the next samples of each channel in the rings; returns how many went */
+static
+int
+decoder_write(Decoder *decoder, int n)
+{
+	unsigned int space = ring_space(&decoder->rings[decoder->channels - 1]);
+	int c;
 	
-	if(sndin->closed || sndin->eof)
+	if((unsigned int)n > space)
+		n = space;
+	for(c = 0; c < decoder->channels; c++)
+		ring_write(&decoder->rings[c], decoder->buffers[c] + decoder->nextSampleIndex, n);
+	
+	return n;
+}
+
+/* for the SndIn: how many samples of every channel can be read */
+static
+unsigned int
+decoder_count(Decoder *decoder)
+{
+	return ring_count(&decoder->rings[decoder->channels - 1]);
+}
+
+/* for the SndIn: skips n samples of every channel */
+static
+void
+decoder_skip(Decoder *decoder, unsigned int n)
+{
+	int c;
+	
+	for(c = 0; c < decoder->channels; c++)
+		ring_skip(&decoder->rings[c], n);
+}
+
+/* allocates a ring of size samples for each channel; returns 0 if out of memory */
+static
+int
+decoder_alloc_rings(Decoder *decoder, unsigned int size)
+{
+	int c;
+	
+	decoder->rings = (Ring *)ckv_malloc(sizeof(Ring) * decoder->channels);
+	if(decoder->rings == NULL)
 		return 0;
+	for(c = 0; c < decoder->channels; c++)
+		decoder->rings[c].buffer = NULL;
 	
-	while(!sndin->eof && sndin->nextSampleIndex >= sndin->samplesLeft)
-		sndin_get_samples(sndin);
-	if(sndin->eof) {
-		/* ran out of data */
-		sndin_close(sndin);
-		last_value = 0;
-	} else {
-		lua_getfield(L, -1, "rate");
-		rate = lua_tonumber(L, -1);
-		lua_pop(L, 1);
-		if(rate < 0) {
-			fprintf(stderr, "[ckv] SndIn rate must be positive\n");
+	for(c = 0; c < decoder->channels; c++)
+		if(!ring_init(&decoder->rings[c], size))
 			return 0;
+	
+	return 1;
+}
+
+/* seeks if the SndIn has asked to, then decodes until the rings are full or the region runs out */
+static
+void
+decoder_fill(Decoder *decoder)
+{
+	int64_t n;
+	int written, more = 1, looped = 0;
+	
+	decoder_handle_request(decoder);
+	
+	while(!decoder->eof) {
+		n = decoder->samplesLeft;
+		if(decoder->end >= 0 && decoder->position + n > decoder->end)
+			n = decoder->end - decoder->position;
+		if(n <= 0 && more && (decoder->end < 0 || decoder->position < decoder->end)) {
+			more = decoder_get_samples(decoder);
+			if(!more && LOAD(&decoder->length) < 0)
+				STORE(&decoder->length, decoder->position);
+			continue;
+		}
+	
+		if(n <= 0) {
+			/* the region has run out; start it again, unless that gave nothing */
+			if(LOAD(&decoder->loop) && !looped) {
+				decoder_seek(decoder, decoder->start);
+				more = 1;
+				looped = 1;
+			} else {
+				STORE(&decoder->eof, 1);
+			}
+			continue;
 		}
+	
+		written = decoder_write(decoder, n);
+		decoder->nextSampleIndex += written;
+		decoder->samplesLeft -= written;
+		decoder->position += written;
+		looped = 0;
+		if(written < n)
+			break; /* the rings are full */
+	}
+}
+
+static
+void
+decoder_close(Decoder *decoder)
+{
+	int c;
+	
+	swr_free(&decoder->resampler);
+	av_free(decoder->frame);
+	avcodec_close(decoder->pCodecCtx);
+	avformat_close_input(&decoder->pFormatCtx);
+	if(decoder->bufferSize > 0)
+		av_freep(&decoder->buffers[0]);
+	ckv_free(decoder->buffers);
+	ckv_free(decoder->index);
+	if(decoder->rings != NULL) {
+		for(c = 0; c < decoder->channels; c++)
+			ring_free(&decoder->rings[c]);
+		ckv_free(decoder->rings);
+	}
+	ckv_free(decoder);
+}
+
+
+/* CACHE */
+
+/*
+decoded files are kept in a cache shared by every SndIn, so playing a file
+again doesn't decode it again. entries are keyed by the file's path, its
+modification time and the sample rate it was decoded at, and are read-only
+once loaded. when the cache holds more than CACHE_LIMIT bytes, the entries
+no SndIn is playing are dropped, least recently played first.
+
+files are cached by the decoder threads: when they're preloaded, or when a
+SndIn first streams one that decodes to at most CACHE_FILE_LIMIT bytes.
+the decoded samples are also saved as a file of raw floats in the disk
+cache ($CKV_CACHE, or ~/.cache/ckv), which later runs map into memory
+rather than decoding the file again. entries hold every channel of the
+file, a frame at a time; on disk, they follow a CacheHeader giving how
+many channels there are.
+*/
+
+#define CACHE_LIMIT (256 * 1024 * 1024) /* bytes */
+#define CACHE_FILE_LIMIT (16 * 1024 * 1024)
+
+#define CACHE_MAGIC "ckvpcm1"
+
+#define CACHE_LOADING (0)
+#define CACHE_READY (1)
+#define CACHE_FAILED (2)
+
+struct _CacheEntry {
+	char *path;
+	time_t mtime;
+	int sample_rate;
+	int state;
+	int busy; /* a decoder thread is loading it */
+	int users; /* SndIns playing it */
+	unsigned long used; /* when it was last played, by cache_clock */
+	
+	float *samples; /* a frame (a sample of each channel) at a time */
+	long frames;
+	int channels;
+	size_t size; /* of samples (and the header, if mapped), in bytes */
+	int mapped; /* samples is the file in the disk cache, mapped into memory */
+	
+	CacheEntry *next;
+};
+
+typedef struct _CacheHeader {
+	char magic[8];
+	int channels;
+	int reserved; /* keeps the samples aligned to 16 bytes */
+} CacheHeader;
+
+/* all of it is under cache_lock */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static CacheEntry *cache = NULL;
+static size_t cache_size = 0;
+static unsigned long cache_clock = 0;
+
+static int start_threads(void);
+
+/* finds the entry for filename at sample_rate, creating it (to be loaded) if create is set; needs cache_lock */
+static
+CacheEntry *
+cache_find(const char *filename, int sample_rate, int create)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	CacheEntry *entry;
+	
+	if(stat(filename, &st) != 0)
+		return NULL;
+	if(realpath(filename, path) == NULL)
+		return NULL;
+	
+	for(entry = cache; entry != NULL; entry = entry->next)
+		if(entry->mtime == st.st_mtime && entry->sample_rate == sample_rate && strcmp(entry->path, path) == 0)
+			return entry;
+	
+	if(!create)
+		return NULL;
+	
+	entry = (CacheEntry *)ckv_malloc(sizeof(CacheEntry));
+	if(entry == NULL)
+		return NULL;
+	entry->path = (char *)ckv_malloc(strlen(path) + 1);
+	if(entry->path == NULL) {
+		ckv_free(entry);
+		return NULL;
+	}
+	
+	strcpy(entry->path, path);
+	entry->mtime = st.st_mtime;
+	entry->sample_rate = sample_rate;
+	entry->state = CACHE_LOADING;
+	entry->busy = entry->users = 0;
+	entry->used = cache_clock;
+	entry->samples = NULL;
+	entry->frames = 0;
+	entry->channels = 1;
+	entry->size = 0;
+	entry->mapped = 0;
+	
+	entry->next = cache;
+	cache = entry;
+	
+	return entry;
+}
+
+/* returns the cached samples of filename, for a SndIn to play until it calls cache_release(); NULL if they aren't cached */
+static
+CacheEntry *
+cache_acquire(const char *filename, int sample_rate)
+{
+	CacheEntry *entry;
+	
+	pthread_mutex_lock(&cache_lock);
+	
+	entry = cache_find(filename, sample_rate, 0);
+	if(entry != NULL && entry->state == CACHE_READY) {
+		entry->users++;
+		entry->used = ++cache_clock;
+	} else {
+		entry = NULL;
+	}
+	
+	pthread_mutex_unlock(&cache_lock);
+	
+	return entry;
+}
+
+/* has the decoder threads cache filename, if it isn't already */
+static
+void
+cache_request(const char *filename, int sample_rate)
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_find(filename, sample_rate, 1);
+	pthread_mutex_unlock(&cache_lock);
+	
+	pthread_mutex_lock(&pool_lock);
+	start_threads();
+	pthread_cond_signal(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* drops unused entries until the cache fits in CACHE_LIMIT; needs cache_lock */
+static
+void
+cache_trim(void)
+{
+	CacheEntry *entry, **link, **oldest;
+	
+	while(cache_size > CACHE_LIMIT) {
+		oldest = NULL;
+		for(link = &cache; *link != NULL; link = &(*link)->next)
+			if((*link)->state == CACHE_READY && (*link)->users == 0 && (oldest == NULL || (*link)->used < (*oldest)->used))
+				oldest = link;
+		if(oldest == NULL)
+			break;
+		
+		entry = *oldest;
+		*oldest = entry->next;
+		cache_size -= entry->size;
 		
-		last_value = sndin->buffer[(int) sndin->nextSampleIndex];
-		sndin->nextSampleIndex += rate;
+		if(entry->mapped)
+			munmap((CacheHeader *)entry->samples - 1, entry->size);
+		else
+			ckv_free(entry->samples);
+		ckv_free(entry->path);
+		ckv_free(entry);
 	}
+}
+
+static
+void
+cache_release(CacheEntry *entry)
+{
+	pthread_mutex_lock(&cache_lock);
+	entry->users--;
+	cache_trim();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* returns an entry for a decoder thread to load, marking it busy; NULL if there are none */
+static
+CacheEntry *
+cache_next_job(void)
+{
+	CacheEntry *entry;
 	
-	lua_pushnumber(L, last_value);
-	lua_setfield(L, 1, "last");
+	pthread_mutex_lock(&cache_lock);
+	for(entry = cache; entry != NULL; entry = entry->next)
+		if(entry->state == CACHE_LOADING && !entry->busy)
+			break;
+	if(entry != NULL)
+		entry->busy = 1;
+	pthread_mutex_unlock(&cache_lock);
 	
-	return 0;
+	return entry;
 }
 
-/* args: self */
+/* writes the path of entry's file in the disk cache to out (of PATH_MAX chars); returns 0 if there's no disk cache */
 static
 int
-ckv_sndin_close(lua_State *L)
+cache_disk_path(CacheEntry *entry, char *out, int make_dir)
 {
-	luaL_checktype(L, 1, LUA_TTABLE);
+	char dir[PATH_MAX - 64];
+	const char *env = getenv("CKV_CACHE");
+	const char *home = getenv("HOME");
+	unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
+	const char *c;
 	
-	SndIn *sndin;
+	if(env != NULL && env[0] != '\0') {
+		snprintf(dir, sizeof(dir), "%s", env);
+	} else if(home != NULL) {
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+		if(make_dir)
+			mkdir(dir, 0755);
+		snprintf(dir, sizeof(dir), "%s/.cache/ckv", home);
+	} else {
+		return 0;
+	}
+	if(make_dir)
+		mkdir(dir, 0755);
 	
-	lua_getfield(L, -1, "obj");
-	sndin = (SndIn *)lua_touserdata(L, -1);
-	lua_pop(L, 1);
+	for(c = entry->path; *c != '\0'; c++)
+		hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
 	
-	if(!sndin->closed)
-		sndin_close(sndin);
+	snprintf(out, PATH_MAX, "%s/%016llx-%lld-%d.f32", dir, hash, (long long)entry->mtime, entry->sample_rate);
 	
-	return 0;
+	return 1;
 }
 
+/* maps entry's file in the disk cache into memory; returns 0 if there isn't one */
 static
 int
-ckv_sndin_release(lua_State *L)
+cache_map(CacheEntry *entry)
 {
-	SndIn *sndin = (SndIn *)lua_touserdata(L, 1);
-	sndin_close(sndin);
-	free(sndin);
+	char path[PATH_MAX];
+	struct stat st;
+	CacheHeader *header;
+	long frame_size;
+	int fd;
 	
-	return 0;
+	if(!cache_disk_path(entry, path, 0))
+		return 0;
+	
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	if(fstat(fd, &st) != 0 || st.st_size <= (off_t)sizeof(CacheHeader)) {
+		close(fd);
+		return 0;
+	}
+	
+	header = (CacheHeader *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(header == MAP_FAILED)
+		return 0;
+	
+	/* a file that isn't whole frames was cut short, or isn't ours */
+	frame_size = sizeof(float) * header->channels;
+	if(memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header->channels <= 0 || (st.st_size - sizeof(CacheHeader)) % frame_size != 0) {
+		munmap(header, st.st_size);
+		return 0;
+	}
+	
+	entry->samples = (float *)(header + 1);
+	entry->channels = header->channels;
+	entry->frames = (st.st_size - sizeof(CacheHeader)) / frame_size;
+	entry->size = st.st_size;
+	entry->mapped = 1;
+	
+	return 1;
 }
 
+/* saves entry's samples to the disk cache, through a temporary file so no other run maps half of it */
 static
-const
-luaL_Reg
-ckvugen_sndin[] = {
-	{ "tick", ckv_sndin_tick },
-	{ "close", ckv_sndin_close },
-	{ NULL, NULL }
-};
+void
+cache_save(CacheEntry *entry)
+{
+	char path[PATH_MAX], temp[PATH_MAX + 32];
+	CacheHeader header;
+	size_t count = (size_t)entry->frames * entry->channels;
+	FILE *file;
+	int ok;
+	
+	if(!cache_disk_path(entry, path, 1))
+		return;
+	snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.channels = entry->channels;
+	
+	file = fopen(temp, "wb");
+	if(file == NULL)
+		return;
+	ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	ok = fwrite(entry->samples, sizeof(float), count, file) == count && ok;
+	ok = fclose(file) == 0 && ok;
+	
+	if(!ok || rename(temp, path) != 0)
+		remove(temp);
+}
 
-/* args: SndIn (class), filename */
+/* decodes all of entry's file into memory; returns 0 on failure */
 static
 int
-ckv_sndin_new(lua_State *L)
+cache_decode(CacheEntry *entry)
 {
-	luaL_checktype(L, 1, LUA_TSTRING);
+	Decoder *decoder;
+	float *samples, *frame;
+	long capacity = 0; /* in frames */
+	int channels, c, i;
 	
-	SndIn *sndin;
-	const char *filename;
-
-	/* get the current sample rate */
-	ckvm_pushstdglobal(L, "sample_rate");
-	lua_Number sample_rate = lua_tonumber(L, -1);
-	lua_pop(L, 1);
-	
-	sndin = (SndIn *)malloc(sizeof(struct _SndIn));
-	if(sndin == NULL) {
-		fprintf(stderr, "[ckv] memory error allocating SndIn\n");
+	decoder = (Decoder *)ckv_malloc(sizeof(Decoder));
+	if(decoder == NULL)
+		return 0;
+	if(!decoder_open(decoder, entry->path, entry->sample_rate)) {
+		ckv_free(decoder);
 		return 0;
 	}
 	
-	filename = lua_tostring(L, 1);
-	if(!sndin_open(sndin, filename, sample_rate)) {
-		fprintf(stderr, "[ckv] could not open file \"%s\"\n", filename);
+	channels = decoder->channels;
+	entry->samples = NULL;
+	entry->frames = 0;
+	
+	while(decoder_get_samples(decoder)) {
+		if(entry->frames + decoder->samplesLeft > capacity) {
+			capacity = (entry->frames + decoder->samplesLeft) * 2;
+			samples = (float *)ckv_realloc(entry->samples, sizeof(float) * channels * capacity);
+			if(samples == NULL) {
+				ckv_free(entry->samples);
+				decoder_close(decoder);
+				return 0;
+			}
+			entry->samples = samples;
+		}
+		
+		/* interleave the planes */
+		frame = entry->samples + entry->frames * channels;
+		for(i = 0; i < decoder->samplesLeft; i++)
+			for(c = 0; c < channels; c++)
+				*frame++ = decoder->buffers[c][decoder->nextSampleIndex + i];
+		entry->frames += decoder->samplesLeft;
+	}
+	
+	decoder_close(decoder);
+	
+	if(entry->frames == 0) {
+		ckv_free(entry->samples);
 		return 0;
 	}
+	entry->channels = channels;
+	entry->size = sizeof(float) * channels * entry->frames;
+	entry->mapped = 0;
+	
+	return 1;
+}
+
+/* fills in entry, from the disk cache or by decoding the file (and saving it there) */
+static
+void
+cache_load(CacheEntry *entry)
+{
+	int state = CACHE_READY;
+	
+	if(!cache_map(entry)) {
+		if(cache_decode(entry))
+			cache_save(entry);
+		else
+			state = CACHE_FAILED;
+	}
+	
+	pthread_mutex_lock(&cache_lock);
+	entry->state = state;
+	entry->busy = 0;
+	cache_size += entry->size;
+	cache_trim();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+float *
+sndin_load(const char *filename, int sample_rate, long *frames, int *channels)
+{
+	struct timespec wait = { 0, WAIT_NS };
+	CacheEntry *entry;
+	float *samples = NULL;
+	int load = 0;
+	
+	/* using the entry keeps it in the cache, even while it's loading */
+	pthread_mutex_lock(&cache_lock);
+	entry = cache_find(filename, sample_rate, 1);
+	if(entry != NULL) {
+		entry->users++;
+		entry->used = ++cache_clock;
+		if(entry->state == CACHE_LOADING && !entry->busy) {
+			entry->busy = 1;
+			load = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	
+	if(entry == NULL)
+		return NULL;
+	if(load)
+		cache_load(entry);
+	
+	/* or a decoder thread is loading it already */
+	pthread_mutex_lock(&cache_lock);
+	while(entry->state == CACHE_LOADING) {
+		pthread_mutex_unlock(&cache_lock);
+		nanosleep(&wait, NULL);
+		pthread_mutex_lock(&cache_lock);
+	}
+	pthread_mutex_unlock(&cache_lock);
+	
+	if(entry->state == CACHE_READY) {
+		samples = (float *)ckv_malloc(sizeof(float) * entry->frames * entry->channels);
+		if(samples != NULL) {
+			memcpy(samples, entry->samples, sizeof(float) * entry->frames * entry->channels);
+			*frames = entry->frames;
+			*channels = entry->channels;
+		}
+	}
+	
+	cache_release(entry);
+	
+	return samples;
+}
+
+
+/* DECODER THREADS */
+
+/* looks for decoders to fill (or free), forever */
+static
+void *
+decoder_thread(void *arg)
+{
+	Decoder *decoder, **link;
+	CacheEntry *entry;
+	struct timespec until;
+	
+	pthread_mutex_lock(&pool_lock);
+	
+	for(;;) {
+		for(link = &pool; *link != NULL; link = &(*link)->next)
+			if(!(*link)->busy && (LOAD(&(*link)->closed) || LOAD(&(*link)->wanted)))
+				break;
+		decoder = *link;
+	
+		if(decoder == NULL && (entry = cache_next_job()) != NULL) {
+			pthread_mutex_unlock(&pool_lock);
+			cache_load(entry);
+			pthread_mutex_lock(&pool_lock);
+			continue;
+		}
+		
+		if(decoder == NULL) {
+			/* SndIns only set flags, so they can't wake us; look again in a bit */
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += DECODER_POLL_NS;
+			if(until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&pool_wake, &pool_lock, &until);
+			continue;
+		}
+	
+		if(LOAD(&decoder->closed)) {
+			*link = decoder->next;
+			pthread_mutex_unlock(&pool_lock);
+			decoder_close(decoder);
+			pthread_mutex_lock(&pool_lock);
+			continue;
+		}
+	
+		decoder->busy = 1;
+		STORE(&decoder->wanted, 0);
+		pthread_mutex_unlock(&pool_lock);
+	
+		decoder_fill(decoder);
+	
+		pthread_mutex_lock(&pool_lock);
+		decoder->busy = 0;
+	}
+	
+	return NULL;
+}
+
+/* starts the decoder threads if they haven't been; returns 0 if none could be; needs pool_lock */
+static
+int
+start_threads(void)
+{
+	pthread_t thread;
+	int i;
+	
+	for(i = pool_started; i < DECODER_THREADS; i++) {
+		if(pthread_create(&thread, NULL, decoder_thread, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		pool_started++;
+	}
+	
+	return pool_started > 0;
+}
+
+/* hands a decoder to the threads, starting them if they haven't been; returns 0 on failure */
+static
+int
+pool_add(Decoder *decoder)
+{
+	int ok = 1;
+	
+	pthread_mutex_lock(&pool_lock);
+	
+	if(start_threads()) {
+		decoder->next = pool;
+		pool = decoder;
+		pthread_cond_signal(&pool_wake);
+	} else {
+		ok = 0;
+	}
+	
+	pthread_mutex_unlock(&pool_lock);
+	
+	return ok;
+}
+
+
+/* THE UGEN */
+
+/* has sndin play from position on (clamped to its region), even if it was done */
+static void
+sndin_seek_to(SndIn *sndin, double position)
+{
+	Decoder *decoder = sndin->decoder;
+	long long target;
+	
+	if(sndin->entry == NULL && decoder == NULL)
+		return; /* closed */
+	
+	if(sndin->end >= 0 && position > sndin->end)
+		position = sndin->end;
+	if(position < sndin->start)
+		position = sndin->start;
+	sndin->done = 0;
+	
+	if(sndin->entry != NULL) {
+		sndin->position = position;
+		return;
+	}
+	
+	/* the decoder may read this at any time, so mark it as being written */
+	target = (long long)position;
+	STORE(&decoder->requests, decoder->requests + 1);
+	STORE(&decoder->requestStart, (long long)sndin->start);
+	STORE(&decoder->requestEnd, sndin->end >= 0 ? (long long)sndin->end : -1);
+	STORE(&decoder->requestTarget, target);
+	STORE(&decoder->requests, decoder->requests + 1);
+	
+	sndin->request = decoder->requests;
+	sndin->pending = 1;
+	sndin->position = target;
+	sndin->skip = position - target;
+	STORE(&decoder->wanted, 1);
+}
+
+static void
+sndin_tick(UGen *ugen)
+{
+	SndIn *sndin = (SndIn *)ugen;
+	Decoder *decoder = sndin->decoder;
+	struct timespec wait = { 0, WAIT_NS };
+	unsigned int count, steps;
+	long long length;
+	double end, sum = 0;
+	float *frame;
+	int eof, looping, c;
+	
+	ugen->last = 0;
+	for(c = 0; c < sndin->channels; c++)
+		sndin->out[c] = 0;
+	if(sndin->done)
+		return;
+	
+	if(sndin->entry != NULL) {
+		end = sndin->entry->frames;
+		if(sndin->end >= 0 && sndin->end < end)
+			end = sndin->end;
+		
+		if(sndin->position >= end) {
+			if(!sndin->loop || end <= sndin->start) {
+				sndin->done = 1;
+				ugen->signal = 1;
+				return;
+			}
+			sndin->position = sndin->start + fmod(sndin->position - sndin->start, end - sndin->start);
+		}
+		
+		frame = sndin->entry->samples + (long)sndin->position * sndin->channels;
+		for(c = 0; c < sndin->channels; c++)
+			sum += sndin->out[c] = frame[c];
+		ugen->last = sum / sndin->channels;
+		if(sndin->rate > 0)
+			sndin->position += sndin->rate;
+		return;
+	}
+	
+	looping = sndin->loop != 0;
+	if(looping != sndin->looping) {
+		sndin->looping = looping;
+		STORE(&decoder->loop, looping);
+	}
+	
+	/* until the decoder has done the last seek, what's in the rings is from before it */
+	if(sndin->pending) {
+		count = decoder_count(decoder);
+		while(LOAD(&decoder->seeked) != sndin->request) {
+			decoder_skip(decoder, count);
+			STORE(&decoder->wanted, 1);
+			if(!sndin->wait)
+				return;
+			nanosleep(&wait, NULL);
+			count = decoder_count(decoder);
+		}
+		for(c = 0; c < sndin->channels; c++)
+			ring_skip_to(&decoder->rings[c], LOAD(&decoder->seekHead));
+		sndin->pending = 0;
+	}
+	
+	/* check eof first: once it's set, count is final */
+	eof = LOAD(&decoder->eof);
+	count = decoder_count(decoder);
+	
+	while(sndin->wait && !eof && count <= sndin->skip) {
+		STORE(&decoder->wanted, 1);
+		nanosleep(&wait, NULL);
+		eof = LOAD(&decoder->eof);
+		count = decoder_count(decoder);
+	}
+	
+	if(!eof && count < ring_size(&decoder->rings[0]) / 2)
+		STORE(&decoder->wanted, 1);
+	
+	/* move along by the rate, as far as the decoder has got */
+	steps = sndin->skip < count ? (unsigned int)sndin->skip : count;
+	decoder_skip(decoder, steps);
+	sndin->skip -= steps;
+	sndin->position += steps;
+	count -= steps;
+	
+	/* the decoder goes round the loop by itself, so follow it; if loop was unset since, stop at the end */
+	end = sndin->end;
+	length = LOAD(&decoder->length);
+	if(length >= 0 && (end < 0 || length < end))
+		end = length;
+	if(end >= 0 && sndin->position >= end) {
+		if(!looping || end <= sndin->start) {
+			sndin->done = 1;
+			ugen->signal = 1;
+			return;
+		}
+		sndin->position -= end - sndin->start;
+	}
+	
+	if(count == 0) {
+		if(eof && looping) {
+			/* loop was set after the decoder had got to the end; start it again */
+			sndin_seek_to(sndin, sndin->start);
+			if(sndin->wait)
+				sndin_tick(ugen);
+		} else if(eof) {
+			/* ran out of data; wake whoever is waiting for it to finish */
+			sndin->done = 1;
+			ugen->signal = 1;
+		}
+		return;
+	}
+	
+	for(c = 0; c < sndin->channels; c++)
+		sum += sndin->out[c] = ring_peek(&decoder->rings[c], 0);
+	ugen->last = sum / sndin->channels;
+	if(sndin->rate > 0)
+		sndin->skip += sndin->rate;
+}
+
+/* lets the decoder threads free the decoder, or lets go of the cached file */
+static void
+sndin_stop(SndIn *sndin)
+{
+	if(sndin->decoder != NULL)
+		STORE(&sndin->decoder->closed, 1);
+	if(sndin->entry != NULL)
+		cache_release(sndin->entry);
+	sndin->decoder = NULL;
+	sndin->entry = NULL;
+	sndin->done = 1;
+}
+
+static void
+sndin_release(UGen *ugen)
+{
+	SndIn *sndin = (SndIn *)ugen;
+	
+	sndin_stop(sndin);
+	ckv_free(sndin->out);
+}
+
+static double
+sndin_read(UGen *ugen, int c)
+{
+	return ((SndIn *)ugen)->out[c];
+}
+
+static void sndin_copy(lua_State *L, UGen *ugen, int index);
+static int sndin_seek(lua_State *L);
+static int sndin_region(lua_State *L);
+static int sndin_output(lua_State *L);
+static int sndin_close(lua_State *L);
+
+static const luaL_Reg sndin_methods[] = {
+	{ "seek", sndin_seek },
+	{ "region", sndin_region },
+	{ "output", sndin_output },
+	{ "close", sndin_close },
+	{ NULL, NULL }
+};
+
+static const UGenClass sndin_class = { "SndIn", sizeof(SndIn), NULL, sndin_fields, sndin_methods, sndin_tick, sndin_release, sndin_copy };
+
+/* allocates sndin's out for its channels, raising an error if it can't */
+static void
+sndin_alloc(lua_State *L, SndIn *sndin, int channels)
+{
+	sndin->out = (double *)ckv_malloc(sizeof(double) * channels);
+	if(sndin->out == NULL)
+		luaL_error(L, "out of memory opening a sound file");
+	memset(sndin->out, 0, sizeof(double) * channels);
+	sndin->channels = channels;
+}
+
+/*
+opens filename for sndin, from the cache or by filling its rings and handing it to
+the decoder threads, and returns its duration in samples; raises an error on failure
+*/
+static double
+sndin_open(lua_State *L, SndIn *sndin, const char *filename)
+{
+	Decoder *decoder;
+	double duration;
+	
+	/* from the start, with no seek outstanding (a copy comes with its original's) */
+	sndin->looping = 0;
+	sndin->pending = 0;
+	sndin->request = 0;
+	sndin->position = 0;
+	
+	sndin->entry = cache_acquire(filename, sndin->ugen.sample_rate);
+	if(sndin->entry != NULL) {
+		sndin->done = 0;
+		sndin_alloc(L, sndin, sndin->entry->channels);
+		return sndin->entry->frames;
+	}
+	
+	decoder = (Decoder *)ckv_malloc(sizeof(Decoder));
+	if(decoder == NULL)
+		luaL_error(L, "out of memory opening \"%s\"", filename);
+	
+	if(!decoder_open(decoder, filename, sndin->ugen.sample_rate)) {
+		ckv_free(decoder);
+		luaL_error(L, "could not open file \"%s\"", filename);
+	}
+	
+	if(!decoder_alloc_rings(decoder, sndin->prefetch)) {
+		decoder_close(decoder);
+		luaL_error(L, "out of memory opening \"%s\"", filename);
+	}
+	
+	/* the cache holds every channel; a file of unknown length might never end, so it isn't cached */
+	duration = decoder->pFormatCtx->duration / 1000000.0 * sndin->ugen.sample_rate;
+	if(decoder->pFormatCtx->duration != AV_NOPTS_VALUE && duration * decoder->channels * sizeof(float) <= CACHE_FILE_LIMIT)
+		cache_request(filename, sndin->ugen.sample_rate);
+	decoder_fill(decoder);
+	
+	if(!pool_add(decoder)) {
+		decoder_close(decoder);
+		luaL_error(L, "could not start a decoder thread");
+	}
+	
+	sndin->decoder = decoder;
+	sndin->done = 0;
+	sndin_alloc(L, sndin, decoder->channels);
+	
+	return duration;
+}
+
+/* a copy plays its own file, from the start of the region, and has its own "outputs" */
+static void
+sndin_copy(lua_State *L, UGen *ugen, int index)
+{
+	SndIn *sndin = (SndIn *)ugen;
+	
+	sndin->decoder = NULL;
+	sndin->entry = NULL;
+	sndin->out = NULL;
+	sndin->channels = 0;
+	sndin->done = 1;
+	sndin->skip = 0;
+	
+	lua_newtable(L);
+	lua_setfield(L, index, "outputs");
+	
+	lua_getfield(L, index, "filename");
+	sndin_open(L, sndin, luaL_checkstring(L, -1));
+	lua_pop(L, 1);
+	if(sndin->start > 0 || sndin->end >= 0)
+		sndin_seek_to(sndin, sndin->start);
+	
+	ckvm_push_new_event(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, index, "done");
+	lua_setfield(L, index, "event");
+}
+
+/* args: self, position */
+static int
+sndin_seek(lua_State *L)
+{
+	SndIn *sndin = (SndIn *)ugen_check(L, 1, &sndin_class);
+	sndin_seek_to(sndin, luaL_checknumber(L, 2));
+	
+	return 0;
+}
+
+/* args: self, start (default 0), len (default the rest of the file); seeks to start */
+static int
+sndin_region(lua_State *L)
+{
+	SndIn *sndin = (SndIn *)ugen_check(L, 1, &sndin_class);
+	double start = luaL_optnumber(L, 2, 0);
+	double len = luaL_optnumber(L, 3, -1);
+	
+	luaL_argcheck(L, start >= 0, 2, "the region starts before the file");
+	
+	sndin->start = start;
+	sndin->end = len >= 0 ? start + len : -1;
+	sndin_seek_to(sndin, start);
+	
+	return 0;
+}
+
+/* args: self, channel */
+static int
+sndin_output(lua_State *L)
+{
+	SndIn *sndin = (SndIn *)ugen_check(L, 1, &sndin_class);
+	int c = luaL_checkint(L, 2) - 1;
+	
+	luaL_argcheck(L, c >= 0 && c < sndin->channels, 2, "no such channel");
+	ugen_push_output(L, 1, "sndin", c, sndin_read);
+	
+	return 1;
+}
+
+/* args: self */
+static int
+sndin_close(lua_State *L)
+{
+	SndIn *sndin = (SndIn *)ugen_check(L, 1, &sndin_class);
+	sndin_stop(sndin);
 	
-	/* self */
-	lua_createtable(L, 0 /* array */, 2 /* non-array */);
+	return 0;
+}
+
+/* args: filename, prefetch (in samples; default half a second) */
+static int
+new_sndin(lua_State *L)
+{
+	const char *filename = luaL_checkstring(L, 1);
+	int prefetch = luaL_optint(L, 2, 0);
+	SndIn *sndin;
+	double duration;
+	int self;
 	
-	/* set GC routine, then */
-	/* self.obj = sndin* */
-	lua_pushlightuserdata(L, sndin);
-	lua_createtable(L, 0 /* array */, 1 /* non-array */); /* new metatable */
-	lua_pushcfunction(L, ckv_sndin_release);
-	lua_setfield(L, -2, "__gc");
-	lua_setmetatable(L, -2);
-	lua_setfield(L, -2, "obj");
+	sndin = (SndIn *)ugen_new(L, &sndin_class);
+	self = lua_gettop(L);
+	sndin->rate = 1;
+	sndin->loop = 0;
+	sndin->start = 0;
+	sndin->end = -1;
+	sndin->out = NULL;
+	sndin->prefetch = prefetch > 0 ? prefetch : sndin->ugen.sample_rate * DEFAULT_PREFETCH;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "offline");
+	sndin->wait = lua_toboolean(L, -1);
+	lua_pop(L, 1);
 	
-	/* self.filename = filename */
-	lua_pushvalue(L, 2);
-	lua_setfield(L, -2, "filename");
+	duration = sndin_open(L, sndin, filename);
 	
-	/* self.duration = ... */
-	lua_pushnumber(L, sndin->pFormatCtx->duration / 1000000.0 * sample_rate);
-	lua_setfield(L, -2, "duration");
+	lua_pushvalue(L, 1);
+	lua_setfield(L, self, "filename");
 	
-	/* self.rate = 1 */
-	lua_pushnumber(L, 1);
-	lua_setfield(L, -2, "rate");
+	lua_pushnumber(L, duration);
+	lua_setfield(L, self, "duration");
 	
-	/* add sndin methods */
-	luaL_register(L, NULL, ckvugen_sndin);
+	lua_pushnumber(L, sndin->channels);
+	lua_setfield(L, self, "channels");
 	
-	return 1; /* return self */
+	lua_newtable(L);
+	lua_setfield(L, self, "outputs");
+	
+	/* an Event broadcast when the file runs out */
+	ckvm_push_new_event(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, self, "done");
+	lua_setfield(L, self, "event");
+	
+	return 1;
+}
+
+/* args: table of filenames */
+static int
+ckv_preload(lua_State *L)
+{
+	int sample_rate, i, n;
+	
+	luaL_checktype(L, 1, LUA_TTABLE);
+	
+	ckvm_pushstdglobal(L, "sample_rate");
+	sample_rate = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	
+	n = lua_objlen(L, 1);
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, 1, i);
+		cache_request(luaL_checkstring(L, -1), sample_rate);
+		lua_pop(L, 1);
+	}
+	
+	return 0;
 }
 
 /* LIBRARY REGISTRATION */
@@ -352,9 +1583,12 @@ ckv_sndin_new(lua_State *L)
 int
 open_ugen_sndin(lua_State *L)
 {
-	lua_pushcfunction(L, ckv_sndin_new);
+	lua_pushcfunction(L, new_sndin);
 	lua_setglobal(L, "SndIn");
 	
+	lua_pushcfunction(L, ckv_preload);
+	lua_setglobal(L, "preload");
+	
 	(void) luaL_dostring(L,
 	"function play(filename, dest)"
 	"  fork(function()"
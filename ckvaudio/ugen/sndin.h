@@ -0,0 +1,14 @@
+#ifndef SNDIN_H
+#define SNDIN_H
+
+/*
+decodes all of filename at sample_rate, for ugens that need a whole file
+at once (Convolver's impulse responses). it goes through SndIn's cache,
+so a file that's been decoded before, in this run or an earlier one,
+isn't decoded again. returns the samples, a frame (a sample of each
+channel) at a time, which the caller frees with ckv_free(), and sets
+frames and channels; NULL if the file can't be decoded.
+*/
+float *sndin_load(const char *filename, int sample_rate, long *frames, int *channels);
+
+#endif
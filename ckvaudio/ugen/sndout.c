@@ -0,0 +1,550 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <libavutil/opt.h>
+
+#include "../../alloc.h"
+#include "ugen.h"
+#include "ring.h"
+
+/*
+
+SndOut(filename, format, channels) records its input to a sound file, for
+capturing stems of a live set. channel c is port c, and the default port is
+channel 1 (channels defaults to 1); its own output is channel 1, passed
+through. it is a sink, so it records whether or not anything is listening
+to it.
+
+format is "wav" (32-bit float), "wav16" (16-bit) or "flac"; by default it's
+"flac" if filename ends in .flac, and "wav" otherwise.
+
+ticking a SndOut only copies its inputs into a ring (a couple of seconds
+long); a writer thread encodes what's in the rings a quarter second or so
+at a time and writes it out. if the writer falls behind and a ring fills,
+the samples that don't fit are dropped and counted in the overruns field,
+rather than holding up the audio (when rendering offline with -s, the
+SndOut waits for the writer instead).
+
+fields: overruns (samples dropped), and channels and filename
+
+methods:
+  sndout:close()  stops recording; the writer finishes the file
+
+a SndOut that's collected, or still recording when ckv exits, is closed
+and finished too. a copy passes its input through but records nothing.
+
+*/
+
+#define MAX_CHANNELS (8) /* what an AVFrame has planes for */
+#define RING_SECONDS (2)
+#define WRITE_SECONDS (0.25) /* how much the writer lets build up before encoding it */
+#define FRAME_SIZE (4096) /* samples encoded at a time, for codecs that will take any number */
+#define WRITER_POLL_NS (20000000) /* how often the writer looks for SndOuts with enough to write */
+#define WAIT_NS (100000) /* how long an offline SndOut sleeps at a time while the writer catches up */
+
+typedef struct _Format {
+	const char *name;
+	const char *muxer;
+	enum AVCodecID codec;
+} Format;
+
+static const Format formats[] = {
+	{ "wav", "wav", AV_CODEC_ID_PCM_F32LE },
+	{ "wav16", "wav", AV_CODEC_ID_PCM_S16LE },
+	{ "flac", "flac", AV_CODEC_ID_FLAC },
+	{ NULL, NULL, AV_CODEC_ID_NONE }
+};
+
+typedef struct _Encoder {
+	/* only touched by the writer thread, once the SndOut has it */
+	AVFormatContext *pFormatCtx;
+	AVCodecContext *pCodecCtx;
+	AVStream *stream;
+	SwrContext *converter;
+	AVFrame *frame;
+	uint8_t *converted[MAX_CHANNELS]; /* a frame in the codec's sample format */
+	float *samples; /* a frame as it comes out of the ring */
+	int frameSize;
+	int channels;
+	unsigned int chunk; /* floats in the ring worth waking up for */
+	int64_t written; /* samples encoded so far, for timestamps */
+	int opened; /* the file is open */
+	int failed; /* writing failed, so what's left is thrown away */
+
+	/* shared with the SndOut */
+	Ring ring; /* interleaved frames */
+	int closed; /* set by the SndOut when it's done with the encoder */
+
+	/* the writer's list, under writer_lock */
+	struct _Encoder *next;
+} Encoder;
+
+typedef struct _SndOut {
+	UGen ugen;
+	double overruns;
+	int channels;
+	int wait; /* offline: wait for the writer rather than drop samples */
+	Encoder *encoder;
+} SndOut;
+
+static const UGenField sndout_fields[] = {
+	{ "overruns", offsetof(SndOut, overruns) },
+	{ NULL, 0 }
+};
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_idle = PTHREAD_COND_INITIALIZER;
+static Encoder *writers = NULL;
+static int writer_started = 0;
+static int writer_exiting = 0;
+
+
+/* THE ENCODER */
+
+/* frees whatever of the encoder has been set up, closing the file if it was opened */
+static
+void
+encoder_free(Encoder *encoder)
+{
+	if(encoder->pCodecCtx != NULL)
+		avcodec_close(encoder->pCodecCtx);
+	if(encoder->opened)
+		avio_close(encoder->pFormatCtx->pb);
+	if(encoder->pFormatCtx != NULL)
+		avformat_free_context(encoder->pFormatCtx);
+	swr_free(&encoder->converter);
+	av_freep(&encoder->converted[0]);
+	av_free(encoder->frame);
+	ckv_free(encoder->samples);
+	ring_free(&encoder->ring);
+	ckv_free(encoder);
+}
+
+/* returns a new encoder writing filename, with its header written, or NULL on failure */
+static
+Encoder *
+encoder_open(const char *filename, const Format *format, int channels, int sample_rate)
+{
+	Encoder *encoder;
+	AVCodec *pCodec;
+	AVCodecContext *pCodecCtx;
+	int64_t layout = av_get_default_channel_layout(channels);
+	unsigned int size = sample_rate * RING_SECONDS * channels;
+	int c;
+	
+	encoder = (Encoder *)ckv_malloc(sizeof(Encoder));
+	if(encoder == NULL)
+		return NULL;
+	memset(encoder, 0, sizeof(Encoder));
+	encoder->channels = channels;
+	
+	/* allocate the ring first, so encoder_free() can always free it */
+	if(!ring_init(&encoder->ring, size)) {
+		ckv_free(encoder);
+		return NULL;
+	}
+	encoder->chunk = sample_rate * WRITE_SECONDS * channels;
+	if(encoder->chunk > ring_size(&encoder->ring) / 2)
+		encoder->chunk = ring_size(&encoder->ring) / 2;
+	
+	av_register_all();
+	
+	pCodec = avcodec_find_encoder(format->codec);
+	if(pCodec == NULL || avformat_alloc_output_context2(&encoder->pFormatCtx, NULL, format->muxer, filename) < 0 || encoder->pFormatCtx == NULL) {
+		encoder_free(encoder);
+		return NULL;
+	}
+	
+	encoder->stream = avformat_new_stream(encoder->pFormatCtx, pCodec);
+	if(encoder->stream == NULL) {
+		encoder_free(encoder);
+		return NULL;
+	}
+	
+	/* samples are timestamped by their number */
+	pCodecCtx = encoder->stream->codec;
+	pCodecCtx->sample_rate = sample_rate;
+	pCodecCtx->channels = channels;
+	pCodecCtx->channel_layout = layout;
+	pCodecCtx->sample_fmt = pCodec->sample_fmts != NULL ? pCodec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+	pCodecCtx->time_base.num = 1;
+	pCodecCtx->time_base.den = sample_rate;
+	encoder->stream->time_base = pCodecCtx->time_base;
+	if(encoder->pFormatCtx->oformat->flags & AVFMT_GLOBALHEADER)
+		pCodecCtx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	
+	if(avcodec_open2(pCodecCtx, pCodec, NULL) != 0) {
+		encoder_free(encoder);
+		return NULL;
+	}
+	encoder->pCodecCtx = pCodecCtx;
+	encoder->frameSize = pCodecCtx->frame_size > 0 ? pCodecCtx->frame_size : FRAME_SIZE;
+	
+	/* a converter from interleaved floats to the codec's format, and a frame's worth of each */
+	encoder->converter = swr_alloc();
+	av_opt_set_int(encoder->converter, "in_channel_layout", layout, 0);
+	av_opt_set_int(encoder->converter, "out_channel_layout", layout, 0);
+	av_opt_set_int(encoder->converter, "in_sample_rate", sample_rate, 0);
+	av_opt_set_int(encoder->converter, "out_sample_rate", sample_rate, 0);
+	av_opt_set_sample_fmt(encoder->converter, "in_sample_fmt", AV_SAMPLE_FMT_FLT, 0);
+	av_opt_set_sample_fmt(encoder->converter, "out_sample_fmt", pCodecCtx->sample_fmt, 0);
+	encoder->samples = (float *)ckv_malloc(sizeof(float) * encoder->frameSize * channels);
+	encoder->frame = avcodec_alloc_frame();
+	if(swr_init(encoder->converter) != 0 || encoder->samples == NULL || encoder->frame == NULL
+	   || av_samples_alloc(encoder->converted, NULL, channels, encoder->frameSize, pCodecCtx->sample_fmt, 0) < 0) {
+		encoder_free(encoder);
+		return NULL;
+	}
+	
+	encoder->frame->format = pCodecCtx->sample_fmt;
+	encoder->frame->channel_layout = layout;
+	encoder->frame->sample_rate = sample_rate;
+	for(c = 0; c < MAX_CHANNELS; c++)
+		encoder->frame->data[c] = encoder->converted[c];
+	encoder->frame->extended_data = encoder->frame->data;
+	
+	if(!(encoder->pFormatCtx->oformat->flags & AVFMT_NOFILE)) {
+		if(avio_open(&encoder->pFormatCtx->pb, filename, AVIO_FLAG_WRITE) < 0) {
+			encoder_free(encoder);
+			return NULL;
+		}
+		encoder->opened = 1;
+	}
+	
+	if(avformat_write_header(encoder->pFormatCtx, NULL) < 0) {
+		encoder_free(encoder);
+		return NULL;
+	}
+	
+	return encoder;
+}
+
+/* encodes frame (or, if it's NULL, flushes the codec) and writes the packet it makes; returns 1 if it made one */
+static
+int
+encoder_encode(Encoder *encoder, AVFrame *frame)
+{
+	AVPacket packet;
+	int got = 0;
+	
+	av_init_packet(&packet);
+	packet.data = NULL;
+	packet.size = 0;
+	
+	if(avcodec_encode_audio2(encoder->pCodecCtx, &packet, frame, &got) < 0) {
+		fprintf(stderr, "[ckv] SndOut could not encode\n");
+		encoder->failed = 1;
+		return 0;
+	}
+	if(!got)
+		return 0;
+	
+	packet.stream_index = encoder->stream->index;
+	packet.pts = av_rescale_q(packet.pts, encoder->pCodecCtx->time_base, encoder->stream->time_base);
+	packet.dts = av_rescale_q(packet.dts, encoder->pCodecCtx->time_base, encoder->stream->time_base);
+	packet.duration = av_rescale_q(packet.duration, encoder->pCodecCtx->time_base, encoder->stream->time_base);
+	
+	if(av_interleaved_write_frame(encoder->pFormatCtx, &packet) < 0) {
+		fprintf(stderr, "[ckv] SndOut could not write\n");
+		encoder->failed = 1;
+	}
+	av_free_packet(&packet);
+	
+	return 1;
+}
+
+/* encodes the whole frames in the ring; if last, the partial frame at the end too */
+static
+void
+encoder_write(Encoder *encoder, int last)
+{
+	unsigned int n;
+	
+	for(;;) {
+		n = ring_count(&encoder->ring) / encoder->channels;
+		if(n == 0 || (n < encoder->frameSize && !last))
+			break;
+		if(n > encoder->frameSize)
+			n = encoder->frameSize;
+	
+		ring_read(&encoder->ring, encoder->samples, n * encoder->channels);
+		if(encoder->failed)
+			continue;
+	
+		swr_convert(encoder->converter, encoder->converted, n, (const uint8_t **)&encoder->samples, n);
+		encoder->frame->nb_samples = n;
+		encoder->frame->pts = encoder->written;
+		encoder->written += n;
+		encoder_encode(encoder, encoder->frame);
+	}
+}
+
+/* writes out the rest of the ring and whatever the codec is holding on to, finishes the file and frees the encoder */
+static
+void
+encoder_finish(Encoder *encoder)
+{
+	encoder_write(encoder, 1);
+	
+	if(!encoder->failed && (encoder->pCodecCtx->codec->capabilities & CODEC_CAP_DELAY))
+		while(!encoder->failed && encoder_encode(encoder, NULL))
+			;
+	
+	if(av_write_trailer(encoder->pFormatCtx) < 0)
+		fprintf(stderr, "[ckv] SndOut could not finish its file\n");
+	
+	encoder_free(encoder);
+}
+
+
+/* THE WRITER THREAD */
+
+static
+void *
+writer_thread(void *arg)
+{
+	Encoder *encoder, **link;
+	struct timespec until;
+	
+	pthread_mutex_lock(&writer_lock);
+	
+	for(;;) {
+		for(link = &writers; *link != NULL; link = &(*link)->next)
+			if(writer_exiting || LOAD(&(*link)->closed) || ring_count(&(*link)->ring) >= (*link)->chunk)
+				break;
+		encoder = *link;
+	
+		if(encoder == NULL) {
+			if(writers == NULL)
+				pthread_cond_broadcast(&writer_idle);
+	
+			/* SndOuts only fill rings, so they can't wake us; look again in a bit */
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_nsec += WRITER_POLL_NS;
+			if(until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&writer_wake, &writer_lock, &until);
+			continue;
+		}
+	
+		/* only this thread takes encoders off the list, so the others don't need the lock while it writes */
+		if(writer_exiting || LOAD(&encoder->closed)) {
+			*link = encoder->next;
+			pthread_mutex_unlock(&writer_lock);
+			encoder_finish(encoder);
+			pthread_mutex_lock(&writer_lock);
+			continue;
+		}
+	
+		pthread_mutex_unlock(&writer_lock);
+		encoder_write(encoder, 0);
+		pthread_mutex_lock(&writer_lock);
+	}
+	
+	return NULL;
+}
+
+/* at exit, has the writer finish every file, even those whose SndOuts are still recording */
+static
+void
+writer_finish_all(void)
+{
+	pthread_mutex_lock(&writer_lock);
+	
+	writer_exiting = 1;
+	pthread_cond_signal(&writer_wake);
+	while(writers != NULL)
+		pthread_cond_wait(&writer_idle, &writer_lock);
+	
+	pthread_mutex_unlock(&writer_lock);
+}
+
+/* hands an encoder to the writer thread, starting it if it hasn't been; returns 0 on failure */
+static
+int
+writer_add(Encoder *encoder)
+{
+	pthread_t thread;
+	int ok = 1;
+	
+	pthread_mutex_lock(&writer_lock);
+	
+	if(!writer_started && pthread_create(&thread, NULL, writer_thread, NULL) == 0) {
+		pthread_detach(thread);
+		atexit(writer_finish_all);
+		writer_started = 1;
+	}
+	
+	if(writer_started) {
+		encoder->next = writers;
+		writers = encoder;
+	} else {
+		ok = 0;
+	}
+	
+	pthread_mutex_unlock(&writer_lock);
+	
+	return ok;
+}
+
+
+/* THE UGEN */
+
+static void
+sndout_tick(UGen *ugen)
+{
+	SndOut *sndout = (SndOut *)ugen;
+	Encoder *encoder = sndout->encoder;
+	struct timespec wait = { 0, WAIT_NS };
+	float frame[MAX_CHANNELS];
+	int c;
+	
+	ugen->in[1] += ugen->in[0];
+	ugen->last = ugen->in[1];
+	if(encoder == NULL)
+		return;
+	
+	for(c = 0; c < sndout->channels; c++)
+		frame[c] = ugen->in[c + 1];
+	
+	/* a frame goes in whole or not at all, so the writer never sees part of one */
+	while(ring_space(&encoder->ring) < sndout->channels) {
+		if(!sndout->wait) {
+			sndout->overruns += 1;
+			return;
+		}
+		nanosleep(&wait, NULL);
+	}
+	ring_write(&encoder->ring, frame, sndout->channels);
+}
+
+/* lets the writer finish the file and free the encoder */
+static void
+sndout_stop(SndOut *sndout)
+{
+	if(sndout->encoder == NULL)
+		return;
+	
+	STORE(&sndout->encoder->closed, 1);
+	sndout->encoder = NULL;
+	
+	if(sndout->overruns > 0)
+		fprintf(stderr, "[ckv] SndOut dropped %.0f samples that it couldn't write in time\n", sndout->overruns);
+}
+
+static void
+sndout_release(UGen *ugen)
+{
+	sndout_stop((SndOut *)ugen);
+}
+
+/* a copy doesn't write to its original's file */
+static void
+sndout_copy(lua_State *L, UGen *ugen, int index)
+{
+	((SndOut *)ugen)->encoder = NULL;
+}
+
+static int sndout_close(lua_State *L);
+
+static const luaL_Reg sndout_methods[] = {
+	{ "close", sndout_close },
+	{ NULL, NULL }
+};
+
+static const UGenClass sndout_class = { "SndOut", sizeof(SndOut), NULL, sndout_fields, sndout_methods, sndout_tick, sndout_release, sndout_copy };
+
+/* args: self */
+static int
+sndout_close(lua_State *L)
+{
+	SndOut *sndout = (SndOut *)ugen_check(L, 1, &sndout_class);
+	
+	if(sndout->encoder != NULL) {
+		sndout_stop(sndout);
+		ugen_remove_sink(L, 1);
+	}
+	
+	return 0;
+}
+
+/* returns the format called name, or the one filename's extension suggests if name is NULL */
+static const Format *
+find_format(const char *name, const char *filename)
+{
+	const char *dot;
+	int i;
+	
+	if(name == NULL) {
+		dot = strrchr(filename, '.');
+		name = dot != NULL && strcmp(dot, ".flac") == 0 ? "flac" : "wav";
+	}
+	
+	for(i = 0; formats[i].name != NULL; i++)
+		if(strcmp(formats[i].name, name) == 0)
+			return &formats[i];
+	
+	return NULL;
+}
+
+/* args: filename, format (default from the filename), channels (default 1) */
+static int
+new_sndout(lua_State *L)
+{
+	const char *filename = luaL_checkstring(L, 1);
+	const char *name = luaL_optstring(L, 2, NULL);
+	int channels = luaL_optint(L, 3, 1);
+	const Format *format = find_format(name, filename);
+	SndOut *sndout;
+	int self;
+	
+	luaL_argcheck(L, format != NULL, 2, "unknown format");
+	luaL_argcheck(L, channels >= 1 && channels <= MAX_CHANNELS, 3, "unsupported number of channels");
+	
+	sndout = (SndOut *)ugen_new_ports(L, &sndout_class, channels + 1);
+	self = lua_gettop(L);
+	sndout->channels = channels;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "offline");
+	sndout->wait = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	
+	sndout->encoder = encoder_open(filename, format, channels, sndout->ugen.sample_rate);
+	if(sndout->encoder == NULL)
+		luaL_error(L, "could not open \"%s\" for recording", filename);
+	if(!writer_add(sndout->encoder)) {
+		encoder_free(sndout->encoder);
+		sndout->encoder = NULL;
+		luaL_error(L, "could not start the writer thread");
+	}
+	
+	lua_pushvalue(L, 1);
+	lua_setfield(L, self, "filename");
+	
+	lua_pushnumber(L, channels);
+	lua_setfield(L, self, "channels");
+	
+	ugen_add_sink(L, self, 0);
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_sndout(lua_State *L)
+{
+	lua_pushcfunction(L, new_sndout);
+	lua_setglobal(L, "SndOut");
+	
+	return 0;
+}
@@ -0,0 +1,300 @@
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "../../ckvm.h"
+#include "../../alloc.h"
+#include "ugen.h"
+#include "fft.h"
+
+/*
+
+FFT(size, hop, window) analyzes its input's spectrum, for visuals and
+patches that follow what they hear, without Lua arithmetic every sample.
+
+it keeps the last size samples (a power of two; 1024 by default), and
+every hop samples (size / 2 by default) it windows them ("hann" by
+default, or "hamming", "blackman" or "rect") and takes their FFT. then it
+publishes:
+
+  fft.magnitudes  a read-only array of the size / 2 + 1 bins' magnitudes;
+                  bin k is (k - 1) * sample_rate / size Hz, and a sine at
+                  full scale in the middle of a bin is about 1 there
+  fft.centroid    the spectrum's centroid, in Hz (its "brightness")
+  fft.flux        how much the magnitudes rose since the last frame (the
+                  sum of the rises), which peaks at onsets
+
+and broadcasts its "event", so yield(fft.event) waits for the next frame.
+the ugen only analyzes while it's ticked, so connect it to blackhole, or
+put it in a chain: its output is its input.
+
+fields: centroid, flux, and size and hop (as given)
+
+*/
+
+#define DEFAULT_SIZE (1024)
+
+#define TWO_PI (6.28318530717958647692)
+
+#define MAGNITUDES "ckv_magnitudes"
+
+typedef struct _Spectrum {
+	UGen ugen;
+	double centroid, flux;
+	int n; /* size */
+	int step; /* hop */
+	FFT *fft;
+	double *buffer; /* the last n samples, once fill gets to n; one block, from here */
+	double *window;
+	double *frame;
+	double *re, *im;
+	double *magnitudes; /* n / 2 + 1 of them */
+	int fill;
+} Spectrum;
+
+/*
+the read-only view of an FFT's magnitudes in its "magnitudes", for shreds; it
+holds the ugen's table (as its environment), so the ugen outlives it
+*/
+typedef struct _Magnitudes {
+	Spectrum *spectrum;
+} Magnitudes;
+
+enum { WINDOW_HANN, WINDOW_HAMMING, WINDOW_BLACKMAN, WINDOW_RECT };
+
+static const char *const windows[] = { "hann", "hamming", "blackman", "rect", NULL };
+
+static const UGenField spectrum_fields[] = {
+	{ "centroid", offsetof(Spectrum, centroid) },
+	{ "flux", offsetof(Spectrum, flux) },
+	{ NULL, 0 }
+};
+
+/* takes the spectrum of the last n samples, and publishes it */
+static void
+spectrum_analyze(Spectrum *spectrum)
+{
+	int n = spectrum->n, bins = n / 2 + 1, k;
+	double *values = spectrum->magnitudes;
+	double *re = spectrum->re, *im = spectrum->im;
+	double scale = 0, m, weighted = 0, total = 0, flux = 0;
+	
+	for(k = 0; k < n; k++) {
+		spectrum->frame[k] = spectrum->buffer[k] * spectrum->window[k];
+		scale += spectrum->window[k];
+	}
+	fft_forward(spectrum->fft, spectrum->frame, re, im);
+	
+	/* a sine's energy is split between its positive and negative frequencies, except at 0 Hz and Nyquist */
+	scale = 2 / scale;
+	for(k = 0; k < bins; k++) {
+		m = sqrt(re[k] * re[k] + im[k] * im[k]) * (k == 0 || k == bins - 1 ? scale / 2 : scale);
+		if(m > values[k])
+			flux += m - values[k];
+		values[k] = m;
+		weighted += k * m;
+		total += m;
+	}
+	
+	spectrum->centroid = total > 0 ? weighted / total * spectrum->ugen.sample_rate / n : 0;
+	spectrum->flux = flux;
+}
+
+static void
+spectrum_tick(UGen *ugen)
+{
+	Spectrum *spectrum = (Spectrum *)ugen;
+	int keep = spectrum->n - spectrum->step;
+	
+	ugen->last = ugen->in[0];
+	if(spectrum->fft == NULL)
+		return; /* it couldn't be set up */
+	
+	spectrum->buffer[spectrum->fill++] = ugen->in[0];
+	if(spectrum->fill < spectrum->n)
+		return;
+	
+	spectrum_analyze(spectrum);
+	ugen->signal = 1;
+	
+	memmove(spectrum->buffer, spectrum->buffer + spectrum->step, sizeof(double) * keep);
+	spectrum->fill = keep;
+}
+
+static void
+spectrum_release(UGen *ugen)
+{
+	Spectrum *spectrum = (Spectrum *)ugen;
+	
+	fft_free(spectrum->fft);
+	ckv_free(spectrum->buffer);
+	spectrum->fft = NULL;
+	spectrum->buffer = NULL;
+}
+
+/* sets the ugen's (the table at index's) "magnitudes" to a view of spectrum's */
+static void
+set_magnitudes(lua_State *L, Spectrum *spectrum, int index)
+{
+	Magnitudes *magnitudes = (Magnitudes *)lua_newuserdata(L, sizeof(Magnitudes));
+	
+	magnitudes->spectrum = spectrum;
+	luaL_getmetatable(L, MAGNITUDES);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, index);
+	lua_setfenv(L, -2);
+	lua_setfield(L, index, "magnitudes");
+}
+
+/*
+sets up spectrum (of its n, step and window) and the table at index's
+"magnitudes", raising an error if it can't; a copy of original, if it isn't NULL
+*/
+static void
+spectrum_alloc(lua_State *L, Spectrum *spectrum, int index, const double *original)
+{
+	int n = spectrum->n, bins = n / 2 + 1;
+	
+	spectrum->fft = fft_new(n);
+	spectrum->buffer = (double *)ckv_malloc(sizeof(double) * (3 * n + 3 * bins));
+	if(spectrum->fft == NULL || spectrum->buffer == NULL) {
+		spectrum_release(&spectrum->ugen);
+		luaL_error(L, "out of memory creating an FFT");
+	}
+	
+	spectrum->window = spectrum->buffer + n;
+	spectrum->frame = spectrum->window + n;
+	spectrum->re = spectrum->frame + n;
+	spectrum->im = spectrum->re + bins;
+	spectrum->magnitudes = spectrum->im + bins;
+	if(original != NULL) {
+		memcpy(spectrum->buffer, original, sizeof(double) * 2 * n);
+		memcpy(spectrum->magnitudes, original + 3 * n + 2 * bins, sizeof(double) * bins);
+	} else {
+		memset(spectrum->magnitudes, 0, sizeof(double) * bins);
+	}
+	
+	set_magnitudes(L, spectrum, index);
+}
+
+/* a copy has its own buffers, magnitudes and event, and starts out like its original */
+static void
+spectrum_copy(lua_State *L, UGen *ugen, int index)
+{
+	Spectrum *spectrum = (Spectrum *)ugen;
+	const double *original = spectrum->buffer;
+	
+	spectrum->fft = NULL;
+	spectrum->buffer = NULL;
+	if(original == NULL)
+		return;
+	
+	spectrum_alloc(L, spectrum, index, original);
+	
+	ckvm_push_new_event(L);
+	lua_setfield(L, index, "event");
+}
+
+static const UGenClass spectrum_class = { "FFT", sizeof(Spectrum), NULL, spectrum_fields, NULL, spectrum_tick, spectrum_release, spectrum_copy };
+
+/* args: size (default 1024), hop (default size / 2), window (default "hann") */
+static int
+new_spectrum(lua_State *L)
+{
+	int n = luaL_optint(L, 1, DEFAULT_SIZE);
+	int step = luaL_optint(L, 2, n / 2);
+	int window = luaL_checkoption(L, 3, "hann", windows);
+	Spectrum *spectrum;
+	double w;
+	int k;
+	
+	luaL_argcheck(L, n >= 16 && (n & (n - 1)) == 0, 1, "size must be a power of two, at least 16");
+	luaL_argcheck(L, step > 0 && step <= n, 2, "hop must be from 1 to size");
+	
+	spectrum = (Spectrum *)ugen_new(L, &spectrum_class);
+	spectrum->n = n;
+	spectrum->step = step;
+	spectrum_alloc(L, spectrum, lua_gettop(L), NULL);
+	
+	/* periodic windows, which overlap-add evenly */
+	for(k = 0; k < n; k++) {
+		w = TWO_PI * k / n;
+		switch(window) {
+		case WINDOW_HANN:
+			spectrum->window[k] = 0.5 - 0.5 * cos(w);
+			break;
+		case WINDOW_HAMMING:
+			spectrum->window[k] = 0.54 - 0.46 * cos(w);
+			break;
+		case WINDOW_BLACKMAN:
+			spectrum->window[k] = 0.42 - 0.5 * cos(w) + 0.08 * cos(2 * w);
+			break;
+		default:
+			spectrum->window[k] = 1;
+			break;
+		}
+	}
+	memset(spectrum->buffer, 0, sizeof(double) * n);
+	
+	lua_pushnumber(L, n);
+	lua_setfield(L, -2, "size");
+	lua_pushnumber(L, step);
+	lua_setfield(L, -2, "hop");
+	
+	ckvm_push_new_event(L);
+	lua_setfield(L, -2, "event");
+	
+	return 1;
+}
+
+/* args: magnitudes, index */
+static int
+magnitudes_index(lua_State *L)
+{
+	Spectrum *spectrum = ((Magnitudes *)luaL_checkudata(L, 1, MAGNITUDES))->spectrum;
+	int k = lua_isnumber(L, 2) ? (int)lua_tonumber(L, 2) : 0;
+	
+	if(spectrum->buffer != NULL && k >= 1 && k <= spectrum->n / 2 + 1)
+		lua_pushnumber(L, spectrum->magnitudes[k - 1]);
+	else
+		lua_pushnil(L);
+	
+	return 1;
+}
+
+static int
+magnitudes_newindex(lua_State *L)
+{
+	return luaL_error(L, "an FFT's magnitudes are read-only");
+}
+
+/* args: magnitudes */
+static int
+magnitudes_len(lua_State *L)
+{
+	Spectrum *spectrum = ((Magnitudes *)luaL_checkudata(L, 1, MAGNITUDES))->spectrum;
+	lua_pushnumber(L, spectrum->n / 2 + 1);
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_spectrum(lua_State *L)
+{
+	luaL_newmetatable(L, MAGNITUDES);
+	lua_pushcfunction(L, magnitudes_index);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, magnitudes_newindex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, magnitudes_len);
+	lua_setfield(L, -2, "__len");
+	lua_pop(L, 1);
+	
+	lua_pushcfunction(L, new_spectrum);
+	lua_setglobal(L, "FFT");
+	
+	return 0;
+}
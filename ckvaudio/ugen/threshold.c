@@ -0,0 +1,112 @@
+
+#include <stddef.h>
+
+#include "../../ckvm.h"
+#include "ugen.h"
+
+/*
+
+on_threshold(ugen, level, event, direction) broadcasts event each time the
+ugen's output crosses level: going up if direction is 1 (the default), going
+down if it is -1, or either way if it is 0. event defaults to a new Event.
+
+it returns the watcher, a ugen (and a sink) that the ugen feeds. its fields
+level and direction can be changed, watcher.event is the event, and
+watcher:stop() stops watching.
+
+the event is broadcast right after the sample in which the level is crossed,
+so the shreds waiting on it wake up at that sample.
+
+*/
+
+typedef struct _Threshold {
+	UGen ugen;
+	double level;
+	double direction;
+	double previous;
+	int primed; /* there has been a previous sample */
+} Threshold;
+
+static const UGenField threshold_fields[] = {
+	{ "level", offsetof(Threshold, level) },
+	{ "direction", offsetof(Threshold, direction) },
+	{ NULL, 0 }
+};
+
+static void
+threshold_tick(UGen *ugen)
+{
+	Threshold *threshold = (Threshold *)ugen;
+	double sample = ugen->in[0];
+	double level = threshold->level;
+	
+	if(threshold->primed) {
+		if(threshold->direction >= 0 && threshold->previous < level && sample >= level)
+			ugen->signal = 1;
+		if(threshold->direction <= 0 && threshold->previous >= level && sample < level)
+			ugen->signal = 1;
+	}
+	
+	threshold->previous = sample;
+	threshold->primed = 1;
+	ugen->last = sample;
+}
+
+static int threshold_stop(lua_State *L);
+
+static const luaL_Reg threshold_methods[] = {
+	{ "stop", threshold_stop },
+	{ NULL, NULL }
+};
+
+static const UGenClass threshold_class = { "Threshold", sizeof(Threshold), NULL, threshold_fields, threshold_methods, threshold_tick, NULL, NULL };
+
+/* args: watcher */
+static int
+threshold_stop(lua_State *L)
+{
+	ugen_check(L, 1, &threshold_class);
+	ugen_remove_sink(L, 1);
+	
+	return 0;
+}
+
+/* args: ugen, level, event (optional), direction (default 1) */
+static int
+ckv_on_threshold(lua_State *L)
+{
+	double level = luaL_checknumber(L, 2);
+	double direction = luaL_optnumber(L, 4, 1);
+	Threshold *threshold;
+	int watcher;
+	
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 4);
+	
+	threshold = (Threshold *)ugen_new(L, &threshold_class);
+	threshold->level = level;
+	threshold->direction = direction;
+	watcher = lua_gettop(L);
+	
+	if(lua_istable(L, 3))
+		lua_pushvalue(L, 3);
+	else
+		ckvm_push_new_event(L);
+	lua_setfield(L, watcher, "event");
+	
+	ugen_connect(L, 1, watcher, 0);
+	ugen_add_sink(L, watcher, 0);
+	
+	return 1;
+}
+
+/* LIBRARY REGISTRATION */
+
+int
+open_ugen_threshold(lua_State *L)
+{
+	lua_pushcfunction(L, ckv_on_threshold);
+	lua_setglobal(L, "on_threshold");
+	
+	return 0;
+}
@@ -1,91 +1,731 @@
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "ugen.h"
+#include "../../ckvm.h"
+#include "graph.h"
+#include "vmath.h"
 
 /* ugens to load */
 lua_CFunction ugens[] = {
+	open_ugen_automate,
+	open_ugen_convolver,
 	open_ugen_delay,
+	open_ugen_envelope,
+	open_ugen_filter,
 	open_ugen_follower,
 	open_ugen_gain,
 	open_ugen_impulse,
+	open_ugen_mixer,
 	open_ugen_noise,
+	open_ugen_oscbank,
 	open_ugen_pulseosc,
 	open_ugen_sawosc,
 	open_ugen_sinosc,
 	open_ugen_sndin,
+	open_ugen_sndout,
+	open_ugen_spectrum,
 	open_ugen_sqrosc,
 	open_ugen_step,
+	open_ugen_threshold,
 	open_ugen_triosc,
 	NULL
 };
 
 
-/* UGen HELPER FUNCTIONS */
+/* NATIVE UGENS */
 
-/* args: ugen, port */
+#define UGEN_METATABLE "ckv_ugen"
+
+/* returns the struct of the native ugen at (absolute) index, or NULL if it isn't one */
+static
+UGen *
+to_native(lua_State *L, int index)
+{
+	UGen *ugen = NULL;
+	
+	if(lua_type(L, index) != LUA_TTABLE)
+		return NULL;
+	
+	lua_pushliteral(L, "obj");
+	lua_rawget(L, index);
+	if(lua_getmetatable(L, -1)) {
+		luaL_getmetatable(L, UGEN_METATABLE);
+		if(lua_rawequal(L, -1, -2))
+			ugen = (UGen *)lua_touserdata(L, -3);
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+	
+	return ugen;
+}
+
+/* returns the struct of the native ugen at index, raising an error if it isn't a cls */
+UGen *
+ugen_check(lua_State *L, int index, const UGenClass *cls)
+{
+	UGen *ugen;
+	
+	if(index < 0)
+		index = lua_gettop(L) + index + 1;
+	
+	ugen = to_native(L, index);
+	if(ugen == NULL || ugen->cls != cls)
+		luaL_typerror(L, index, cls->name);
+	
+	return ugen;
+}
+
+/* returns the struct of the native ugen at index, or NULL if it isn't one */
+UGen *
+ugen_test(lua_State *L, int index)
+{
+	if(index < 0)
+		index = lua_gettop(L) + index + 1;
+	
+	return to_native(L, index);
+}
+
+/* args: ugen, key; upvalues: fields (name -> offset), methods */
 static
 int
-ckv_ugen_sum_inputs(lua_State *L)
+ckv_ugen_index(lua_State *L)
 {
-	const char *port;
-	int ugen = 1;
-	double sample = 0;
+	UGen *ugen;
 	
-	luaL_checktype(L, ugen, LUA_TTABLE);
-	port = lua_gettop(L) > 1 ? lua_tostring(L, 2) : "default";
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	if(lua_isnumber(L, -1)) {
+		lua_pushliteral(L, "obj");
+		lua_rawget(L, 1);
+		ugen = (UGen *)lua_touserdata(L, -1);
+		if(ugen == NULL)
+			return 0;
+		lua_pushnumber(L, *(double *)((char *)ugen + (size_t)lua_tonumber(L, -2)));
+		return 1;
+	}
+	
+	/* ugen[j] is ugen:output(j) */
+	if(lua_type(L, 2) == LUA_TNUMBER) {
+		lua_getfield(L, lua_upvalueindex(2), "output");
+		if(lua_isnil(L, -1))
+			return 1;
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_call(L, 2, 1);
+		return 1;
+	}
+	
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(2));
+	return 1;
+}
+
+/* args: ugen, key, value; upvalues: fields (name -> offset) */
+static
+int
+ckv_ugen_newindex(lua_State *L)
+{
+	UGen *ugen;
+	
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	if(lua_isnumber(L, -1)) {
+		lua_pushliteral(L, "obj");
+		lua_rawget(L, 1);
+		ugen = (UGen *)lua_touserdata(L, -1);
+		if(ugen != NULL)
+			*(double *)((char *)ugen + (size_t)lua_tonumber(L, -2)) = luaL_checknumber(L, 3);
+		return 0;
+	}
+	
+	lua_settop(L, 3);
+	lua_rawset(L, 1);
+	return 0;
+}
+
+/* args: ugen */
+static
+int
+ckv_ugen_tick(lua_State *L)
+{
+	UGen *ugen = to_native(L, 1);
+	
+	if(ugen != NULL)
+		ugen->cls->tick(ugen);
+	
+	return 0;
+}
+
+/* args: ugen struct userdata */
+static
+int
+ckv_ugen_release(lua_State *L)
+{
+	UGen *ugen = (UGen *)lua_touserdata(L, 1);
+	
+	/* a copy that still has its original's pointers doesn't own what they point at */
+	if(ugen->cls->release != NULL && !ugen->copying)
+		ugen->cls->release(ugen);
+	
+	return 0;
+}
+
+/* pushes the metatable shared by the tables of cls's ugens, creating it the first time */
+static
+void
+push_class_metatable(lua_State *L, const UGenClass *cls)
+{
+	const UGenField *field;
+	
+	lua_pushlightuserdata(L, (void *)cls);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if(!lua_isnil(L, -1))
+		return;
+	lua_pop(L, 1);
+	
+	lua_createtable(L, 0, 2);
+	
+	/* fields */
+	lua_newtable(L);
+	lua_pushnumber(L, offsetof(UGen, last));
+	lua_setfield(L, -2, "last");
+	for(field = cls->fields; field != NULL && field->name != NULL; field++) {
+		lua_pushnumber(L, field->offset);
+		lua_setfield(L, -2, field->name);
+	}
+	
+	/* methods */
+	lua_newtable(L);
+	lua_pushcfunction(L, ckv_ugen_tick);
+	lua_setfield(L, -2, "tick");
+	if(cls->methods != NULL)
+		luaL_register(L, NULL, cls->methods);
+	
+	lua_pushvalue(L, -2); /* fields */
+	lua_insert(L, -2);
+	lua_pushcclosure(L, ckv_ugen_index, 2);
+	lua_setfield(L, -3, "__index");
+	
+	lua_pushcclosure(L, ckv_ugen_newindex, 1);
+	lua_setfield(L, -2, "__newindex");
+	
+	lua_pushlightuserdata(L, (void *)cls);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+static
+double
+get_sample_rate(lua_State *L)
+{
+	double sample_rate;
+	
+	if(ckvm_get_thread(L) != NULL)
+		ckvm_pushstdglobal(L, "sample_rate");
+	else
+		lua_getglobal(L, "sample_rate");
+	sample_rate = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	
+	return sample_rate > 0 ? sample_rate : 44100;
+}
+
+/* adds the ugen at (absolute) index to the patch being recorded, if there is one (see PATCHES) */
+static
+void
+record_ugen(lua_State *L, int ugen)
+{
+	int n;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_recording");
+	if(lua_istable(L, -1)) {
+		n = lua_objlen(L, -1) + 1;
+		lua_pushvalue(L, ugen);
+		lua_rawseti(L, -2, n);
+		lua_pushvalue(L, ugen);
+		lua_pushnumber(L, n);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 1);
+}
+
+/* pushes a new ugen table of class cls, returning its (zeroed) struct */
+UGen *
+ugen_new(lua_State *L, const UGenClass *cls)
+{
+	int ports = 1;
+	
+	while(cls->ports != NULL && cls->ports[ports - 1] != NULL)
+		ports++;
+	
+	return ugen_new_ports(L, cls, ports);
+}
+
+/* ... with the given number of ports, counting the default port; those past the class's named ones are only numbered */
+UGen *
+ugen_new_ports(lua_State *L, const UGenClass *cls, int ports)
+{
+	UGen *ugen;
+	size_t size, total;
+	
+	/* the port sums follow the struct */
+	size = (cls->size + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+	total = size + sizeof(double) * ports;
+	
+	lua_createtable(L, 0, 1);
+	
+	ugen = (UGen *)lua_newuserdata(L, total);
+	memset(ugen, 0, total);
+	ugen->cls = cls;
+	ugen->in = (double *)((char *)ugen + size);
+	ugen->ports = ports;
+	ugen->sample_rate = get_sample_rate(L);
+	luaL_getmetatable(L, UGEN_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_setfield(L, -2, "obj");
+	
+	push_class_metatable(L, cls);
+	lua_setmetatable(L, -2);
+	
+	record_ugen(L, lua_gettop(L));
+	
+	return ugen;
+}
+
+
+/* GRAPH HELPERS */
+
+#define GRAPH_METATABLE "ckv_graph"
+#define NODE_METATABLE "ckv_node"
+#define DEFAULT_PORT (0)
+
+/*
+a node holds a reference to its ugen only while the ugen is a sink or feeds
+another, so everything a sink depends on is kept. ugen_nodes has weak keys,
+so any other ugen is collected once the script lets go of it; its node's
+handle (the value in ugen_nodes) is collected after it, and the node is
+removed from the graph at the next tick. a node left with no edges is
+removed right away.
+*/
+
+static
+Graph
+get_graph(lua_State *L)
+{
+	Graph *graph;
 	
 	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_graph");
-	lua_getfield(L, -1, "conns");
+	graph = (Graph *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
 	
+	return *graph;
+}
+
+/* returns the node for the ugen at index ugen, optionally creating it; NULL if there is none */
+static
+Node *
+get_node(lua_State *L, int ugen, int create)
+{
+	Graph graph;
+	Node *node, **handle;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_nodes");
 	lua_pushvalue(L, ugen);
 	lua_rawget(L, -2);
+	handle = (Node **)lua_touserdata(L, -1);
+	node = handle != NULL ? *handle : NULL;
+	lua_pop(L, 1);
 	
-	if(lua_isnil(L, -1)) {
-		/* nothing connected to this ugen */
-		lua_pushnumber(L, 0);
-		return 1;
+	if(node == NULL && create) {
+		graph = get_graph(L);
+		node = graph_add_node(graph);
+		if(node == NULL)
+			luaL_error(L, "out of memory adding a ugen to the graph");
+		
+		node->ref = LUA_NOREF;
+		node->native = to_native(L, ugen);
+		
+		lua_getfield(L, ugen, "last");
+		node->last = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		
+		lua_pushvalue(L, ugen);
+		handle = (Node **)lua_newuserdata(L, sizeof(Node *));
+		*handle = node;
+		luaL_getmetatable(L, NODE_METATABLE);
+		lua_setmetatable(L, -2);
+		lua_rawset(L, -3);
 	}
 	
-	lua_getfield(L, -1, port);
-	if(lua_isnil(L, -1)) {
-		/* nothing connected to this port */
-		lua_pushnumber(L, 0);
-		return 1;
+	lua_pop(L, 1); /* pop ugen_nodes */
+	
+	return node;
+}
+
+/* pushes the ugen of node, or nil if it's gone */
+static
+void
+push_ugen(lua_State *L, Node *node)
+{
+	Node **handle;
+	
+	if(node->ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, node->ref);
+		return;
 	}
 	
-	/* enumerate the inputs */
-	lua_pushnil(L); /* first key */
+	/* it isn't holding its ugen, so look for it */
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_nodes");
+	lua_pushnil(L);
 	while(lua_next(L, -2) != 0) {
-		/* pairs are source (-2) -> connection count (-1) */
-		int connection_count = lua_tonumber(L, -1);
+		handle = (Node **)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if(*handle == node) {
+			lua_remove(L, -2);
+			return;
+		}
+	}
+	lua_pop(L, 1);
+	lua_pushnil(L);
+}
+
+/* whether a node needs to keep its ugen */
+static
+int
+is_held(Node *node)
+{
+	Edge *edge;
+	
+	if(node->sink)
+		return 1;
+	for(edge = node->outputs; edge != NULL; edge = edge->next_output)
+		if(edge->port >= 0)
+			return 1;
+	
+	return 0;
+}
+
+/*
+takes or drops node's reference to its ugen (at index ugen), as it needs.
+during a batch, references are only taken, since it may be rolled back.
+*/
+static
+void
+update_ref(lua_State *L, Node *node, int ugen)
+{
+	int held = is_held(node);
+	
+	if(held && node->ref == LUA_NOREF) {
+		lua_pushvalue(L, ugen);
+		node->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	} else if(!held && node->ref != LUA_NOREF && !graph_in_batch(get_graph(L))) {
+		luaL_unref(L, LUA_REGISTRYINDEX, node->ref);
+		node->ref = LUA_NOREF;
+	}
+}
+
+/* removes the node of the ugen at index ugen if it has no edges left */
+static
+void
+prune(lua_State *L, Node *node, int ugen)
+{
+	Graph graph = get_graph(L);
+	Node **handle;
+	
+	if(node->sink || node->inputs != NULL || node->outputs != NULL || graph_in_batch(graph))
+		return;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_nodes");
+	lua_pushvalue(L, ugen);
+	lua_rawget(L, -2);
+	handle = (Node **)lua_touserdata(L, -1);
+	*handle = NULL;
+	lua_pop(L, 1);
+	lua_pushvalue(L, ugen);
+	lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	
+	if(node->ref != LUA_NOREF)
+		luaL_unref(L, LUA_REGISTRYINDEX, node->ref);
+	graph_remove_node(graph, node);
+}
+
+/* updates a node whose edges have changed, for the ugen at index ugen */
+static
+void
+settle(lua_State *L, Node *node, int ugen)
+{
+	update_ref(L, node, ugen);
+	prune(L, node, ugen);
+}
+
+/* settles every node that still holds its ugen, after a batch */
+static
+void
+settle_all(lua_State *L)
+{
+	Graph graph = get_graph(L);
+	Node *node;
+	int i;
+	
+	/* (from the end, since pruning moves the nodes after it up) */
+	for(i = graph_size(graph) - 1; i >= 0; i--) {
+		node = graph_node(graph, i);
+		if(node->ref == LUA_NOREF)
+			continue;
+		lua_rawgeti(L, LUA_REGISTRYINDEX, node->ref);
+		settle(L, node, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+}
+
+/* args: node handle, whose ugen has been collected */
+static
+int
+ckv_node_release(lua_State *L)
+{
+	Node **handle = (Node **)lua_touserdata(L, 1);
+	
+	if(*handle == NULL)
+		return 0;
+	
+	/* (it can't be removed now: the graph may be in the middle of a tick) */
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_garbage");
+	lua_pushlightuserdata(L, *handle);
+	lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
+	lua_pop(L, 1);
+	
+	return 0;
+}
+
+/* removes the nodes whose ugens have been collected */
+static
+void
+remove_collected(lua_State *L)
+{
+	Graph graph;
+	Node *node;
+	Edge *edge;
+	int n, count, top;
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_garbage");
+	
+	while((n = lua_objlen(L, -1)) > 0) {
+		lua_rawgeti(L, -1, n);
+		node = (Node *)lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, -2, n);
+		
+		/* its sources all hold their ugens, since they feed it; keep them while it goes */
+		top = lua_gettop(L);
+		count = 0;
+		for(edge = node->inputs; edge != NULL; edge = edge->next_input, count++) {
+			luaL_checkstack(L, 1, "too many ugens to release");
+			lua_rawgeti(L, LUA_REGISTRYINDEX, edge->source->ref);
+		}
 		
-		lua_getfield(L, -2, "last"); /* source.last */
-		sample += lua_tonumber(L, -1) * connection_count;
+		graph = get_graph(L);
+		graph_remove_node(graph, node);
 		
-		/* remove sample and source; keeps 'key' for next iteration */
-		lua_pop(L, 2);
+		while(count > 0) {
+			node = get_node(L, top + count, 0);
+			if(node != NULL)
+				settle(L, node, top + count);
+			count--;
+		}
+		lua_settop(L, top);
+	}
+	
+	lua_pop(L, 1);
+}
+
+/*
+returns the number of the port of native (or of a Lua ugen, if native is NULL) named by the
+value at index port ("default" if it's none); -1 if there's no such port.
+a native ugen's ports are its class's. a Lua ugen can have any port, so names are given
+numbers as they're first connected to (if create is set).
+*/
+static
+int
+get_port(lua_State *L, UGen *native, int port, int create)
+{
+	const char *name;
+	int number;
+	
+	if(lua_isnoneornil(L, port))
+		return DEFAULT_PORT;
+	
+	if(lua_type(L, port) == LUA_TNUMBER) {
+		number = lua_tointeger(L, port);
+		if(number < 0 || (native != NULL && number >= native->ports))
+			return -1;
+		return number;
 	}
 	
+	if(lua_type(L, port) != LUA_TSTRING)
+		return -1;
+	
+	name = lua_tostring(L, port);
+	if(strcmp(name, "default") == 0)
+		return DEFAULT_PORT;
+	
+	if(native != NULL) {
+		for(number = 1; native->cls->ports != NULL && native->cls->ports[number - 1] != NULL; number++)
+			if(strcmp(name, native->cls->ports[number - 1]) == 0)
+				return number;
+		return -1;
+	}
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_ports");
+	lua_pushvalue(L, port);
+	lua_rawget(L, -2);
+	if(lua_isnumber(L, -1)) {
+		number = lua_tointeger(L, -1);
+	} else if(create) {
+		/* names are also listed by number, so the next number is one past the list */
+		number = lua_objlen(L, -2) + 1;
+		lua_pushvalue(L, port);
+		lua_rawseti(L, -3, number);
+		lua_pushvalue(L, port);
+		lua_pushnumber(L, number);
+		lua_rawset(L, -4);
+	} else {
+		number = -1;
+	}
+	lua_pop(L, 2);
+	
+	return number;
+}
+
+/* ticks every live ugen once, in order */
+void
+ugen_tick_all(lua_State *L)
+{
+	Graph graph = get_graph(L);
+	Node *node;
+	Edge *edge;
+	UGen *ugen;
+	int i, port;
+	
+	remove_collected(L);
+	automate_tick(L);
+	
+	for(i = 0; i < graph_size(graph); i++) {
+		node = graph_node(graph, i);
+		if(node->users == 0)
+			continue;
+		
+		/* native ugens are ticked without calling into Lua */
+		if(node->native != NULL) {
+			ugen = node->native;
+			for(port = 0; port < ugen->ports; port++)
+				ugen->in[port] = 0;
+			for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+				if(edge->port >= 0)
+					ugen->in[edge->port] += edge->source->last * edge->count;
+			
+			ugen->cls->tick(ugen);
+			node->last = ugen->last;
+			
+			if(ugen->signal) {
+				ugen->signal = 0;
+				lua_rawgeti(L, LUA_REGISTRYINDEX, node->ref);
+				lua_getfield(L, -1, "event");
+				ckvm_broadcast(L, lua_gettop(L));
+				lua_pop(L, 2);
+			}
+			continue;
+		}
+		
+		lua_rawgeti(L, LUA_REGISTRYINDEX, node->ref);
+		lua_getfield(L, -1, "tick");
+		lua_pushvalue(L, -2); /* self */
+		lua_call(L, 1, 0);
+		
+		lua_getfield(L, -1, "last");
+		node->last = lua_tonumber(L, -1);
+		lua_pop(L, 2); /* pop last and ugen */
+	}
+}
+
+/* args: graph userdata */
+static
+int
+ckv_graph_release(lua_State *L)
+{
+	Graph *graph = (Graph *)lua_touserdata(L, 1);
+	free_graph(*graph);
+	*graph = NULL;
+	
+	return 0;
+}
+
+/* UGen HELPER FUNCTIONS */
+
+/* args: ugen, port */
+static
+int
+ckv_ugen_sum_inputs(lua_State *L)
+{
+	Node *node;
+	Edge *edge;
+	int port;
+	double sample = 0;
+	
+	luaL_checktype(L, 1, LUA_TTABLE);
+	
+	node = get_node(L, 1, 0);
+	port = get_port(L, NULL, 2, 0);
+	
+	/* nothing connected to this ugen or port */
+	if(node == NULL || port < 0) {
+		lua_pushnumber(L, 0);
+		return 1;
+	}
+	
+	for(edge = node->inputs; edge != NULL; edge = edge->next_input)
+		if(edge->port == port)
+			sample += edge->source->last * edge->count;
+	
 	lua_pushnumber(L, sample);
 	return 1;
 }
 
 /* CONNECT & DISCONNECT */
 
-/* args: source1, dest1/source2, dest2/source3, ... */
+/* connects the ugen at index source to port of the one at index dest */
+void
+ugen_connect(lua_State *L, int source, int dest, int port)
+{
+	Node *source_node, *dest_node;
+	
+	dest_node = get_node(L, dest, 1);
+	source_node = get_node(L, source, 1);
+	if(graph_connect(get_graph(L), source_node, dest_node, port) < 0)
+		luaL_error(L, "out of memory connecting ugens");
+	update_ref(L, source_node, source);
+}
+
+/* args: source1, dest1/source2, dest2/source3, ..., optional port of the last dest */
 static
 int
 ckv_connect(lua_State *L) {
-	int i, graph, connect, source, dest;
+	int i, source, dest, port;
 	int nargs = lua_gettop(L);
+	int port_arg = 0;
+	Node *dest_node;
+	
+	if(nargs > 2 && (lua_type(L, nargs) == LUA_TSTRING || lua_type(L, nargs) == LUA_TNUMBER))
+		port_arg = nargs--;
 	
 	if(nargs < 2)
 		return luaL_error(L, "connect() expects at least two arguments, received %d", nargs);
 	
-	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_graph");
-	graph = lua_gettop(L);
-	lua_getfield(L, -1, "connect");
-	connect = lua_gettop(L);
-	
 	/*
 	if they provided a function (constructor) instead of a table (ex: connect(Gain, speaker)),
 	call the function and connect the return value instead
@@ -109,12 +749,16 @@ ckv_connect(lua_State *L) {
 		luaL_checktype(L, source, LUA_TTABLE);
 		luaL_checktype(L, dest, LUA_TTABLE);
 		
-		lua_pushvalue(L, connect);
-		lua_pushvalue(L, graph); /* self */
-		lua_pushvalue(L, source);
-		lua_pushvalue(L, dest);
-		lua_pushstring(L, "default"); /* port */
-		lua_call(L, 4, 0);
+		port = DEFAULT_PORT;
+		if(dest == nargs && port_arg) {
+			dest_node = get_node(L, dest, 1);
+			port = get_port(L, dest_node->native, port_arg, 1);
+			if(port < 0)
+				return luaL_error(L, "%s has no port %s",
+					dest_node->native ? dest_node->native->cls->name : "ugen", lua_tostring(L, port_arg));
+		}
+		
+		ugen_connect(L, source, dest, port);
 	}
 	
 	return 0;
@@ -125,23 +769,539 @@ static
 int
 ckv_disconnect(lua_State *L)
 {
-	const char *port;
+	Node *source, *dest;
+	int port;
 	
 	luaL_checktype(L, 1, LUA_TTABLE);
 	luaL_checktype(L, 2, LUA_TTABLE);
-	if(lua_gettop(L) < 3)
-		port = "default";
-	else
-		port = lua_tostring(L, 3);
 	
-	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_graph");
+	source = get_node(L, 1, 0);
+	dest = get_node(L, 2, 0);
+	port = dest == NULL ? -1 : get_port(L, dest->native, 3, 0);
+	
+	if(source != NULL && dest != NULL && port >= 0) {
+		graph_disconnect(get_graph(L), source, dest, port);
+		settle(L, source, 1);
+		if(dest != source)
+			prune(L, dest, 2);
+	}
+	
+	return 0;
+}
+
+/* BATCHES */
+
+/*
+args: fn, ... (passed to fn)
+the connections fn makes are ordered all at once when it returns, or are undone if it raises an error.
+returns what fn returns.
+*/
+static
+int
+ckv_graph_batch(lua_State *L)
+{
+	Graph graph = get_graph(L);
+	
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	
+	if(graph_begin(graph) < 0)
+		return luaL_error(L, "out of memory starting a graph batch");
+	
+	if(lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0) != 0) {
+		graph_rollback(graph);
+		if(!graph_in_batch(graph))
+			settle_all(L);
+		return lua_error(L);
+	}
+	
+	graph_commit(graph);
+	if(!graph_in_batch(graph))
+		settle_all(L);
+	
+	return lua_gettop(L);
+}
+
+/* OUTPUTS */
+
+typedef struct _UGenOutput {
+	UGen ugen;
+	UGen *parent;
+	UGenRead read;
+	int index;
+	const char *field; /* the parent's, in the output's table */
+} UGenOutput;
+
+static
+void
+output_tick(UGen *ugen)
+{
+	UGenOutput *output = (UGenOutput *)ugen;
+	ugen->last = output->read(output->parent, output->index);
+}
+
+/* a copy reads the parent in its field (the copy of the original's, if that was copied too) */
+static
+void
+output_copy(lua_State *L, UGen *ugen, int index)
+{
+	UGenOutput *output = (UGenOutput *)ugen;
+	
+	lua_getfield(L, index, output->field);
+	output->parent = ugen_check(L, -1, output->parent->cls);
+	
+	lua_getfield(L, -1, "outputs");
+	lua_rawgeti(L, -1, output->index + 1);
+	if(lua_isnil(L, -1)) {
+		lua_pushvalue(L, index);
+		lua_rawseti(L, -3, output->index + 1);
+	}
+	lua_pop(L, 3);
+}
+
+static const UGenClass output_class = { "Output", sizeof(UGenOutput), NULL, NULL, NULL, output_tick, NULL, output_copy };
+
+void
+ugen_push_output(lua_State *L, int self, const char *field, int index, UGenRead read)
+{
+	UGenOutput *output;
+	
+	/* each output's ugen is made once, and kept in self's "outputs" */
+	lua_getfield(L, self, "outputs");
+	lua_rawgeti(L, -1, index + 1);
+	if(!lua_isnil(L, -1)) {
+		lua_remove(L, -2);
+		return;
+	}
+	lua_pop(L, 1);
+	
+	output = (UGenOutput *)ugen_new(L, &output_class);
+	output->parent = to_native(L, self);
+	output->read = read;
+	output->index = index;
+	output->field = field;
+	
+	/* it reads self, so it's ticked after it and keeps it alive */
+	lua_pushvalue(L, self);
+	lua_setfield(L, -2, field);
+	ugen_connect(L, self, lua_gettop(L), 0);
+	
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, -3, index + 1);
+	lua_remove(L, -2);
+}
+
+/* PATCHES */
+
+#define PATCH_METATABLE "ckv_patch"
+
+/*
+Patch(fn) calls fn once, recording the native ugens it makes, how they're
+connected (to each other, and to ugens outside the patch), and which are
+sinks. fn returns the patch's output and a table naming the ugens to
+expose, either of which can be nil. its connections are then rolled back,
+leaving the ugens it made as prototypes.
+
+patch:new() copies every prototype (its struct, then its table's fields,
+with fields holding ugens of the patch pointed at their copies) and
+connects the copies the same way, ordering them all at once. no Lua runs.
+it returns the copy of the output and a table of the named copies.
+
+ugens that fn didn't make with a native constructor, Lua ugens included,
+are outside the patch, and are shared by every instance.
+*/
+
+typedef struct _PatchEdge {
+	int source; /* a ugen in the patch (from 1), or outside it (from -1) */
+	int dest; /* likewise */
+	int port;
+	int count;
+} PatchEdge;
+
+/* returns where the ugen at index is (as in PatchEdge), adding it to outside if it's new there; 0 for nil */
+static
+int
+patch_index(lua_State *L, int ugen, int ugens, int outside)
+{
+	int i;
+	
+	if(lua_isnil(L, ugen))
+		return 0;
+	luaL_checktype(L, ugen, LUA_TTABLE);
+	
+	lua_pushvalue(L, ugen);
+	lua_rawget(L, ugens);
+	i = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if(i > 0)
+		return i;
+	
+	lua_pushvalue(L, ugen);
+	lua_rawget(L, outside);
+	i = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if(i == 0) {
+		i = lua_objlen(L, outside) + 1;
+		lua_pushvalue(L, ugen);
+		lua_rawseti(L, outside, i);
+		lua_pushvalue(L, ugen);
+		lua_pushnumber(L, i);
+		lua_rawset(L, outside);
+	}
+	
+	return -i;
+}
+
+/* reads the edges into each of the patch's ugens, and from them to outside ugens; returns how many (only counting if edges is NULL) */
+static
+int
+read_patch_edges(lua_State *L, int ugens, int outside, PatchEdge *edges)
+{
+	Node *node;
+	Edge *edge;
+	int i, n, count = 0;
+	PatchEdge patch_edge;
+	
+	n = lua_objlen(L, ugens);
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, ugens, i);
+		node = get_node(L, lua_gettop(L), 0);
+		lua_pop(L, 1);
+		if(node == NULL)
+			continue;
+		
+		for(edge = node->inputs; edge != NULL; edge = edge->next_input) {
+			if(edge->port < 0)
+				continue;
+			push_ugen(L, edge->source);
+			patch_edge.source = patch_index(L, lua_gettop(L), ugens, outside);
+			patch_edge.dest = i;
+			patch_edge.port = edge->port;
+			patch_edge.count = edge->count;
+			lua_pop(L, 1);
+			if(patch_edge.source != 0 && edges != NULL)
+				edges[count] = patch_edge;
+			count += patch_edge.source != 0;
+		}
+		
+		for(edge = node->outputs; edge != NULL; edge = edge->next_output) {
+			if(edge->port < 0)
+				continue;
+			push_ugen(L, edge->dest);
+			patch_edge.source = i;
+			patch_edge.dest = patch_index(L, lua_gettop(L), ugens, outside);
+			patch_edge.port = edge->port;
+			patch_edge.count = edge->count;
+			lua_pop(L, 1);
+			/* edges within the patch were read as inputs */
+			if(patch_edge.dest < 0 && edges != NULL)
+				edges[count] = patch_edge;
+			count += patch_edge.dest < 0;
+		}
+	}
+	
+	return count;
+}
+
+/* args: fn */
+static
+int
+ckv_patch(lua_State *L)
+{
+	Graph graph = get_graph(L);
+	PatchEdge *edges;
+	Node *node;
+	int ugens, outside, sinks, patch, status, count, i, n;
+	
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+	
+	/* record fn in a batch, to be rolled back once it's been read */
+	if(graph_begin(graph) < 0)
+		return luaL_error(L, "out of memory starting a graph batch");
+	
+	lua_getfield(L, LUA_REGISTRYINDEX, "ugen_recording"); /* 2: the enclosing patch's, if any */
+	lua_newtable(L);
+	ugens = lua_gettop(L);
+	lua_pushvalue(L, ugens);
+	lua_setfield(L, LUA_REGISTRYINDEX, "ugen_recording");
 	
-	lua_getfield(L, -1, "disconnect");
-	lua_pushvalue(L, -2); /* self */
 	lua_pushvalue(L, 1);
+	status = lua_pcall(L, 0, 2, 0); /* 4: output, 5: names */
+	
 	lua_pushvalue(L, 2);
-	lua_pushstring(L, port);
-	lua_call(L, 4, 0);
+	lua_setfield(L, LUA_REGISTRYINDEX, "ugen_recording");
+	
+	if(status != 0) {
+		graph_rollback(graph);
+		if(!graph_in_batch(graph))
+			settle_all(L);
+		return lua_error(L);
+	}
+	
+	lua_createtable(L, 0, 6);
+	patch = lua_gettop(L);
+	lua_newtable(L);
+	outside = lua_gettop(L);
+	lua_newtable(L);
+	sinks = lua_gettop(L);
+	
+	count = read_patch_edges(L, ugens, outside, NULL);
+	edges = (PatchEdge *)lua_newuserdata(L, sizeof(PatchEdge) * count);
+	read_patch_edges(L, ugens, outside, edges);
+	lua_setfield(L, patch, "edges");
+	
+	n = lua_objlen(L, ugens);
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, ugens, i);
+		node = get_node(L, lua_gettop(L), 0);
+		if(node != NULL && node->sink) {
+			lua_pushnumber(L, node->priority);
+			lua_rawseti(L, sinks, i);
+		}
+		lua_pop(L, 1);
+	}
+	
+	graph_rollback(graph);
+	if(!graph_in_batch(graph))
+		settle_all(L);
+	
+	/* the prototypes are left without edges, so they leave the graph */
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, ugens, i);
+		node = get_node(L, lua_gettop(L), 0);
+		if(node != NULL)
+			prune(L, node, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	
+	lua_pushnumber(L, patch_index(L, 4, ugens, outside));
+	lua_setfield(L, patch, "output");
+	
+	lua_newtable(L);
+	if(!lua_isnil(L, 5)) {
+		luaL_checktype(L, 5, LUA_TTABLE);
+		lua_pushnil(L);
+		while(lua_next(L, 5) != 0) {
+			lua_pushnumber(L, patch_index(L, lua_gettop(L), ugens, outside));
+			lua_replace(L, -2);
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, -4);
+		}
+	}
+	lua_setfield(L, patch, "names");
+	
+	lua_setfield(L, patch, "sinks");
+	lua_setfield(L, patch, "outside");
+	lua_pushvalue(L, ugens);
+	lua_setfield(L, patch, "ugens");
+	
+	luaL_getmetatable(L, PATCH_METATABLE);
+	lua_setmetatable(L, patch);
+	
+	return 1;
+}
+
+/* where patch:new() keeps ugen i (as in PatchEdge): the copies from first, then the outside ugens, backward, up to last */
+static
+int
+patch_slot(int i, int first, int last)
+{
+	return i > 0 ? first + i - 1 : last + 1 + i;
+}
+
+/* args: edges, sinks, n, then the n copies and the outside ugens (see patch_slot); connects the copies */
+static
+int
+patch_connect(lua_State *L)
+{
+	const PatchEdge *edges = (const PatchEdge *)lua_touserdata(L, 1);
+	int count = lua_objlen(L, 1) / sizeof(PatchEdge);
+	int first = 4, last = lua_gettop(L);
+	int i, j;
+	
+	for(i = 0; i < count; i++)
+		for(j = 0; j < edges[i].count; j++)
+			ugen_connect(L, patch_slot(edges[i].source, first, last), patch_slot(edges[i].dest, first, last), edges[i].port);
+	
+	lua_pushnil(L);
+	while(lua_next(L, 2) != 0) {
+		ugen_add_sink(L, first + lua_tointeger(L, -2) - 1, lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+	
+	return 0;
+}
+
+/* args: patch */
+static
+int
+ckv_patch_new(lua_State *L)
+{
+	Graph graph = get_graph(L);
+	UGen *original, *copy;
+	double *in;
+	int ugens, outside, first, last, i, j, n;
+	
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_getfield(L, 1, "ugens");
+	lua_getfield(L, 1, "outside");
+	lua_getfield(L, 1, "edges");
+	lua_getfield(L, 1, "sinks");
+	if(!lua_istable(L, 2) || !lua_istable(L, 3) || !lua_isuserdata(L, 4) || !lua_istable(L, 5))
+		return luaL_error(L, "new() expects a patch");
+	ugens = 2;
+	outside = 3;
+	
+	/* the copies go on the stack, followed by the outside ugens (see patch_slot), and then again as patch_connect's arguments */
+	n = lua_objlen(L, ugens);
+	luaL_checkstack(L, 2 * (n + lua_objlen(L, outside)) + 8, "too many ugens in a patch");
+	first = lua_gettop(L) + 1;
+	
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, ugens, i);
+		original = to_native(L, lua_gettop(L));
+		lua_pop(L, 1);
+		
+		copy = ugen_new_ports(L, original->cls, original->ports);
+		in = copy->in;
+		memcpy(copy, original, original->cls->size);
+		copy->in = in;
+		copy->copying = 1;
+	}
+	
+	for(i = 1; i <= n; i++) {
+		lua_rawgeti(L, ugens, i);
+		lua_pushnil(L);
+		while(lua_next(L, -2) != 0) {
+			if(lua_type(L, -2) == LUA_TSTRING && strcmp(lua_tostring(L, -2), "obj") == 0) {
+				lua_pop(L, 1);
+				continue;
+			}
+			
+			if(lua_istable(L, -1)) {
+				lua_pushvalue(L, -1);
+				lua_rawget(L, ugens);
+				j = lua_tointeger(L, -1);
+				lua_pop(L, 1);
+				if(j > 0) {
+					lua_pop(L, 1);
+					lua_pushvalue(L, first + j - 1);
+				}
+			}
+			
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, first + i - 1);
+		}
+		lua_pop(L, 1);
+	}
+	
+	for(i = 1; i <= n; i++) {
+		copy = to_native(L, first + i - 1);
+		copy->copying = 0;
+		if(copy->cls->copy != NULL)
+			copy->cls->copy(L, copy, first + i - 1);
+	}
+	
+	j = lua_objlen(L, outside);
+	for(i = j; i >= 1; i--)
+		lua_rawgeti(L, outside, i);
+	last = lua_gettop(L);
+	
+	/* connected in a batch, as graph_batch() would, so an error leaves the graph as it was */
+	if(graph_begin(graph) < 0)
+		return luaL_error(L, "out of memory starting a graph batch");
+	
+	lua_pushcfunction(L, patch_connect);
+	lua_pushvalue(L, 4);
+	lua_pushvalue(L, 5);
+	lua_pushnumber(L, n);
+	for(i = first; i <= last; i++)
+		lua_pushvalue(L, i);
+	if(lua_pcall(L, last - first + 4, 0, 0) != 0) {
+		graph_rollback(graph);
+		if(!graph_in_batch(graph))
+			settle_all(L);
+		return lua_error(L);
+	}
+	
+	graph_commit(graph);
+	
+	lua_getfield(L, 1, "output");
+	i = lua_tointeger(L, -1);
+	if(i != 0)
+		lua_pushvalue(L, patch_slot(i, first, last));
+	else
+		lua_pushnil(L);
+	
+	lua_newtable(L);
+	lua_getfield(L, 1, "names");
+	lua_pushnil(L);
+	while(lua_next(L, -2) != 0) {
+		i = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushvalue(L, patch_slot(i, first, last));
+		lua_rawset(L, -5);
+	}
+	lua_pop(L, 1);
+	
+	return 2;
+}
+
+/* SINKS */
+
+/* makes the ugen at (absolute) index a sink */
+void
+ugen_add_sink(lua_State *L, int index, double priority)
+{
+	Node *node = get_node(L, index, 1);
+	
+	if(graph_add_sink(get_graph(L), node, priority) < 0)
+		luaL_error(L, "out of memory adding a sink");
+	update_ref(L, node, index);
+}
+
+void
+ugen_remove_sink(lua_State *L, int index)
+{
+	Node *node = get_node(L, index, 0);
+	
+	if(node != NULL) {
+		graph_remove_sink(get_graph(L), node);
+		settle(L, node, index);
+	}
+}
+
+/* args: ugen, priority (sinks with lower priorities are pulled first; default 0) */
+static
+int
+ckv_add_sink(lua_State *L)
+{
+	lua_Number priority = luaL_optnumber(L, 2, 0);
+	
+	if(lua_type(L, 1) == LUA_TFUNCTION) {
+		lua_pushvalue(L, 1);
+		lua_call(L, 0, 1);
+		lua_replace(L, 1);
+	}
+	luaL_checktype(L, 1, LUA_TTABLE);
+	
+	ugen_add_sink(L, 1, priority);
+	
+	lua_pushvalue(L, 1);
+	return 1;
+}
+
+/* args: ugen */
+static
+int
+ckv_remove_sink(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	ugen_remove_sink(L, 1);
 	
 	return 0;
 }
@@ -152,101 +1312,59 @@ static
 void
 open_ugen_graph(lua_State *L)
 {
-	lua_createtable(L, 0 /* array */, 6 /* non-array */);
+	Graph *graph;
 	
-	lua_newtable(L);
-	lua_setfield(L, -2, "conns");
-	
-	(void) luaL_dostring(L,
-	"return function(self, source, dest, port) \n"
-	"  local conns = self.conns \n"
-	"  self.queue = nil \n"
-	"  if conns[dest] == nil then \n"
-	"    conns[dest] = {} \n"
-	"    conns[dest][port] = {} \n"
-	"    conns[dest][port][source] = 1 \n"
-	"  elseif conns[dest][port] == nil then \n"
-	"    conns[dest][port] = {} \n"
-	"    conns[dest][port][source] = 1 \n"
-	"  elseif conns[dest][port][source] == nil then \n"
-	"    conns[dest][port][source] = 1 \n"
-	"  else \n"
-	"    conns[dest][port][source] = conns[dest][port][source] + 1 \n"
-	"  end \n"
-	"end"
-	);
-	lua_setfield(L, -2, "connect");
-	
-	(void) luaL_dostring(L,
-	"return function(self, source, dest, port) \n"
-	"  local conns = self.conns \n"
-	"  self.queue = nil \n"
-	"  if conns[dest] and conns[dest][port] then \n"
-	"    local port = conns[dest][port] \n"
-	"    if port[source] and port[source] > 1 then \n"
-	"      port[source] = port[source] - 1 \n"
-	"    else \n"
-	"      port[source] = nil \n"
-	"    end \n"
-	"  end \n"
-	"end"
-	);
-	lua_setfield(L, -2, "disconnect");
-	
-	(void) luaL_dostring(L,
-	"return function(self, ugen) \n"
-	"  local conns = self.conns \n"
-	"  local inputs = {} \n"
-	"  if conns[ugen] then \n"
-	"    for port,iugens in pairs(conns[ugen]) do \n"
-	"      for iugen,count in pairs(iugens) do \n"
-	"        inputs[iugen] = count \n"
-	"      end \n"
-	"    end \n"
-	"  end \n"
-	"  return inputs \n"
-	"end"
-	);
-	lua_setfield(L, -2, "gather_inputs");
-	
-	(void) luaL_dostring(L,
-	"return function(self, sinks) \n"
-	"  local conns = self.conns \n"
-	"  local queue = {} \n"
-	"  local deduped = {} \n"
-	"  local seen = {} \n"
-	"  for k,ugen in pairs(sinks) do \n"
-	"    queue[#queue + 1] = ugen \n"
-	"  end \n"
-	"  for i,ugen in ipairs(queue) do \n"
-	"    for iugen,count in pairs(self:gather_inputs(ugen)) do \n"
-	"      queue[#queue + 1] = iugen \n"
-	"    end \n"
-	"  end \n"
-	"  for i = #queue, 1, -1 do \n"
-	"    if not seen[queue[i]] then \n"
-	"      deduped[#deduped + 1] = queue[i] \n"
-	"    end \n"
-	"    seen[queue[i]] = true \n"
-	"  end \n"
-	"  return deduped \n"
-	"end"
-	);
-	lua_setfield(L, -2, "create_ugen_queue");
-	
-	(void) luaL_dostring(L,
-	"return function(self, sinks) \n"
-	"  if not self.queue then \n"
-	"    self.queue = self:create_ugen_queue(sinks) \n"
-	"  end \n"
-	"  for i,ugen in ipairs(self.queue) do \n"
-	"    ugen:tick() \n"
-	"  end \n"
-	"end"
-	);
-	lua_setfield(L, -2, "tick_all");
+	/* the graph is a userdata so it is freed with the Lua state */
+	graph = (Graph *)lua_newuserdata(L, sizeof(Graph));
+	*graph = new_graph();
+	if(*graph == NULL) {
+		fprintf(stderr, "[ckv] memory error allocating the ugen graph\n");
+		exit(1);
+	}
+	
+	luaL_newmetatable(L, GRAPH_METATABLE);
+	lua_pushcfunction(L, ckv_graph_release);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
 	
 	lua_setfield(L, LUA_REGISTRYINDEX, "ugen_graph");
+	
+	/* ugen -> node handle, with weak keys */
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, "ugen_nodes");
+	
+	luaL_newmetatable(L, NODE_METATABLE);
+	lua_pushcfunction(L, ckv_node_release);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	
+	/* nodes to remove at the next tick */
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "ugen_garbage");
+	
+	/* port names of Lua ugens -> numbers (and numbers -> names) */
+	lua_newtable(L);
+	lua_pushnumber(L, DEFAULT_PORT);
+	lua_setfield(L, -2, "default");
+	lua_setfield(L, LUA_REGISTRYINDEX, "ugen_ports");
+	
+	/* patches, whose methods are looked up in the metatable */
+	luaL_newmetatable(L, PATCH_METATABLE);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, ckv_patch_new);
+	lua_setfield(L, -2, "new");
+	lua_pop(L, 1);
+	
+	/* native ugen structs */
+	luaL_newmetatable(L, UGEN_METATABLE);
+	lua_pushcfunction(L, ckv_ugen_release);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
 }
 
 /* opens ckv library */
@@ -255,6 +1373,8 @@ open_ckvugen(lua_State *L)
 {
 	lua_CFunction *fn;
 	
+	vmath_init();
+	
 	/* UGen */
 	lua_createtable(L, 0, 3 /* 3 functions in "UGen" */);
 	lua_pushcfunction(L, ckv_ugen_sum_inputs); lua_setfield(L, -2, "sum_inputs");
@@ -265,6 +1385,12 @@ open_ckvugen(lua_State *L)
 	lua_pushcfunction(L, ckv_connect); lua_setglobal(L, "c");
 	lua_pushcfunction(L, ckv_disconnect); lua_setglobal(L, "disconnect");
 	lua_pushcfunction(L, ckv_disconnect); lua_setglobal(L, "d");
+	lua_pushcfunction(L, ckv_graph_batch); lua_setglobal(L, "graph_batch");
+	lua_pushcfunction(L, ckv_patch); lua_setglobal(L, "Patch");
+	
+	/* sinks */
+	lua_pushcfunction(L, ckv_add_sink); lua_setglobal(L, "add_sink");
+	lua_pushcfunction(L, ckv_remove_sink); lua_setglobal(L, "remove_sink");
 	
 	open_ugen_graph(L);
 	
@@ -274,18 +1400,20 @@ open_ckvugen(lua_State *L)
 		lua_call(L, 0, 0);
 	}
 	
-	/* blackhole */
-	lua_getglobal(L, "Gain");
-	lua_call(L, 0, 1);
-	lua_setglobal(L, "blackhole");
-	
-	/* dac */
+	/* dac (pulled first) */
+	lua_pushcfunction(L, ckv_add_sink);
 	lua_getglobal(L, "Gain");
-	lua_call(L, 0, 1);
+	lua_call(L, 1, 1);
 	lua_pushvalue(L, -1); /* dup dac */
 	lua_setglobal(L, "dac"); /* pops one */
 	lua_setglobal(L, "speaker"); /* pops other */
 	
+	/* blackhole */
+	lua_pushcfunction(L, ckv_add_sink);
+	lua_getglobal(L, "Gain");
+	lua_call(L, 1, 1);
+	lua_setglobal(L, "blackhole");
+	
 	/* adc (microphone/audio input) */
 	lua_getglobal(L, "Step");
 	lua_call(L, 0, 1);
@@ -2,25 +2,132 @@
 #ifndef UGEN_H
 #define UGEN_H
 
+#include <stddef.h>
+
 #include "lua.h"
 #include "lualib.h"
 #include "lauxlib.h"
 
+/* ticks every ugen that a sink depends on, once */
+void ugen_tick_all(lua_State *L);
+
+/* sets the fields ramp() and automate() are moving for this sample (see automate.c); ugen_tick_all() calls it first */
+void automate_tick(lua_State *L);
+
+/*
+
+native unit generators.
+
+a native ugen is a Lua table like any other ugen, but its state is a
+C struct (in the table's "obj" field) that begins with a UGen, and
+the graph ticks it without calling into Lua. the fields its class
+lists (doubles in the struct, plus "last") are read and written from
+Lua as ugen.name.
+
+a ugen's inputs arrive on ports. every ugen has port 0, "default";
+a class can name more, which are numbered from 1 in the order given.
+connect(source, dest, "port") connects to a named port. before each
+tick, ugen->in[port] holds the sum of whatever is connected to it.
+by convention, a port with the same name as a field is added to it
+(connecting a SinOsc to another's "freq" port is FM, for example).
+
+a tick can set ugen->signal to wake the shreds waiting on the Event in
+the ugen's "event" field, right after this sample.
+
+a ugen with more than one output has an "output" method returning a
+ugen for each (numbered from 1); ugen[j] is short for ugen:output(j).
+ugen_push_output() makes those ugens, which keep their parent in a field
+and are listed in its "outputs" table: the parent's constructor makes
+that table, and its copy function makes the copy a new, empty one.
+
+a patch (see Patch() in ugen.c) copies native ugens: first the struct,
+byte for byte, then the table's fields. a class whose struct points at
+memory it owns, or at other ugens, needs a copy function to fix that up.
+a copy isn't released until its copy function has run, and that function
+must stop pointing at the original's memory before it can raise an error.
+
+*/
+
+typedef struct _UGen UGen;
+
+typedef struct _UGenField {
+	const char *name;
+	size_t offset; /* of a double in the class's struct */
+} UGenField;
+
+typedef struct _UGenClass {
+	const char *name;
+	size_t size; /* of the class's struct, which begins with a UGen */
+	const char *const *ports; /* named ports, NULL-terminated (or NULL for none) */
+	const UGenField *fields; /* terminated by a field with a NULL name (or NULL for none) */
+	const luaL_Reg *methods; /* called with the ugen table as self (or NULL for none) */
+	void (*tick)(UGen *ugen); /* sets ugen->last */
+	void (*release)(UGen *ugen); /* frees what the ugen owns (or NULL) */
+	void (*copy)(lua_State *L, UGen *ugen, int index); /* makes a byte-for-byte copy (the table at index) its own (or NULL) */
+} UGenClass;
+
+struct _UGen {
+	const UGenClass *cls;
+	double last;
+	double *in; /* the sum of each port's inputs for this tick */
+	int ports; /* how many entries there are in in, counting the default port */
+	double sample_rate;
+	int signal; /* set by tick to broadcast the ugen's "event" */
+	int copying; /* a patch's copy whose copy function hasn't run, so it isn't released */
+};
+
+/* pushes a new ugen table of class cls, returning its (zeroed) struct */
+UGen *ugen_new(lua_State *L, const UGenClass *cls);
+
+/* ... with the given number of ports, counting the default port; those past the class's named ones are only numbered */
+UGen *ugen_new_ports(lua_State *L, const UGenClass *cls, int ports);
+
+/* returns the struct of the ugen at index, raising an error if it isn't a cls */
+UGen *ugen_check(lua_State *L, int index, const UGenClass *cls);
+
+/* ... or NULL if it isn't a native ugen (of any class) */
+UGen *ugen_test(lua_State *L, int index);
+
+/* connects the ugen at (absolute) index source to port of the one at index dest */
+void ugen_connect(lua_State *L, int source, int dest, int port);
+
+/* like add_sink() and remove_sink(), for the ugen at (absolute) index */
+void ugen_add_sink(lua_State *L, int index, double priority);
+void ugen_remove_sink(lua_State *L, int index);
+
+/* returns output index (from 0) of a multi-output ugen, for its output ugens */
+typedef double (*UGenRead)(UGen *ugen, int index);
+
+/*
+pushes the ugen for output index of the one at (absolute) index self, making
+it the first time: it holds self in its field, and each tick it's read(self, index)
+*/
+void ugen_push_output(lua_State *L, int self, const char *field, int index, UGenRead read);
+
 /* standard unit generators */
 /* these functions add their respective
    unit generator constructors to the
    global namespace */
+int open_ugen_automate(lua_State *L);
+int open_ugen_convolver(lua_State *L);
 int open_ugen_delay(lua_State *L);
+int open_ugen_envelope(lua_State *L);
+int open_ugen_filter(lua_State *L);
 int open_ugen_follower(lua_State *L);
 int open_ugen_gain(lua_State *L);
 int open_ugen_impulse(lua_State *L);
+int open_ugen_mixer(lua_State *L);
 int open_ugen_noise(lua_State *L);
+int open_ugen_oscbank(lua_State *L);
 int open_ugen_pulseosc(lua_State *L);
 int open_ugen_sawosc(lua_State *L);
 int open_ugen_sinosc(lua_State *L);
 int open_ugen_sndin(lua_State *L);
+int open_ugen_sndout(lua_State *L);
+int open_ugen_spectrum(lua_State *L);
 int open_ugen_sqrosc(lua_State *L);
 int open_ugen_step(lua_State *L);
+int open_ugen_threshold(lua_State *L);
 int open_ugen_triosc(lua_State *L);
 
 /* custom unit generators */
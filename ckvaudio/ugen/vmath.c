@@ -0,0 +1,216 @@
+
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "vmath.h"
+
+/* adding then subtracting 1.5 * 2^52 rounds a double to the nearest
+   integer, which is left in the low bits of the sum */
+#define ROUND_MAGIC (6755399441055744.0)
+
+/* pi, split so that k * PI_A and k * PI_B are exact for the k that matter (Cephes) */
+#define PI_A (4 * 7.85398125648498535156E-1)
+#define PI_B (4 * 3.77489470793079817668E-8)
+#define PI_C (4 * 2.69515142907905952645E-15)
+
+/* ln(2), split the same way */
+#define LN2_HI (6.93145751953125E-1)
+#define LN2_LO (1.42860682030941723212E-6)
+
+#define EXP_MIN (-708.0)
+#define EXP_MAX (709.0)
+
+/* not every libm defines the M_ constants under -ansi */
+#define VM_1_PI (0.31830988618379067154)
+#define VM_LOG2E (1.4426950408889634074)
+#define VM_SQRT2 (1.41421356237309504880)
+#define VM_LN2 (0.69314718055994530942)
+#define VM_LN10 (2.30258509299404568402)
+#define VM_NAN (vm_nan.d)
+
+#define MANTISSA_BITS (__extension__ 0x000fffffffffffffULL)
+#define ONE_BITS (__extension__ 0x3ff0000000000000ULL)
+
+__extension__ typedef unsigned long long vm_u64;
+
+typedef union {
+	vm_u64 i;
+	double d;
+} Bits;
+
+static const Bits vm_nan = { __extension__ 0x7ff8000000000000ULL };
+
+void (*vmath_sin)(double *out, const double *in, int n);
+void (*vmath_cos)(double *out, const double *in, int n);
+void (*vmath_exp)(double *out, const double *in, int n);
+void (*vmath_log)(double *out, const double *in, int n);
+void (*vmath_pow)(double *out, const double *a, const double *b, int n);
+void (*vmath_tanh)(double *out, const double *in, int n);
+void (*vmath_mtof)(double *out, const double *in, int n);
+void (*vmath_dbtoa)(double *out, const double *in, int n);
+double (*vmath_dot)(const double *a, const double *b, int n);
+void (*vmath_cmac)(double *re, double *im, const double *ar, const double *ai, const double *br, const double *bi, int n);
+void (*vmath_svf)(double *out, const double *in, double *state, const double *coefs, int n);
+
+static const char *isa = "scalar";
+
+
+/* SCALAR */
+
+static vm_u64
+as_int(double d)
+{
+	Bits b;
+	b.d = d;
+	return b.i;
+}
+
+static double
+as_dbl(vm_u64 i)
+{
+	Bits b;
+	b.i = i;
+	return b.d;
+}
+
+#define V double
+#define VI vm_u64
+#define W 1
+#define TARGET
+#define NAME(f) f##_scalar
+#define SPLAT(c) (c)
+#define AS_INT(x) as_int(x)
+#define AS_DBL(x) as_dbl(x)
+#define MASK(c) (-(VI)(c))
+#define LOAD(x, p) ((x) = *(p))
+#define STORE(p, x) (*(p) = (x))
+
+#include "vmath_kernels.h"
+
+#undef V
+#undef VI
+#undef W
+#undef TARGET
+#undef NAME
+#undef SPLAT
+#undef AS_INT
+#undef AS_DBL
+#undef MASK
+#undef LOAD
+#undef STORE
+
+
+/* x86 SIMD, written with GCC vector extensions so there's one copy of each kernel */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+
+#define AS_INT(x) ((VI)(x))
+#define AS_DBL(x) ((V)(x))
+#define MASK(c) ((VI)(c))
+#define SPLAT(c) (NAME(zero) + (c))
+#define LOAD(x, p) memcpy(&(x), (p), sizeof(V))
+#define STORE(p, x) memcpy((p), &(x), sizeof(V))
+
+/* SSE4.1 */
+
+typedef double v2df __attribute__((vector_size(16)));
+typedef vm_u64 v2di __attribute__((vector_size(16)));
+
+#define V v2df
+#define VI v2di
+#define W 2
+#define TARGET __attribute__((target("sse4.1")))
+#define NAME(f) f##_sse41
+
+static const V NAME(zero);
+
+#include "vmath_kernels.h"
+
+#undef V
+#undef VI
+#undef W
+#undef TARGET
+#undef NAME
+
+/* AVX2 */
+
+typedef double v4df __attribute__((vector_size(32)));
+typedef vm_u64 v4di __attribute__((vector_size(32)));
+
+#define V v4df
+#define VI v4di
+#define W 4
+#define TARGET __attribute__((target("avx2,fma")))
+#define NAME(f) f##_avx2
+
+static const V NAME(zero);
+
+#include "vmath_kernels.h"
+
+#undef V
+#undef VI
+#undef W
+#undef TARGET
+#undef NAME
+
+#endif
+
+
+/* DISPATCH */
+
+void
+vmath_init(void)
+{
+	vmath_sin = sin_scalar;
+	vmath_cos = cos_scalar;
+	vmath_exp = exp_scalar;
+	vmath_log = log_scalar;
+	vmath_pow = pow_scalar;
+	vmath_tanh = tanh_scalar;
+	vmath_mtof = mtof_scalar;
+	vmath_dbtoa = dbtoa_scalar;
+	vmath_dot = dot_scalar;
+	vmath_cmac = cmac_scalar;
+	vmath_svf = svf_scalar;
+	isa = "scalar";
+
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		vmath_sin = sin_avx2;
+		vmath_cos = cos_avx2;
+		vmath_exp = exp_avx2;
+		vmath_log = log_avx2;
+		vmath_pow = pow_avx2;
+		vmath_tanh = tanh_avx2;
+		vmath_mtof = mtof_avx2;
+		vmath_dbtoa = dbtoa_avx2;
+		vmath_dot = dot_avx2;
+		vmath_cmac = cmac_avx2;
+		vmath_svf = svf_avx2;
+		isa = "avx2";
+	} else if(__builtin_cpu_supports("sse4.1")) {
+		vmath_sin = sin_sse41;
+		vmath_cos = cos_sse41;
+		vmath_exp = exp_sse41;
+		vmath_log = log_sse41;
+		vmath_pow = pow_sse41;
+		vmath_tanh = tanh_sse41;
+		vmath_mtof = mtof_sse41;
+		vmath_dbtoa = dbtoa_sse41;
+		vmath_dot = dot_sse41;
+		vmath_cmac = cmac_sse41;
+		vmath_svf = svf_sse41;
+		isa = "sse4.1";
+	}
+#endif
+}
+
+const char *
+vmath_isa(void)
+{
+	return isa;
+}
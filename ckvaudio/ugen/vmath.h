@@ -0,0 +1,58 @@
+
+#ifndef VMATH_H
+#define VMATH_H
+
+/*
+
+block math kernels for unit generators.
+
+each kernel computes out[i] = f(in[i]) for i in [0, n); out may be the
+same array as in. vmath_dot instead returns the sum of a[i] * b[i], and
+vmath_cmac and vmath_svf work on spectra and filter banks (see below).
+there are scalar, SSE4.1 and AVX2 versions of every kernel, and
+vmath_init() points these at the fastest one the CPU supports (it is
+called when the ugen library is opened).
+
+accuracy, measured against the C library over the ranges given:
+
+  vmath_sin, vmath_cos  |x| <= 2^20        abs error < 4e-16 * (1 + |x|)
+  vmath_exp             -708 <= x <= 709   rel error < 3e-16
+                        x < -708 gives 0; x > 709 saturates at exp(709)
+  vmath_log             x > 0              abs error < 2e-16 * (1 + |log x|)
+                        log(0) = -inf, log(x < 0) = NaN, subnormals handled
+  vmath_pow             a > 0              rel error < 3e-16 * (1 + |b log a|)
+                        a^0 = 1; 0^b = 0 for b > 0; a < 0 gives NaN
+  vmath_tanh            all x              abs error < 4e-16
+  vmath_mtof            -100 <= m <= 227   rel error < 3e-15
+  vmath_dbtoa           |db| <= 200        rel error < 6e-15
+
+*/
+
+void vmath_init(void);
+const char *vmath_isa(void); /* "avx2", "sse4.1" or "scalar" */
+
+extern void (*vmath_sin)(double *out, const double *in, int n);
+extern void (*vmath_cos)(double *out, const double *in, int n);
+extern void (*vmath_exp)(double *out, const double *in, int n);
+extern void (*vmath_log)(double *out, const double *in, int n);
+extern void (*vmath_pow)(double *out, const double *a, const double *b, int n); /* a^b */
+extern void (*vmath_tanh)(double *out, const double *in, int n);
+extern void (*vmath_mtof)(double *out, const double *in, int n); /* MIDI note to Hz (A4 = 69 = 440 Hz) */
+extern void (*vmath_dbtoa)(double *out, const double *in, int n); /* decibels to amplitude */
+extern double (*vmath_dot)(const double *a, const double *b, int n);
+
+/*
+complex multiply-accumulate over n bins of spectra kept as separate real
+and imaginary arrays (see fft.h): re + i im += (ar + i ai) * (br + i bi).
+*/
+extern void (*vmath_cmac)(double *re, double *im, const double *ar, const double *ai, const double *br, const double *bi, int n);
+
+/*
+one sample of n state-variable filters (Simper's trapezoidal SVF), for
+filter banks: filter i takes in[i] to out[i]. state holds each filter's
+ic1eq, then each one's ic2eq (2n doubles); coefs holds each one's a1,
+then a2, a3, m0, m1 and m2 (6n doubles). out may be the same as in.
+*/
+extern void (*vmath_svf)(double *out, const double *in, double *state, const double *coefs, int n);
+
+#endif
@@ -0,0 +1,414 @@
+
+/*
+
+the kernels in vmath.c, written once for any vector width.
+vmath.c includes this file once per instruction set after defining:
+
+  V, VI            a vector of W doubles, and of W unsigned 64-bit integers
+  W                the number of lanes
+  TARGET           the function attributes for this instruction set
+  NAME(f)          the name of kernel f for this instruction set
+  SPLAT(c)         a V with c in every lane
+  AS_INT, AS_DBL   reinterpret the bits of a V as a VI and back
+  MASK(c)          a VI of all ones where comparison c is true
+  LOAD, STORE      unaligned loads and stores of W doubles
+
+the scalar kernels (W = 1) are included first; the wider ones use
+them to finish off the last n % W elements.
+
+*/
+
+#define SELECT(m, a, b) AS_DBL((AS_INT(a) & (m)) | (AS_INT(b) & ~(m)))
+
+/* sin(x), reduced to r in [-pi/2, pi/2] with x = k pi + r */
+static TARGET V
+NAME(sin_v)(V x)
+{
+	V t, k, r, z, p;
+	VI sign;
+
+	t = x * VM_1_PI + ROUND_MAGIC;
+	k = t - ROUND_MAGIC;
+	sign = (AS_INT(t) & 1) << 63; /* sin(k pi + r) = (-1)^k sin(r) */
+
+	r = x - k * PI_A;
+	r = r - k * PI_B;
+	r = r - k * PI_C;
+
+	z = r * r;
+	p = SPLAT(-1.0 / 121645100408832000.0);
+	p = p * z + 1.0 / 355687428096000.0;
+	p = p * z - 1.0 / 1307674368000.0;
+	p = p * z + 1.0 / 6227020800.0;
+	p = p * z - 1.0 / 39916800.0;
+	p = p * z + 1.0 / 362880.0;
+	p = p * z - 1.0 / 5040.0;
+	p = p * z + 1.0 / 120.0;
+	p = p * z - 1.0 / 6.0;
+	p = r + r * z * p;
+
+	return AS_DBL(AS_INT(p) ^ sign);
+}
+
+/* cos(x) = -sin(x - pi/2), reusing the same reduction */
+static TARGET V
+NAME(cos_v)(V x)
+{
+	V t, k, r, z, p;
+	VI sign;
+
+	t = x * VM_1_PI - 0.5 + ROUND_MAGIC;
+	k = t - ROUND_MAGIC + 0.5; /* x = k pi + r, with k a half-integer */
+	sign = ((AS_INT(t) & 1) ^ 1) << 63;
+
+	r = x - k * PI_A;
+	r = r - k * PI_B;
+	r = r - k * PI_C;
+
+	z = r * r;
+	p = SPLAT(-1.0 / 121645100408832000.0);
+	p = p * z + 1.0 / 355687428096000.0;
+	p = p * z - 1.0 / 1307674368000.0;
+	p = p * z + 1.0 / 6227020800.0;
+	p = p * z - 1.0 / 39916800.0;
+	p = p * z + 1.0 / 362880.0;
+	p = p * z - 1.0 / 5040.0;
+	p = p * z + 1.0 / 120.0;
+	p = p * z - 1.0 / 6.0;
+	p = r + r * z * p;
+
+	return AS_DBL(AS_INT(p) ^ sign);
+}
+
+/* exp(x) = 2^k exp(r), with |r| <= ln(2)/2 */
+static TARGET V
+NAME(exp_v)(V x)
+{
+	V t, k, r, p, c;
+	VI underflow;
+
+	underflow = MASK(x < EXP_MIN);
+	c = SELECT(MASK(x > EXP_MAX), SPLAT(EXP_MAX), x);
+	c = SELECT(underflow, SPLAT(0.0), c);
+
+	t = c * VM_LOG2E + ROUND_MAGIC;
+	k = t - ROUND_MAGIC;
+
+	r = c - k * LN2_HI;
+	r = r - k * LN2_LO;
+
+	p = SPLAT(1.0 / 6227020800.0);
+	p = p * r + 1.0 / 479001600.0;
+	p = p * r + 1.0 / 39916800.0;
+	p = p * r + 1.0 / 3628800.0;
+	p = p * r + 1.0 / 362880.0;
+	p = p * r + 1.0 / 40320.0;
+	p = p * r + 1.0 / 5040.0;
+	p = p * r + 1.0 / 720.0;
+	p = p * r + 1.0 / 120.0;
+	p = p * r + 1.0 / 24.0;
+	p = p * r + 1.0 / 6.0;
+	p = p * r + 0.5;
+	p = p * r + 1.0;
+	p = p * r + 1.0;
+
+	/* scale by 2^k, building the double directly */
+	p = p * AS_DBL((AS_INT(t) - AS_INT(SPLAT(ROUND_MAGIC)) + 1023) << 52);
+
+	return AS_DBL(AS_INT(p) & ~underflow);
+}
+
+/* log(x) = e ln(2) + log(m), with m in [sqrt(1/2), sqrt(2)) */
+static TARGET V
+NAME(log_v)(V x)
+{
+	V m, e, f, s, z, p, r, scaled;
+	VI bits, subnormal, big;
+
+	/* bring subnormals into the normal range first */
+	subnormal = MASK(x < DBL_MIN);
+	scaled = SELECT(subnormal, x * 18014398509481984.0 /* 2^54 */, x);
+
+	bits = AS_INT(scaled);
+	m = AS_DBL((bits & MANTISSA_BITS) | ONE_BITS);
+
+	big = MASK(m > VM_SQRT2);
+	m = SELECT(big, m * 0.5, m);
+
+	/* the exponent, converted to a double by way of the rounding constant */
+	bits = ((bits >> 52) & 0x7ff) - 1023 - big - (subnormal & 54);
+	e = AS_DBL(bits + AS_INT(SPLAT(ROUND_MAGIC))) - ROUND_MAGIC;
+
+	f = m - 1.0;
+	s = f / (f + 2.0);
+	z = s * s;
+
+	p = SPLAT(1.0 / 19.0);
+	p = p * z + 1.0 / 17.0;
+	p = p * z + 1.0 / 15.0;
+	p = p * z + 1.0 / 13.0;
+	p = p * z + 1.0 / 11.0;
+	p = p * z + 1.0 / 9.0;
+	p = p * z + 1.0 / 7.0;
+	p = p * z + 1.0 / 5.0;
+	p = p * z + 1.0 / 3.0;
+	p = 2.0 * s + 2.0 * s * z * p;
+
+	r = e * LN2_HI + (p + e * LN2_LO);
+
+	/* log(inf) = inf, log(0) = -inf, log(negative or NaN) = NaN */
+	r = SELECT(MASK(x == x + x) & MASK(x > 0), x, r);
+	r = SELECT(MASK(x == 0), SPLAT(-HUGE_VAL), r);
+	r = SELECT(MASK(x >= 0), r, SPLAT(VM_NAN));
+
+	return r;
+}
+
+static TARGET V
+NAME(tanh_v)(V x)
+{
+	return 1.0 - 2.0 / (NAME(exp_v)(2.0 * x) + 1.0);
+}
+
+/* BLOCK KERNELS */
+
+#if W == 1
+#define TAIL(f, out, in, i, n)
+#define TAIL2(f, out, a, b, i, n)
+#else
+#define TAIL(f, out, in, i, n) for(; i < n; i++) out[i] = f##_v_scalar(in[i])
+#define TAIL2(f, out, a, b, i, n) for(; i < n; i++) out[i] = f##_v_scalar(a[i], b[i])
+#endif
+
+static TARGET void
+NAME(sin)(double *out, const double *in, int n)
+{
+	int i;
+	V x;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		x = NAME(sin_v)(x);
+		STORE(out + i, x);
+	}
+
+	TAIL(sin, out, in, i, n);
+}
+
+static TARGET void
+NAME(cos)(double *out, const double *in, int n)
+{
+	int i;
+	V x;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		x = NAME(cos_v)(x);
+		STORE(out + i, x);
+	}
+
+	TAIL(cos, out, in, i, n);
+}
+
+static TARGET void
+NAME(exp)(double *out, const double *in, int n)
+{
+	int i;
+	V x;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		x = NAME(exp_v)(x);
+		STORE(out + i, x);
+	}
+
+	TAIL(exp, out, in, i, n);
+}
+
+static TARGET void
+NAME(log)(double *out, const double *in, int n)
+{
+	int i;
+	V x;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		x = NAME(log_v)(x);
+		STORE(out + i, x);
+	}
+
+	TAIL(log, out, in, i, n);
+}
+
+static TARGET V
+NAME(pow_v)(V a, V b)
+{
+	V r = NAME(exp_v)(b * NAME(log_v)(a));
+
+	/* a^0 = 1 for every a, and 0^b = 0 for b > 0 */
+	r = SELECT(MASK(a == 0) & MASK(b > 0), SPLAT(0.0), r);
+	return SELECT(MASK(b == 0), SPLAT(1.0), r);
+}
+
+static TARGET void
+NAME(pow)(double *out, const double *a, const double *b, int n)
+{
+	int i;
+	V x, y;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, a + i);
+		LOAD(y, b + i);
+		x = NAME(pow_v)(x, y);
+		STORE(out + i, x);
+	}
+
+	TAIL2(pow, out, a, b, i, n);
+}
+
+static TARGET void
+NAME(tanh)(double *out, const double *in, int n)
+{
+	int i;
+	V x;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		x = NAME(tanh_v)(x);
+		STORE(out + i, x);
+	}
+
+	TAIL(tanh, out, in, i, n);
+}
+
+/* 440 * 2^((m - 69) / 12) */
+static TARGET void
+NAME(mtof)(double *out, const double *in, int n)
+{
+	int i;
+	V x;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		x = 440.0 * NAME(exp_v)((x - 69.0) * (VM_LN2 / 12.0));
+		STORE(out + i, x);
+	}
+
+	for(; i < n; i++)
+		out[i] = 440.0 * exp_v_scalar((in[i] - 69.0) * (VM_LN2 / 12.0));
+}
+
+/* 10^(db / 20) */
+static TARGET void
+NAME(dbtoa)(double *out, const double *in, int n)
+{
+	int i;
+	V x;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		x = NAME(exp_v)(x * (VM_LN10 / 20.0));
+		STORE(out + i, x);
+	}
+
+	for(; i < n; i++)
+		out[i] = exp_v_scalar(in[i] * (VM_LN10 / 20.0));
+}
+
+/* sum of a[i] * b[i] */
+static TARGET double
+NAME(dot)(const double *a, const double *b, int n)
+{
+	double lanes[W], sum = 0;
+	int i;
+	V x, y, acc = SPLAT(0.0);
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, a + i);
+		LOAD(y, b + i);
+		acc += x * y;
+	}
+
+	STORE(lanes, acc);
+	for(i = 0; i < W; i++)
+		sum += lanes[i];
+
+	for(i = n - n % W; i < n; i++)
+		sum += a[i] * b[i];
+
+	return sum;
+}
+
+/* re + i im += (ar + i ai) * (br + i bi), bin by bin */
+static TARGET void
+NAME(cmac)(double *re, double *im, const double *ar, const double *ai, const double *br, const double *bi, int n)
+{
+	int i;
+	V xr, xi, yr, yi, r, m;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(xr, ar + i);
+		LOAD(xi, ai + i);
+		LOAD(yr, br + i);
+		LOAD(yi, bi + i);
+		LOAD(r, re + i);
+		LOAD(m, im + i);
+		r = r + xr * yr - xi * yi;
+		m = m + xr * yi + xi * yr;
+		STORE(re + i, r);
+		STORE(im + i, m);
+	}
+
+	for(; i < n; i++) {
+		re[i] += ar[i] * br[i] - ai[i] * bi[i];
+		im[i] += ar[i] * bi[i] + ai[i] * br[i];
+	}
+}
+
+/* a sample of n of Simper's trapezoidal state-variable filters, side by side */
+static TARGET void
+NAME(svf)(double *out, const double *in, double *state, const double *coefs, int n)
+{
+	double *ic1 = state, *ic2 = state + n;
+	const double *a1 = coefs, *a2 = coefs + n, *a3 = coefs + 2 * n;
+	const double *m0 = coefs + 3 * n, *m1 = coefs + 4 * n, *m2 = coefs + 5 * n;
+	double v1s, v2s, v3s;
+	int i;
+	V x, s1, s2, c1, c2, c3, d0, d1, d2, v1, v2, v3;
+
+	for(i = 0; i + W <= n; i += W) {
+		LOAD(x, in + i);
+		LOAD(s1, ic1 + i);
+		LOAD(s2, ic2 + i);
+		LOAD(c1, a1 + i);
+		LOAD(c2, a2 + i);
+		LOAD(c3, a3 + i);
+		LOAD(d0, m0 + i);
+		LOAD(d1, m1 + i);
+		LOAD(d2, m2 + i);
+
+		v3 = x - s2;
+		v1 = c1 * s1 + c2 * v3;
+		v2 = s2 + c2 * s1 + c3 * v3;
+		s1 = 2.0 * v1 - s1;
+		s2 = 2.0 * v2 - s2;
+		x = d0 * x + d1 * v1 + d2 * v2;
+
+		STORE(ic1 + i, s1);
+		STORE(ic2 + i, s2);
+		STORE(out + i, x);
+	}
+
+	for(; i < n; i++) {
+		v3s = in[i] - ic2[i];
+		v1s = a1[i] * ic1[i] + a2[i] * v3s;
+		v2s = ic2[i] + a2[i] * ic1[i] + a3[i] * v3s;
+		ic1[i] = 2.0 * v1s - ic1[i];
+		ic2[i] = 2.0 * v2s - ic2[i];
+		out[i] = m0[i] * in[i] + m1[i] * v1s + m2[i] * v2s;
+	}
+}
+
+#undef TAIL
+#undef TAIL2
+#undef SELECT
@@ -4,6 +4,7 @@
 
 #include "ckvm.h"
 #include "pq.h"
+#include "alloc.h"
 
 
 /* BEGIN PRIVATE DECLARATIONS */
@@ -11,6 +12,8 @@
 #define GLOBAL_NAMESPACE "global"
 #define THREADS_TABLE "threads"
 #define ERROR_MESSAGE_BUFFER_SIZE (1024)
+#define EVENT_METATABLE "ckv_event"
+#define EVENT_QUEUE_RESERVE (16) /* waiting threads each reserved event can hold without growing */
 
 typedef struct _CKVM_Thread {
 	lua_State *L;
@@ -34,10 +37,13 @@ typedef struct _CKVM {
 	lua_State *L;
 	Thread main_thread; /* not a script; where audio processing happens */
 	ErrorCallback err_callback;
+	Pool thread_pool;
+	Pool event_pool; /* released events keep their queues, so reusing one doesn't allocate */
 } VM;
 
 /* scripts can wait on events to be triggered */
 typedef struct _Event {
+	VM *vm; /* overwritten while the event sits in the pool */
 	PQ waiting; /* ordered by the time at which the threads started waiting */
 } Event;
 
@@ -48,6 +54,7 @@ static int ckv_fork_eval(lua_State *L);
 static int ckv_yield(lua_State *L);
 static int ckv_event_broadcast(lua_State *L);
 static int ckv_event_new(lua_State *L);
+static int ckv_event_release(lua_State *L);
 static int open_ckv(lua_State *L);
 
 static Scheduler *new_scheduler(double now, double rate);
@@ -55,6 +62,12 @@ static void free_scheduler(Scheduler *scheduler);
 static int enqueue_thread(Scheduler *scheduler, double now, Thread *thread);
 static Scheduler *scheduler_with_next_thread(VM *vm);
 
+static Event *new_event(VM *vm);
+static void broadcast(Event *ev);
+static void free_event(Event *ev);
+static void free_pooled_event(void *item);
+static Event *to_event(lua_State *L, int index);
+
 static Thread *new_thread(VM *vm, lua_State *parentL);
 static void create_standalone_thread_env(Thread *thread);
 static void free_thread(Thread *thread);
@@ -100,6 +113,15 @@ terror(VM *vm, lua_State *L, const char *fmt, ...)
 	lua_pop(L, 2);
 }
 
+/* same as the panic function luaL_newstate() installs */
+static
+int
+panic(lua_State *L)
+{
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+	return 0;
+}
+
 CKVM
 ckvm_create(ErrorCallback err_callback)
 {
@@ -114,12 +136,26 @@ ckvm_create(ErrorCallback err_callback)
 		return NULL;
 	}
 	
-	vm->L = luaL_newstate();
+	vm->thread_pool = new_pool(sizeof(Thread), 0);
+	vm->event_pool = new_pool(sizeof(Event), 0);
+	if(vm->thread_pool == NULL || vm->event_pool == NULL) {
+		free_pool(vm->thread_pool);
+		free_pool(vm->event_pool);
+		free_scheduler(vm->scheduler);
+		free(vm);
+		return NULL;
+	}
+	
+	/* all Lua memory goes through ckv_lua_alloc so it can be audited */
+	vm->L = lua_newstate(ckv_lua_alloc, NULL);
 	if(vm->L == NULL) {
+		free_pool(vm->thread_pool);
+		free_pool(vm->event_pool);
 		free_scheduler(vm->scheduler);
 		free(vm);
 		return NULL;
 	}
+	lua_atpanic(vm->L, panic);
 	
 	vm->main_thread.vm = vm;
 	vm->main_thread.L = vm->L;
@@ -136,6 +172,12 @@ ckvm_create(ErrorCallback err_callback)
 	lua_newtable(vm->L);
 	lua_setfield(vm->L, LUA_REGISTRYINDEX, GLOBAL_NAMESPACE);
 	
+	/* events are collected like any other value */
+	luaL_newmetatable(vm->L, EVENT_METATABLE);
+	lua_pushcfunction(vm->L, ckv_event_release);
+	lua_setfield(vm->L, -2, "__gc");
+	lua_pop(vm->L, 1);
+	
 	/* create a table for storing lua thread references */
 	lua_pushstring(vm->L, THREADS_TABLE);
 	lua_newtable(vm->L);
@@ -165,9 +207,44 @@ ckvm_destroy(CKVM vm)
 		scheduler = next;
 	}
 	
+	/* after lua_close, which hands every event back to its pool (with its queue) */
+	pool_foreach_free(vm->event_pool, free_pooled_event);
+	free_pool(vm->thread_pool);
+	free_pool(vm->event_pool);
+	
 	free(vm);
 }
 
+int
+ckvm_reserve(CKVM vm, int count)
+{
+	int i, ok = 1;
+	Event **events;
+	
+	if(!pool_reserve(vm->thread_pool, count) || !queue_reserve(vm->scheduler->queue, count))
+		return 0;
+	
+	/* take count events (allocating any queues they lack), then put them all back */
+	events = (Event **)malloc(sizeof(Event *) * count);
+	if(events == NULL)
+		return 0;
+	
+	for(i = 0; i < count; i++) {
+		events[i] = new_event(vm);
+		if(events[i] == NULL || !queue_reserve(events[i]->waiting, EVENT_QUEUE_RESERVE)) {
+			ok = 0;
+			break;
+		}
+	}
+	
+	while(i-- > 0)
+		free_event(events[i]);
+	
+	free(events);
+	
+	return ok;
+}
+
 lua_State *
 ckvm_global_state(CKVM vm)
 {
@@ -262,6 +339,8 @@ ckvm_remove_thread(CKVM_Thread thread)
 	lua_pushnil(vm->L);
 	lua_settable(vm->L, -3);
 	lua_pop(vm->L, 1); /* pop THREADS_TABLE */
+	
+	free_thread(thread);
 }
 
 CKVM_Thread
@@ -439,7 +518,7 @@ ckv_fork(lua_State *L)
 	
 	if(!enqueue_thread(parent->vm->scheduler, parent->vm->scheduler->now, thread)) {
 		terror(parent->vm, parent->L, "could not enqueue child thread");
-		free_thread(thread);
+		ckvm_remove_thread(thread);
 	}
 	
 	return 0;
@@ -462,11 +541,11 @@ ckv_fork_eval(lua_State *L)
 	switch(luaL_loadstring(thread->L, code)) {
 	case LUA_ERRSYNTAX:
 		terror(parent->vm, parent->L, "could not create thread: %s", lua_tostring(thread->L, -1));
-		free(thread);
+		ckvm_remove_thread(thread);
 		break;
 	case LUA_ERRMEM:
 		terror(parent->vm, parent->L, "could not create thread: memory allocation error");
-		free(thread);
+		ckvm_remove_thread(thread);
 		break;
 	default:
 		if(!enqueue_thread(parent->vm->scheduler, parent->vm->scheduler->now, thread))
@@ -494,27 +573,21 @@ static
 int
 ckv_event_broadcast(lua_State *L)
 {
-	double now;
 	Event *ev;
 	
 	/* check arguments */
 	/* first arg to event.broadcast() is event */
 	luaL_checktype(L, 1, LUA_TTABLE); /* event */
 	
-	now = ckvm_get_thread(L)->vm->scheduler->now;
-	
 	/* get event.obj */
 	lua_getfield(L, 1, "obj");
-	ev = (Event *)lua_touserdata(L, -1);
+	ev = to_event(L, -1);
 	lua_pop(L, 1);
 	
-	/* enqueue all threads waiting on this event */
-	while(!queue_empty(ev->waiting)) {
-		Thread *thread = (Thread *)remove_queue_min(ev->waiting);
-		if(!enqueue_thread(thread->vm->scheduler, thread->vm->scheduler->now, thread))
-			terror(thread->vm, thread->L, "could not insert woken thread into scheduler");
-		thread->vm->num_sleeping_threads--;
-	}
+	if(ev == NULL)
+		return luaL_error(L, "broadcast() expects an event");
+	
+	broadcast(ev);
 	
 	return 0;
 }
@@ -523,37 +596,69 @@ static
 int
 ckv_event_new(lua_State *L)
 {
-	Event *ev;
-	
 	/* check arguments */
 	luaL_checktype(L, 1, LUA_TTABLE); /* Event */
 	
-	ev = (Event *)malloc(sizeof(struct _Event));
-	if(ev == NULL) {
-		lua_pushnil(L);
-		return 1;
-	}
+	ckvm_push_new_event(L);
+	return 1;
+}
+
+void
+ckvm_push_new_event(lua_State *L)
+{
+	Event *ev;
+	Event **box;
 	
-	ev->waiting = new_queue(1);
-	if(ev->waiting == NULL) {
-		free(ev);
+	ev = new_event(ckvm_get_thread(L)->vm);
+	if(ev == NULL) {
 		lua_pushnil(L);
-		return 1;
+		return;
 	}
 	
 	/* our new_event object */
 	lua_createtable(L, 0 /* array items */, 1 /* non-array items */);
 	
-	/* event["obj"] = ev */
+	/* event["obj"] = ev (boxed, so the event goes back to the pool when collected) */
 	lua_pushstring(L, "obj");
-	lua_pushlightuserdata(L, ev);
+	box = (Event **)lua_newuserdata(L, sizeof(Event *));
+	*box = ev;
+	luaL_getmetatable(L, EVENT_METATABLE);
+	lua_setmetatable(L, -2);
 	lua_rawset(L, -3);
 	
 	/* event["broadcast"] = ckv_event_broadcast */
 	lua_pushcfunction(L, ckv_event_broadcast);
 	lua_setfield(L, -2, "broadcast");
+}
+
+void
+ckvm_broadcast(lua_State *L, int index)
+{
+	Event *ev = NULL;
 	
-	return 1;
+	if(lua_istable(L, index)) {
+		lua_getfield(L, index, "obj");
+		ev = to_event(L, -1);
+		lua_pop(L, 1);
+	}
+	
+	if(ev != NULL)
+		broadcast(ev);
+}
+
+/* args: boxed event */
+static
+int
+ckv_event_release(lua_State *L)
+{
+	Event **box = (Event **)lua_touserdata(L, 1);
+	
+	if(*box != NULL) {
+		free_event(*box);
+		*box = NULL;
+	}
+	
+	return 0;
 }
 
 /* adds ckv functions to given L */
@@ -610,7 +715,7 @@ static
 void
 free_scheduler(Scheduler *scheduler)
 {
-	free(scheduler->queue);
+	free_queue(scheduler->queue);
 	free(scheduler);
 }
 
@@ -646,6 +751,79 @@ scheduler_with_next_thread(VM *vm)
 	return earliest_scheduler;
 }
 
+/* events come from the vm's pool; a pooled event may still have its queue */
+static
+Event *
+new_event(VM *vm)
+{
+	Event *ev = (Event *)pool_alloc(vm->event_pool);
+	if(ev == NULL)
+		return NULL;
+	
+	if(ev->waiting == NULL)
+		ev->waiting = new_queue(1);
+	
+	if(ev->waiting == NULL) {
+		pool_free(vm->event_pool, ev);
+		return NULL;
+	}
+	
+	ev->vm = vm;
+	
+	return ev;
+}
+
+/* wakes all threads waiting on the event */
+static
+void
+broadcast(Event *ev)
+{
+	Thread *thread;
+	
+	while(!queue_empty(ev->waiting)) {
+		thread = (Thread *)remove_queue_min(ev->waiting);
+		if(!enqueue_thread(thread->vm->scheduler, thread->vm->scheduler->now, thread))
+			terror(thread->vm, thread->L, "could not insert woken thread into scheduler");
+		thread->vm->num_sleeping_threads--;
+	}
+}
+
+static
+void
+free_event(Event *ev)
+{
+	/* a collected event has no waiting threads (they would reference it) */
+	pool_free(ev->vm->event_pool, ev);
+}
+
+/* frees the queue a pooled event keeps, when the pool is freed */
+static
+void
+free_pooled_event(void *item)
+{
+	free_queue(((Event *)item)->waiting);
+}
+
+/* returns the event boxed at the given stack index, or NULL if it isn't one */
+static
+Event *
+to_event(lua_State *L, int index)
+{
+	int is_event;
+	
+	if(index < 0)
+		index = lua_gettop(L) + index + 1;
+	
+	if(!lua_getmetatable(L, index))
+		return NULL;
+	
+	luaL_getmetatable(L, EVENT_METATABLE);
+	is_event = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	
+	return is_event ? *(Event **)lua_touserdata(L, index) : NULL;
+}
+
 static
 Thread *
 new_thread(VM *vm, lua_State *parentL)
@@ -653,7 +831,7 @@ new_thread(VM *vm, lua_State *parentL)
 	lua_State *L; /* new thread state */
 	Thread *thread;
 	
-	thread = (Thread *)malloc(sizeof(Thread));
+	thread = (Thread *)pool_alloc(vm->thread_pool);
 	if(!thread)
 		return NULL;
 	
@@ -709,7 +887,7 @@ static
 void
 free_thread(Thread *thread)
 {
-	free(thread);
+	pool_free(thread->vm->thread_pool, thread);
 }
 
 static
@@ -749,7 +927,7 @@ yield_on_event(CKVM vm, Thread *thread)
 	
 	lua_pushstring(thread->L, "obj");
 	lua_rawget(thread->L, 1);
-	ev = (Event *)lua_touserdata(thread->L, -1);
+	ev = to_event(thread->L, -1);
 	lua_pop(thread->L, 1);
 	
 	if(ev == NULL) {
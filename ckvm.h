@@ -20,6 +20,7 @@ typedef void (*ErrorCallback)(CKVM vm, const char *message); /* callback type fo
 
 CKVM ckvm_create(ErrorCallback err_callback);
 void ckvm_destroy(CKVM vm);
+int ckvm_reserve(CKVM vm, int count); /* pre-allocates room for count threads and events so running them doesn't allocate; returns 0 on failure */
 
 lua_State *ckvm_global_state(CKVM vm); /* get ckvm's global lua state */
 
@@ -37,6 +38,9 @@ int ckvm_running(CKVM vm); /* is the vm running? */
 
 void ckvm_pushstdglobal(lua_State *L, const char *name); /* fetches the VM-global with the given name and pushes it on L's stack */
 
+void ckvm_push_new_event(lua_State *L); /* pushes a new Event (or nil if out of memory) */
+void ckvm_broadcast(lua_State *L, int index); /* wakes the threads waiting on the Event at index (if it is one) */
+
 void ckvm_push_new_scheduler(lua_State *L, double rate); /* pushes a scheduler with the given rate onto L's stack */
 int ckvm_set_scheduler_rate(lua_State *L, int stack_index, double rate); /* sets the rate of the scheduler at the given stack position; returns a positive value if successful */
 double ckvm_get_scheduler_rate(lua_State *L, int stack_index); /* gets the rate of the scheduler at the given stack index */
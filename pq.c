@@ -2,6 +2,7 @@
 #include <stdlib.h>
 
 #include "pq.h"
+#include "alloc.h"
 
 typedef struct {
 	double priority;
@@ -14,6 +15,7 @@ struct _PQ {
 	PQItem *items; /* stored starting at index 1 */
 };
 
+static int resize(PQ q, int capacity);
 static void exchange(PQ q, int i, int j);
 static void swim(PQ q, int k);
 static void sink(PQ q, int k);
@@ -21,15 +23,15 @@ static void sink(PQ q, int k);
 PQ
 new_queue(int capacity)
 {
-	PQ q = (PQ)malloc(sizeof(struct _PQ));
+	PQ q = (PQ)ckv_malloc(sizeof(struct _PQ));
 	
 	if(q == NULL)
 		return NULL;
 	
-	q->items = (PQItem *)malloc(sizeof(PQItem) * (capacity + 1));
+	q->items = (PQItem *)ckv_malloc(sizeof(PQItem) * (capacity + 1));
 	
 	if(q->items == NULL) {
-		free(q);
+		ckv_free(q);
 		return NULL;
 	}
 	
@@ -43,33 +45,27 @@ void
 free_queue(PQ q)
 {
 	if(q) {
-		free(q->items);
-		free(q);
+		ckv_free(q->items);
+		ckv_free(q);
 	}
 }
 
+/* returns 0 if the queue could not be resized */
+int
+queue_reserve(PQ q, int capacity)
+{
+	if(capacity <= q->capacity)
+		return 1;
+	
+	return resize(q, capacity);
+}
+
 /* returns 0 if the queue is full and could not be resized */
 int
 queue_insert(PQ q, double priority, void *data)
 {
-	int i;
-	
-	if(q->count == q->capacity) {
-		int new_capacity = q->capacity == 0 ? 1 : q->capacity * 2;
-		
-		PQItem *new_items = (PQItem *)malloc(sizeof(PQItem) * (new_capacity + 1));
-		
-		if(new_items == NULL)
-			return 0;
-		
-		for(i = 1; i <= q->count; i++)
-			new_items[i] = q->items[i];
-		
-		free(q->items);
-		
-		q->items = new_items;
-		q->capacity = new_capacity;
-	}
+	if(q->count == q->capacity && !resize(q, q->capacity == 0 ? 1 : q->capacity * 2))
+		return 0;
 	
 	q->count++;
 	q->items[q->count].priority = priority;
@@ -142,6 +138,27 @@ queue_count(PQ q)
 
 /* PRIVATE HELPERS */
 
+static
+int
+resize(PQ q, int capacity)
+{
+	int i;
+	PQItem *new_items = (PQItem *)ckv_malloc(sizeof(PQItem) * (capacity + 1));
+	
+	if(new_items == NULL)
+		return 0;
+	
+	for(i = 1; i <= q->count; i++)
+		new_items[i] = q->items[i];
+	
+	ckv_free(q->items);
+	
+	q->items = new_items;
+	q->capacity = capacity;
+	
+	return 1;
+}
+
 #define MORE(i, j) (q->items[j].floats || (q->items[i].priority > q->items[j].priority))
 
 static
@@ -7,6 +7,7 @@ typedef struct _PQ *PQ;
 
 PQ new_queue(int capacity);
 void free_queue(PQ q);
+int queue_reserve(PQ q, int capacity); /* grows the queue so capacity items fit without resizing; returns 0 on failure */
 
 /* modifying the queue */
 int queue_insert(PQ q, double priority, void *data); /* returns 0 if the queue could not be resized */